@@ -0,0 +1,204 @@
+/*
+ * IMCIMVBench.c
+ *
+ * IMCIMVTester Benchmark Statistics
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "IMCIMVBench.h"
+#include "output.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static const char *g_pszPhaseNames[ BENCH_PHASE_COUNT ] =
+{
+    "Initialize", "BeginHandshake", "Batch to IMV", "Batch to IMC", 
+    "SolicitRecommendation", "Delete", "Full handshake"
+};
+
+BENCH_TIME BenchClock(void)
+{
+#ifdef WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if( 0 == freq.QuadPart )
+        QueryPerformanceFrequency( &freq );
+
+    QueryPerformanceCounter( &now );
+    return (BENCH_TIME) ((double) now.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (BENCH_TIME) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static unsigned BenchBucket(BENCH_TIME value)
+{
+    unsigned msb = 0;
+    BENCH_TIME v;
+
+    if( value < BENCH_SUB_BUCKETS )
+        return (unsigned) value;
+
+    for( v = value; v > 1; v >>= 1 )
+        ++msb;
+
+    return (msb - BENCH_SUB_BITS + 1) * BENCH_SUB_BUCKETS
+        + (unsigned) ((value >> (msb - BENCH_SUB_BITS)) & (BENCH_SUB_BUCKETS - 1));
+}
+
+/* Midpoint of the values that fall into 'bucket' */
+static BENCH_TIME BenchBucketValue(unsigned bucket)
+{
+    unsigned shift;
+
+    if( bucket < BENCH_SUB_BUCKETS )
+        return bucket;
+
+    shift = bucket / BENCH_SUB_BUCKETS - 1;
+    return ((BENCH_TIME) (BENCH_SUB_BUCKETS + bucket % BENCH_SUB_BUCKETS) << shift)
+        + (((BENCH_TIME) 1 << shift) >> 1);
+}
+
+static BENCH_TIME BenchPercentile(const BENCH_HISTOGRAM *h, double percentile)
+{
+    unsigned long long rank, seen = 0;
+    unsigned i;
+
+    if( 0 == h->count )
+        return 0;
+
+    rank = (unsigned long long) (percentile / 100.0 * (double) h->count + 0.5);
+    if( rank < 1 )
+        rank = 1;
+
+    for( i = 0; i < BENCH_BUCKETS; ++i )
+    {
+        seen += h->buckets[ i ];
+        if( seen >= rank )
+            break;
+    }
+
+    /* The bucket midpoint may lie outside what was actually observed */
+    if( BenchBucketValue( i ) < h->min )
+        return h->min;
+    if( BenchBucketValue( i ) > h->max )
+        return h->max;
+    return BenchBucketValue( i );
+}
+
+void BenchInit(BENCH_STATS *stats)
+{
+    memset( stats, 0, sizeof( *stats ) );
+}
+
+void BenchRecord(BENCH_STATS *stats, eBENCH_PHASE phase, BENCH_TIME elapsed)
+{
+    BENCH_HISTOGRAM *h = &stats->phases[ phase ];
+
+    if( 0 == h->count || elapsed < h->min )
+        h->min = elapsed;
+    if( elapsed > h->max )
+        h->max = elapsed;
+
+    h->sum += elapsed;
+    ++h->count;
+    ++h->buckets[ BenchBucket( elapsed ) ];
+}
+
+void BenchMerge(BENCH_STATS *dst, const BENCH_STATS *src)
+{
+    BENCH_HISTOGRAM *d;
+    const BENCH_HISTOGRAM *s;
+    unsigned i, j;
+
+    dst->nHandshakes += src->nHandshakes;
+    dst->nBatches += src->nBatches;
+
+    for( i = 0; i < BENCH_PHASE_COUNT; ++i )
+    {
+        d = &dst->phases[ i ];
+        s = &src->phases[ i ];
+        if( 0 == s->count )
+            continue;
+
+        if( 0 == d->count || s->min < d->min )
+            d->min = s->min;
+        if( s->max > d->max )
+            d->max = s->max;
+
+        d->count += s->count;
+        d->sum += s->sum;
+        for( j = 0; j < BENCH_BUCKETS; ++j )
+            d->buckets[ j ] += s->buckets[ j ];
+    }
+}
+
+void BenchReport(const BENCH_STATS *stats, BENCH_TIME elapsed)
+{
+    const double seconds = (double) elapsed / 1e9;
+    const BENCH_HISTOGRAM *h;
+    unsigned i;
+
+    outfmt( OUT_LEVEL_SUMMARY, "\nBenchmark: %llu handshakes in %.3f s, %.1f handshakes/sec, %.2f batches per handshake\n",
+        stats->nHandshakes, seconds, 
+        seconds > 0 ? (double) stats->nHandshakes / seconds : 0.0,
+        stats->nHandshakes ? (double) stats->nBatches / (double) stats->nHandshakes : 0.0 );
+
+    outfmt( OUT_LEVEL_SUMMARY, "%-22s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+        "Latency (usec)", "count", "min", "mean", "p50", "p90", "p99", "p99.9", "max" );
+
+    for( i = 0; i < BENCH_PHASE_COUNT; ++i )
+    {
+        h = &stats->phases[ i ];
+        if( 0 == h->count )
+            continue;
+
+        outfmt( OUT_LEVEL_SUMMARY, "%-22s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            g_pszPhaseNames[ i ], h->count, 
+            (double) h->min / 1e3, 
+            (double) h->sum / (double) h->count / 1e3,
+            (double) BenchPercentile( h, 50.0 ) / 1e3,
+            (double) BenchPercentile( h, 90.0 ) / 1e3,
+            (double) BenchPercentile( h, 99.0 ) / 1e3,
+            (double) BenchPercentile( h, 99.9 ) / 1e3,
+            (double) h->max / 1e3 );
+    }
+}
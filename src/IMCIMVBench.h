@@ -0,0 +1,91 @@
+/*
+ * IMCIMVBench.h
+ *
+ * Header file for IMCIMVTester Benchmark Statistics
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _IMCIMVBENCH_H
+#define _IMCIMVBENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Phases of a handshake whose latency is measured in benchmark mode */
+typedef enum eBENCH_PHASE_tag
+{
+    BENCH_PHASE_INITIALIZE,
+    BENCH_PHASE_BEGIN_HANDSHAKE,
+    BENCH_PHASE_DELIVER_IMV,
+    BENCH_PHASE_DELIVER_IMC,
+    BENCH_PHASE_RECOMMENDATION,
+    BENCH_PHASE_DELETE,
+    BENCH_PHASE_HANDSHAKE,
+    BENCH_PHASE_COUNT
+} eBENCH_PHASE;
+
+/* Latencies are kept in a log-linear histogram: every power of two is split
+   into BENCH_SUB_BUCKETS linear buckets, which bounds the relative error of
+   a reported percentile to about 1/BENCH_SUB_BUCKETS at any magnitude. */
+#define BENCH_SUB_BITS      4
+#define BENCH_SUB_BUCKETS   (1 << BENCH_SUB_BITS)
+#define BENCH_BUCKETS       ((64 - BENCH_SUB_BITS + 1) * BENCH_SUB_BUCKETS)
+
+typedef unsigned long long BENCH_TIME;
+
+typedef struct BENCH_HISTOGRAM_tag
+{
+    unsigned long long count;
+    BENCH_TIME min, max, sum;
+    unsigned long long buckets[ BENCH_BUCKETS ];
+} BENCH_HISTOGRAM;
+
+typedef struct BENCH_STATS_tag
+{
+    unsigned long long nHandshakes;
+    unsigned long long nBatches;
+    BENCH_HISTOGRAM phases[ BENCH_PHASE_COUNT ];
+} BENCH_STATS;
+
+/* Monotonic time in nanoseconds */
+BENCH_TIME BenchClock(void);
+
+void BenchInit(BENCH_STATS *stats);
+void BenchRecord(BENCH_STATS *stats, eBENCH_PHASE phase, BENCH_TIME elapsed);
+void BenchMerge(BENCH_STATS *dst, const BENCH_STATS *src);
+void BenchReport(const BENCH_STATS *stats, BENCH_TIME elapsed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
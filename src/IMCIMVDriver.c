@@ -0,0 +1,725 @@
+/*
+ * IMCIMVDriver.c
+ *
+ * IMCIMVTester Handshake Driver
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "IMCIMVDriver.h"
+#include "IMCIMVTester.h"
+#include "IMCIMVTNCC.h"
+#include "IMCIMVTNCS.h"
+#include "msgqueue.h"
+#include "output.h"
+#include "tncthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern char *g_pszConnStates[];
+
+void HandshakeInit(CONNECTION *conn, TNC_ConnectionID cid)
+{
+    memset( conn, 0, sizeof( *conn ) );
+    conn->cid = cid;
+    conn->step = CONN_STEP_CREATE;
+    conn->state = TNC_CONNECTION_STATE_CREATE;
+}
+
+/* Batch pipelining
+ *
+ * Normally a batch is delivered to one side, that side's BatchEnding is
+ * called, and only then does the other side get to see the replies. When
+ * pipelining, a helper thread delivers the replies sent so far to the other
+ * side while the first side is still receiving its batch or ending it. What
+ * is left when the first side is done is delivered, together with the
+ * BatchEnding, in the next step.
+ *
+ * A worker thread has one helper for all the batches it delivers, as does a
+ * handshake run by RunHandshake. While a batch is being delivered the helper watches the queue the replies
+ * go to, and sleeps until a sender tells it there is something to take.
+ */
+
+typedef struct PIPELINE_tag
+{
+    TNC_THREAD thread;
+    TNC_MUTEX lock;                 /* Guards the fields below */
+    TNC_COND sent;                  /* Replies were sent, or the helper is to stop */
+    TNC_COND idle;                  /* The helper is done delivering */
+    QUEUE_WATCH watch;
+    TNC_ConnectionID cid;
+    unsigned direction;             /* Where the replies go */
+    unsigned bActive;               /* A batch is being delivered */
+    unsigned bSent;                 /* Replies were sent since the helper last looked */
+    unsigned bBusy;                 /* The helper is delivering replies */
+    unsigned bStop;
+    unsigned nDelivered;            /* Times replies were delivered early */
+} PIPELINE;
+
+static void PipelineNotify(void *context)
+{
+    PIPELINE *pipeline = (PIPELINE *) context;
+
+    MutexLock( &pipeline->lock );
+    pipeline->bSent = 1;
+    CondSignal( &pipeline->sent );
+    MutexUnlock( &pipeline->lock );
+}
+
+static void PipelineWorker(void *arg)
+{
+    PIPELINE *pipeline = (PIPELINE *) arg;
+    TNC_ConnectionID cid;
+    unsigned direction, bDelivered;
+
+    MutexLock( &pipeline->lock );
+    while( !pipeline->bStop )
+    {
+        if( !pipeline->bActive || !pipeline->bSent )
+        {
+            CondWait( &pipeline->sent, &pipeline->lock );
+            continue;
+        }
+
+        pipeline->bSent = 0;
+        pipeline->bBusy = 1;
+        cid = pipeline->cid;
+        direction = pipeline->direction;
+        MutexUnlock( &pipeline->lock );
+
+        /* A sender of the last batch may have notified us late, so there
+           may be nothing to take */
+        bDelivered = !IsQueueEmpty( cid, direction );
+        if( bDelivered )
+        {
+            QueueTakeMessages( cid, direction );
+            if( QUEUE_TO_IMC == direction )
+                DeliverImcMessages( cid );
+            else
+                ImvDeliverPipelined( cid );
+        }
+
+        MutexLock( &pipeline->lock );
+        pipeline->nDelivered += bDelivered;
+        pipeline->bBusy = 0;
+        CondSignal( &pipeline->idle );
+    }
+    MutexUnlock( &pipeline->lock );
+}
+
+/* Start the pipeline helper of a thread; returns 0 on success */
+static int PipelineStart(PIPELINE *pipeline)
+{
+    int err;
+
+    memset( pipeline, 0, sizeof( *pipeline ) );
+    MutexInit( &pipeline->lock );
+    CondInit( &pipeline->sent );
+    CondInit( &pipeline->idle );
+    pipeline->watch.pfnNotify = PipelineNotify;
+    pipeline->watch.context = pipeline;
+
+    err = ThreadCreate( &pipeline->thread, PipelineWorker, pipeline );
+    if( 0 != err )
+    {
+        CondDestroy( &pipeline->idle );
+        CondDestroy( &pipeline->sent );
+        MutexDestroy( &pipeline->lock );
+    }
+
+    return err;
+}
+
+static void PipelineStop(PIPELINE *pipeline)
+{
+    MutexLock( &pipeline->lock );
+    pipeline->bStop = 1;
+    CondSignal( &pipeline->sent );
+    MutexUnlock( &pipeline->lock );
+
+    ThreadJoin( pipeline->thread );
+    CondDestroy( &pipeline->idle );
+    CondDestroy( &pipeline->sent );
+    MutexDestroy( &pipeline->lock );
+}
+
+/* Have the helper deliver the replies sent to 'direction' as they come in */
+static unsigned PipelineBegin(PIPELINE *pipeline, TNC_ConnectionID cid, unsigned direction)
+{
+    MutexLock( &pipeline->lock );
+    pipeline->cid = cid;
+    pipeline->direction = direction;
+    pipeline->bActive = 1;
+    pipeline->bSent = 0;
+    pipeline->nDelivered = 0;
+    MutexUnlock( &pipeline->lock );
+
+    if( 0 != QueueWatch( cid, direction, &pipeline->watch ) )
+    {
+        MutexLock( &pipeline->lock );
+        pipeline->bActive = 0;
+        MutexUnlock( &pipeline->lock );
+        return 0;
+    }
+
+    /* Anything already waiting was sent before the watch was set */
+    if( !IsQueueEmpty( cid, direction ) )
+        PipelineNotify( pipeline );
+
+    return 1;
+}
+
+/* Stop delivering replies early once the helper is done with the ones it
+   has; returns the number of times it delivered any */
+static unsigned PipelineEnd(PIPELINE *pipeline)
+{
+    unsigned nDelivered;
+
+    QueueWatch( pipeline->cid, pipeline->direction, NULL );
+
+    MutexLock( &pipeline->lock );
+    pipeline->bActive = 0;
+    while( pipeline->bBusy )
+        CondWait( &pipeline->idle, &pipeline->lock );
+    nDelivered = pipeline->nDelivered;
+    MutexUnlock( &pipeline->lock );
+
+    return nDelivered;
+}
+
+/* Deliver the batch saved for one side and end it, pipelining the replies to
+   the other side if bPipeline is set and the connection has a helper */
+static void HandshakeDeliver(CONNECTION *conn, unsigned direction, unsigned bPipeline)
+{
+    PIPELINE *pipeline = bPipeline ? conn->pipeline : NULL;
+
+    if( NULL != pipeline && !PipelineBegin( pipeline, conn->cid, QUEUE_TO_IMV == direction ? QUEUE_TO_IMC : QUEUE_TO_IMV ) )
+        pipeline = NULL;
+
+    if( QUEUE_TO_IMV == direction )
+    {
+        outfmt( OUT_LEVEL_NORMAL, "Deliver queued messages to IMVs\n" );
+        ImvDeliverBatch( conn->cid );
+    }
+    else
+    {
+        outfmt( OUT_LEVEL_NORMAL, "Deliver queued messages to IMCs\n" );
+        DeliverImcMessages( conn->cid );
+        ImcBatchEnding( conn->cid );
+    }
+
+    conn->bPipelined = NULL != pipeline && 0 != PipelineEnd( pipeline );
+}
+
+/* HandshakeStep
+ *
+ * Perform the next step of the handshake on connection "conn".
+ * Return 1 if there is more work to do, 0 once the connection
+ * has been deleted.
+ */
+
+unsigned HandshakeStep(CONNECTION *conn)
+{
+    const TNC_ConnectionID cid = conn->cid;
+    const BENCH_TIME tStart = NULL != conn->stats ? BenchClock() : 0;
+    eBENCH_PHASE phase = BENCH_PHASE_COUNT;
+    unsigned result;
+
+    switch( conn->step )
+    {
+    case CONN_STEP_CREATE:
+        outfmt( OUT_LEVEL_NORMAL, "Establishing new connection (CID: %d)\n", cid );
+        NotifyImcConnectionState( cid, TNC_CONNECTION_STATE_CREATE );
+        NotifyImvConnectionState( cid, TNC_CONNECTION_STATE_CREATE );
+
+        outfmt( OUT_LEVEL_NORMAL, "Beginning new handshake on connection %d\n", cid );
+        NotifyImcConnectionState( cid, TNC_CONNECTION_STATE_HANDSHAKE );
+        NotifyImvConnectionState( cid, TNC_CONNECTION_STATE_HANDSHAKE );
+
+        QueueClearMessages( cid, QUEUE_TO_IMV );
+        QueueClearMessages( cid, QUEUE_TO_IMC );
+        ImcBeginHandshake( cid );
+        ImcBatchEnding( cid );
+        conn->tStart = tStart;
+        conn->step = CONN_STEP_DELIVER_IMV;
+        phase = BENCH_PHASE_BEGIN_HANDSHAKE;
+        break;
+
+    case CONN_STEP_DELIVER_IMV:
+        /* A batch whose first messages were pipelined has to be ended even
+           if nothing is left of it */
+        if( IsQueueEmpty( cid, QUEUE_TO_IMV ) && !conn->bPipelined )
+        {
+            conn->step = CONN_STEP_RECOMMEND;
+            break;
+        }
+
+        if( 0 != g_nMaxRoundTrips && conn->nRoundTrips >= g_nMaxRoundTrips )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "Connection %d reached the limit of %u round trips; IMC messages not delivered!\n",
+                cid, g_nMaxRoundTrips );
+            /* Taken rather than saved, so the trace shows no batch the
+               IMVs never got */
+            QueueTakeMessages( cid, QUEUE_TO_IMV );
+            QueueClearMessages( cid, QUEUE_TO_IMV );
+            conn->bLimited = 1;
+            conn->step = CONN_STEP_RECOMMEND;
+            break;
+        }
+
+        ++conn->nRoundTrips;
+        QueueSaveState( cid, QUEUE_TO_IMV );
+        HandshakeDeliver( conn, QUEUE_TO_IMV, g_bPipeline );
+        ++conn->nBatches;
+        conn->step = CONN_STEP_DELIVER_IMC;
+        phase = BENCH_PHASE_DELIVER_IMV;
+        break;
+
+    case CONN_STEP_DELIVER_IMC:
+        if( IsQueueEmpty( cid, QUEUE_TO_IMC ) && !conn->bPipelined )
+        {
+            conn->step = CONN_STEP_RECOMMEND;
+            break;
+        }
+
+        /* IMC messages are only pipelined to the IMVs if they have a round
+           trip left to be answered in */
+        QueueSaveState( cid, QUEUE_TO_IMC );
+        HandshakeDeliver( conn, QUEUE_TO_IMC, g_bPipeline && (0 == g_nMaxRoundTrips || conn->nRoundTrips < g_nMaxRoundTrips) );
+        ++conn->nBatches;
+        conn->step = CONN_STEP_DELIVER_IMV;
+        phase = BENCH_PHASE_DELIVER_IMC;
+        break;
+
+    case CONN_STEP_RECOMMEND:
+        QueueClearMessages( cid, QUEUE_TO_IMV );
+        QueueClearMessages( cid, QUEUE_TO_IMC );
+        outfmt( OUT_LEVEL_NORMAL, "No more messages to deliver. Get results from IMVs\n" );
+
+        conn->state = ImvGetRecommendation( cid, &result );
+        if( conn->state > TNC_CONNECTION_STATE_DELETE )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "No recommendation for connection %d; denying access\n", cid );
+            conn->state = TNC_CONNECTION_STATE_ACCESS_NONE;
+        }
+
+        NotifyImcConnectionState( cid, conn->state );
+        NotifyImvConnectionState( cid, conn->state );
+
+        outfmt( OUT_LEVEL_NORMAL, "Handshake on connection %d completed with result `%s'\n", cid, g_pszConnStates[ conn->state ] );
+        conn->step = CONN_STEP_DELETE;
+        phase = BENCH_PHASE_RECOMMENDATION;
+        break;
+
+    case CONN_STEP_DELETE:
+        outfmt( OUT_LEVEL_NORMAL, "Deleting connection (CID: %d)\n", cid );
+        NotifyImcConnectionState( cid, TNC_CONNECTION_STATE_DELETE );
+        NotifyImvConnectionState( cid, TNC_CONNECTION_STATE_DELETE );
+        QueueRelease( cid );
+        conn->step = CONN_STEP_DONE;
+        phase = BENCH_PHASE_DELETE;
+        break;
+
+    default:
+        break;
+    }
+
+    if( NULL != conn->stats && BENCH_PHASE_COUNT != phase )
+    {
+        const BENCH_TIME tEnd = BenchClock();
+
+        BenchRecord( conn->stats, phase, tEnd - tStart );
+        if( CONN_STEP_DONE == conn->step )
+        {
+            BenchRecord( conn->stats, BENCH_PHASE_HANDSHAKE, tEnd - conn->tStart );
+            conn->stats->nBatches += conn->nBatches;
+            ++conn->stats->nHandshakes;
+        }
+    }
+
+    return CONN_STEP_DONE != conn->step;
+}
+
+TNC_ConnectionState RunHandshake(TNC_ConnectionID cid)
+{
+    CONNECTION conn;
+    PIPELINE pipeline;
+    unsigned bPipeline = g_bPipeline && 0 == PipelineStart( &pipeline );
+
+    HandshakeInit( &conn, cid );
+    conn.pipeline = bPipeline ? &pipeline : NULL;
+    while( HandshakeStep( &conn ) );
+
+    if( bPipeline )
+        PipelineStop( &pipeline );
+
+    return conn.state;
+}
+
+/* Concurrent handshakes
+ *
+ * Every worker thread has a deque of connections of its own. A worker takes
+ * the connection at the back of its deque, performs one step and puts it back
+ * there, so it keeps stepping the same handshake while its state is still in
+ * the cache. A worker whose deque runs dry steals the connection at the front
+ * of another worker's deque, the one that has waited longest, so a few slow
+ * connections (a large SoH, a slow IMV) tie up one worker at most while the
+ * rest of the connections move on elsewhere. A worker that finds nothing to
+ * steal sleeps until a connection is pushed or the run is over. When a
+ * handshake completes, its slot is reused for a new connection as long as
+ * the run hasn't reached its count or deadline.
+ */
+
+typedef struct WORK_DEQUE_tag
+{
+    TNC_MUTEX lock;
+    CONNECTION *head, *tail;
+    volatile long nCount;           /* So thieves can pass by without locking */
+} WORK_DEQUE;
+
+typedef struct HANDSHAKE_POOL_tag
+{
+    TNC_MUTEX lock;
+    TNC_COND work;                  /* A connection was pushed, or the run is over */
+    volatile long nIdle;            /* Workers waiting for work */
+    WORK_DEQUE *deques;             /* One per worker */
+    unsigned nDeques;
+    volatile long nRemaining;       /* Slots that are still running */
+    volatile long nUnstarted;       /* Handshakes not yet started */
+    volatile long nNextCID;
+    volatile long nSteals;
+    volatile long nLimited;         /* Handshakes cut off at the round-trip limit */
+    BENCH_TIME tDeadline;
+    BENCH_STATS *stats;
+    volatile long nResults[ TNC_CONNECTION_STATE_DELETE + 1 ];
+} HANDSHAKE_POOL;
+
+typedef struct HANDSHAKE_WORKER_tag
+{
+    HANDSHAKE_POOL *pool;
+    unsigned index;
+} HANDSHAKE_WORKER;
+
+static void DequePush(WORK_DEQUE *deque, CONNECTION *conn)
+{
+    conn->next = NULL;
+
+    MutexLock( &deque->lock );
+    conn->prev = deque->tail;
+    if( NULL != deque->tail )
+        deque->tail->next = conn;
+    else
+        deque->head = conn;
+    deque->tail = conn;
+    AtomicAdd( &deque->nCount, 1 );
+    MutexUnlock( &deque->lock );
+}
+
+/* The owner takes from the back */
+static CONNECTION* DequePop(WORK_DEQUE *deque)
+{
+    CONNECTION *conn;
+
+    MutexLock( &deque->lock );
+    conn = deque->tail;
+    if( NULL != conn )
+    {
+        deque->tail = conn->prev;
+        if( NULL != deque->tail )
+            deque->tail->next = NULL;
+        else
+            deque->head = NULL;
+        AtomicAdd( &deque->nCount, -1 );
+    }
+    MutexUnlock( &deque->lock );
+
+    return conn;
+}
+
+/* Thieves take from the front */
+static CONNECTION* DequeSteal(WORK_DEQUE *deque)
+{
+    CONNECTION *conn;
+
+    /* Don't bother taking the lock of a deque that looks empty */
+    if( 0 == AtomicAdd( &deque->nCount, 0 ) )
+        return NULL;
+
+    MutexLock( &deque->lock );
+    conn = deque->head;
+    if( NULL != conn )
+    {
+        deque->head = conn->next;
+        if( NULL != deque->head )
+            deque->head->prev = NULL;
+        else
+            deque->tail = NULL;
+        AtomicAdd( &deque->nCount, -1 );
+    }
+    MutexUnlock( &deque->lock );
+
+    return conn;
+}
+
+/* Look for work in the other workers' deques, starting with the next one so
+   that thieves spread out over their victims */
+static CONNECTION* PoolSteal(HANDSHAKE_POOL *pool, unsigned self)
+{
+    CONNECTION *conn;
+    unsigned i;
+
+    for( i = 1; i < pool->nDeques; ++i )
+    {
+        conn = DequeSteal( &pool->deques[ (self + i) % pool->nDeques ] );
+        if( NULL != conn )
+        {
+            AtomicAdd( &pool->nSteals, 1 );
+            return conn;
+        }
+    }
+
+    return NULL;
+}
+
+/* Push a connection and wake a worker if any are idle, so it can steal it.
+   The count is raised before nIdle is looked at, and an idle worker raises
+   nIdle before it looks at the counts, so one of them sees the other. */
+static void PoolPush(HANDSHAKE_POOL *pool, WORK_DEQUE *deque, CONNECTION *conn)
+{
+    DequePush( deque, conn );
+
+    if( AtomicAdd( &pool->nIdle, 0 ) > 0 )
+    {
+        MutexLock( &pool->lock );
+        CondSignal( &pool->work );
+        MutexUnlock( &pool->lock );
+    }
+}
+
+/* Sleep until there may be something to steal or the run is over */
+static void PoolWait(HANDSHAKE_POOL *pool)
+{
+    unsigned i;
+
+    MutexLock( &pool->lock );
+    AtomicAdd( &pool->nIdle, 1 );
+
+    for( i = 0; i < pool->nDeques && 0 == AtomicAdd( &pool->deques[ i ].nCount, 0 ); ++i );
+    if( i == pool->nDeques && AtomicAdd( &pool->nRemaining, 0 ) > 0 )
+        CondWait( &pool->work, &pool->lock );
+
+    AtomicAdd( &pool->nIdle, -1 );
+    MutexUnlock( &pool->lock );
+}
+
+/* Decide whether a slot whose handshake just completed starts another one */
+static unsigned PoolRestart(HANDSHAKE_POOL *pool, CONNECTION *conn)
+{
+    if( 0 != pool->tDeadline )
+    {
+        if( BenchClock() >= pool->tDeadline )
+            return 0;
+    }
+    else if( AtomicAdd( &pool->nUnstarted, -1 ) < 0 )
+    {
+        return 0;
+    }
+
+    HandshakeInit( conn, g_nCID + AtomicAdd( &pool->nNextCID, 1 ) - 1 );
+    return 1;
+}
+
+static void HandshakeWorker(void *arg)
+{
+    HANDSHAKE_WORKER *worker = (HANDSHAKE_WORKER *) arg;
+    HANDSHAKE_POOL *pool = worker->pool;
+    WORK_DEQUE *deque = &pool->deques[ worker->index ];
+    BENCH_STATS *stats = NULL;
+    PIPELINE pipeline;
+    unsigned bPipeline = g_bPipeline && 0 == PipelineStart( &pipeline );
+    CONNECTION *conn;
+
+    /* Each worker keeps private statistics, merged when it is done */
+    if( NULL != pool->stats )
+    {
+        stats = (BENCH_STATS *) malloc( sizeof( *stats ) );
+        if( NULL != stats )
+            BenchInit( stats );
+    }
+
+    while( AtomicAdd( &pool->nRemaining, 0 ) > 0 )
+    {
+        conn = DequePop( deque );
+        if( NULL == conn )
+            conn = PoolSteal( pool, worker->index );
+        if( NULL == conn )
+        {
+            /* Everything left is being stepped by other workers */
+            PoolWait( pool );
+            continue;
+        }
+
+        conn->stats = stats;
+        conn->pipeline = bPipeline ? &pipeline : NULL;
+        if( HandshakeStep( conn ) )
+        {
+            PoolPush( pool, deque, conn );
+            continue;
+        }
+
+        AtomicAdd( &pool->nResults[ conn->state ], 1 );
+        if( conn->bLimited )
+            AtomicAdd( &pool->nLimited, 1 );
+        if( PoolRestart( pool, conn ) )
+            PoolPush( pool, deque, conn );
+        else if( 0 == AtomicAdd( &pool->nRemaining, -1 ) )
+        {
+            /* The run is over; let the idle workers go */
+            MutexLock( &pool->lock );
+            CondBroadcast( &pool->work );
+            MutexUnlock( &pool->lock );
+        }
+    }
+
+    if( NULL != stats )
+    {
+        MutexLock( &pool->lock );
+        BenchMerge( pool->stats, stats );
+        MutexUnlock( &pool->lock );
+        free( stats );
+    }
+
+    if( bPipeline )
+        PipelineStop( &pipeline );
+}
+
+int RunConcurrentHandshakes(const DRIVER_OPTIONS *options, BENCH_STATS *stats)
+{
+    HANDSHAKE_POOL pool;
+    HANDSHAKE_WORKER *workers;
+    CONNECTION *conns;
+    TNC_THREAD *threads;
+    unsigned i, nStarted, nConnections = options->nConnections;
+    BENCH_TIME tStart;
+    long nCompleted = 0;
+    int err = 0;
+
+    /* No point in more slots than there are handshakes to run */
+    if( 0 == options->nSeconds && options->nHandshakes < nConnections )
+        nConnections = options->nHandshakes;
+
+    memset( &pool, 0, sizeof( pool ) );
+    pool.nDeques = options->nThreads ? options->nThreads : 1;
+
+    conns = (CONNECTION *) malloc( nConnections * sizeof( *conns ) );
+    threads = (TNC_THREAD *) malloc( pool.nDeques * sizeof( *threads ) );
+    workers = (HANDSHAKE_WORKER *) malloc( pool.nDeques * sizeof( *workers ) );
+    pool.deques = (WORK_DEQUE *) calloc( pool.nDeques, sizeof( *pool.deques ) );
+    if( NULL == conns || NULL == threads || NULL == workers || NULL == pool.deques )
+    {
+        free( conns );
+        free( threads );
+        free( workers );
+        free( pool.deques );
+        return TNC_RESULT_OTHER;
+    }
+
+    MutexInit( &pool.lock );
+    CondInit( &pool.work );
+    pool.nRemaining = nConnections;
+    pool.nUnstarted = options->nHandshakes - nConnections;
+    pool.nNextCID = nConnections;
+    pool.stats = stats;
+
+    for( i = 0; i < pool.nDeques; ++i )
+    {
+        MutexInit( &pool.deques[ i ].lock );
+        workers[ i ].pool = &pool;
+        workers[ i ].index = i;
+    }
+
+    /* Deal the connections out evenly; stealing evens out the rest */
+    for( i = 0; i < nConnections; ++i )
+    {
+        HandshakeInit( &conns[ i ], g_nCID + i );
+        DequePush( &pool.deques[ i % pool.nDeques ], &conns[ i ] );
+    }
+
+    outfmt( OUT_LEVEL_SUMMARY, "Running %u concurrent handshakes on %u worker threads\n", nConnections, pool.nDeques );
+
+    tStart = BenchClock();
+    if( 0 != options->nSeconds )
+        pool.tDeadline = tStart + (BENCH_TIME) options->nSeconds * 1000000000ull;
+
+    for( nStarted = 0; nStarted < options->nThreads; ++nStarted )
+    {
+        err = ThreadCreate( &threads[ nStarted ], HandshakeWorker, &workers[ nStarted ] );
+        if( 0 != err )
+        {
+            outfmt( OUT_LEVEL_SUMMARY, "Failed to start worker thread: error %d\n", err );
+            break;
+        }
+    }
+
+    /* Even if not every worker could be started, the ones that were will 
+       finish the job by stealing from the deques of those that weren't */
+    if( 0 == nStarted )
+        HandshakeWorker( &workers[ 0 ] );
+
+    for( i = 0; i < nStarted; ++i )
+        ThreadJoin( threads[ i ] );
+
+    for( i = TNC_CONNECTION_STATE_ACCESS_ALLOWED; i <= TNC_CONNECTION_STATE_ACCESS_NONE; ++i )
+        nCompleted += pool.nResults[ i ];
+
+    outfmt( OUT_LEVEL_SUMMARY, "%ld handshakes completed:", nCompleted );
+    for( i = TNC_CONNECTION_STATE_ACCESS_ALLOWED; i <= TNC_CONNECTION_STATE_ACCESS_NONE; ++i )
+        outfmt( OUT_LEVEL_SUMMARY, " %s %ld%c", g_pszConnStates[ i ], pool.nResults[ i ], 
+            i == TNC_CONNECTION_STATE_ACCESS_NONE ? '\n' : ',' );
+
+    if( 0 != pool.nLimited )
+        outfmt( OUT_LEVEL_SUMMARY, "%ld handshakes were cut off after %u round trips\n", pool.nLimited, g_nMaxRoundTrips );
+
+    outfmt( OUT_LEVEL_NORMAL, "%ld steps were stolen by idle workers\n", pool.nSteals );
+
+    if( NULL != stats )
+        BenchReport( stats, BenchClock() - tStart );
+
+    for( i = 0; i < pool.nDeques; ++i )
+        MutexDestroy( &pool.deques[ i ].lock );
+    CondDestroy( &pool.work );
+    MutexDestroy( &pool.lock );
+    free( pool.deques );
+    free( workers );
+    free( conns );
+    free( threads );
+    return TNC_RESULT_SUCCESS;
+}
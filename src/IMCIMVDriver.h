@@ -0,0 +1,95 @@
+/*
+ * IMCIMVDriver.h
+ *
+ * Header file for IMCIMVTester Handshake Driver
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _IMCIMVDRIVER_H
+#define _IMCIMVDRIVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "tncifimv.h"
+#include "IMCIMVBench.h"
+
+/* A handshake is driven as a sequence of steps so that many connections can
+   be interleaved on a few worker threads. Each step is one unit of work for
+   the TNCC/TNCS: a lifecycle notification or the delivery of one batch. */
+typedef enum eCONN_STEP_tag
+{
+    CONN_STEP_CREATE,
+    CONN_STEP_DELIVER_IMV,
+    CONN_STEP_DELIVER_IMC,
+    CONN_STEP_RECOMMEND,
+    CONN_STEP_DELETE,
+    CONN_STEP_DONE
+} eCONN_STEP;
+
+typedef struct CONNECTION_tag
+{
+    struct CONNECTION_tag *next, *prev;
+    TNC_ConnectionID cid;
+    eCONN_STEP step;
+    unsigned nBatches;
+    unsigned nRoundTrips;       /* Batches delivered to the IMVs */
+    unsigned bLimited;          /* Cut off at the round-trip limit */
+    unsigned bPipelined;        /* Part of the current batch was delivered early */
+    TNC_ConnectionState state;
+    BENCH_STATS *stats;         /* Where to record step latencies, if anywhere */
+    struct PIPELINE_tag *pipeline;  /* Helper for pipelined batches, if any */
+    BENCH_TIME tStart;
+} CONNECTION;
+
+/* How RunConcurrentHandshakes drives the connections. nConnections handshakes
+   are in flight at any time. As one completes, its slot starts a new handshake
+   on a fresh connection ID until nHandshakes have been started or, if nSeconds
+   is set, until that much time has passed. */
+typedef struct DRIVER_OPTIONS_tag
+{
+    unsigned nConnections;
+    unsigned nThreads;
+    unsigned nHandshakes;
+    unsigned nSeconds;
+} DRIVER_OPTIONS;
+
+void HandshakeInit(CONNECTION *conn, TNC_ConnectionID cid);
+unsigned HandshakeStep(CONNECTION *conn);
+TNC_ConnectionState RunHandshake(TNC_ConnectionID cid);
+int RunConcurrentHandshakes(const DRIVER_OPTIONS *options, BENCH_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
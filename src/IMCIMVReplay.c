@@ -0,0 +1,377 @@
+/*
+ * IMCIMVReplay.c
+ *
+ * IMCIMVTester Trace Replay
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "IMCIMVReplay.h"
+#include "IMCIMVTNCS.h"
+#include "IMCIMVBench.h"
+#include "msgqueue.h"
+#include "trace.h"
+#include "corpus.h"
+#include "output.h"
+#include "tncthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+extern char *g_pszConnStates[];
+
+typedef struct REPLAY_STATS_tag
+{
+    unsigned long long nMessages;
+    unsigned long long nBatches;
+    unsigned long long nConnections;
+    unsigned long long nDiffering;      /* Handshakes whose result differs from the recording */
+    unsigned long long nResults[ TNC_CONNECTION_STATE_DELETE + 1 ];
+} REPLAY_STATS;
+
+/* The whole mapped trace or corpus is one shared buffer; every queued
+   message holds a reference to it, so it is unmapped once the last of them
+   is delivered */
+static void ReplayUnmap(void *context, TNC_BufferReference data, TNC_UInt32 length)
+{
+    (void) data;
+    (void) length;
+
+    UnmapFile( (MAPPED_FILE *) context );
+    free( context );
+}
+
+/* Wait until 'offset' nanoseconds have passed since tStart; sleep through
+   most of a long wait and yield for the rest */
+static void ReplayWait(BENCH_TIME tStart, unsigned long long offset)
+{
+    BENCH_TIME elapsed;
+
+    while( (elapsed = BenchClock() - tStart) < offset )
+    {
+        if( offset - elapsed > 2000000 )
+            ThreadSleep( (unsigned) ((offset - elapsed) / 1000000) - 1 );
+        else
+            ThreadYield();
+    }
+}
+
+/* Queue a message an IMC sent; its payload stays where it is in the mapped
+   file. Replayed messages go into the corpus, if one is being written, just
+   as live ones do. */
+static void ReplayQueueMessage(TNC_ConnectionID cid, unsigned category, TNC_UInt32 imcID, TNC_UInt32 imvID,
+    TNC_VendorID vendorID, TNC_MessageSubtype subtype, TNC_UInt32 flags, TNC_BufferReference payload, TNC_UInt32 length,
+    MESSAGE_BUFFER *buffer)
+{
+    MESSAGE_BASIC basicMessage;
+    MESSAGE_SOH sohMessage;
+    MESSAGE_LONG longTypeMessage;
+
+    if( NULL == payload || 0 == length )
+        buffer = NULL;
+
+    switch( category )
+    {
+    case MESSAGE_CATEGORY_BASIC:
+        basicMessage.message = payload;
+        basicMessage.messageLength = length;
+        basicMessage.messageType = ((TNC_MessageType) vendorID << 8) | (subtype & 0xff);
+        if( NULL != buffer )
+            QueueAddMessageShared( cid, QUEUE_TO_IMV, &basicMessage, buffer );
+        else
+            QueueAddMessage( cid, QUEUE_TO_IMV, &basicMessage );
+        break;
+
+    case MESSAGE_CATEGORY_SOH:
+        sohMessage.sohReportEntry = payload;
+        sohMessage.sohRELength = length;
+        if( NULL != buffer )
+            QueueAddMessageSOHShared( cid, QUEUE_TO_IMV, &sohMessage, buffer );
+        else
+            QueueAddMessageSOH( cid, QUEUE_TO_IMV, &sohMessage );
+        break;
+
+    case MESSAGE_CATEGORY_LONG:
+        longTypeMessage.messageFlags = flags;
+        longTypeMessage.message = payload;
+        longTypeMessage.messageLength = length;
+        longTypeMessage.messageVendorID = vendorID;
+        longTypeMessage.messageSubtype = subtype;
+        longTypeMessage.imcID = imcID;
+        longTypeMessage.imvID = imvID;
+        if( NULL != buffer )
+            QueueAddMessageLongShared( cid, QUEUE_TO_IMV, &longTypeMessage, buffer );
+        else
+            QueueAddMessageLong( cid, QUEUE_TO_IMV, &longTypeMessage );
+        break;
+
+    default:
+        return;
+    }
+
+    CorpusMessage( category, vendorID, subtype, flags, imvID, payload, length );
+}
+
+static void ReplayTraceMessage(const TRACE_RECORD *rec, const TRACE_FILE *file, MESSAGE_BUFFER *buffer)
+{
+    TNC_BufferReference payload = NULL;
+    unsigned category;
+
+    if( rec->flags & TRACE_FLAG_PAYLOAD )
+        payload = file->base + rec->payload;
+
+    switch( rec->event )
+    {
+    case TRACE_EVENT_SEND_MESSAGE:
+        category = MESSAGE_CATEGORY_BASIC;
+        break;
+
+    case TRACE_EVENT_SEND_MESSAGE_SOH:
+        category = MESSAGE_CATEGORY_SOH;
+        break;
+
+    default:
+        category = MESSAGE_CATEGORY_LONG;
+        break;
+    }
+
+    ReplayQueueMessage( rec->cid, category, rec->moduleID, rec->destinationID, rec->vendorID, rec->subtype,
+        rec->messageFlags, payload, NULL != payload ? rec->length : 0, buffer );
+}
+
+static void ReplayDeliver(TNC_ConnectionID cid, REPLAY_STATS *stats)
+{
+    QueueSaveState( cid, QUEUE_TO_IMV );
+    stats->nMessages += QueueGetMessageCount( cid, QUEUE_TO_IMV );
+    ++stats->nBatches;
+
+    outfmt( OUT_LEVEL_NORMAL, "Deliver queued messages to IMVs\n" );
+    ImvDeliverBatch( cid );
+
+    /* There is no IMC to take the IMVs' replies */
+    QueueSaveState( cid, QUEUE_TO_IMC );
+    QueueClearMessages( cid, QUEUE_TO_IMC );
+}
+
+/* The IMVs decide afresh; a recorded outcome is only compared */
+static TNC_ConnectionState ReplayResult(TNC_ConnectionID cid, REPLAY_STATS *stats)
+{
+    TNC_ConnectionState state;
+    unsigned result;
+
+    QueueClearMessages( cid, QUEUE_TO_IMV );
+    state = ImvGetRecommendation( cid, &result );
+    if( state > TNC_CONNECTION_STATE_DELETE )
+        state = TNC_CONNECTION_STATE_ACCESS_NONE;
+
+    ++stats->nResults[ state ];
+    return state;
+}
+
+static void ReplayConnectionState(TNC_ConnectionID cid, TNC_ConnectionState recorded, REPLAY_STATS *stats)
+{
+    TNC_ConnectionState state = recorded;
+
+    switch( recorded )
+    {
+    case TNC_CONNECTION_STATE_CREATE:
+        outfmt( OUT_LEVEL_NORMAL, "Establishing new connection (CID: %d)\n", cid );
+        ++stats->nConnections;
+        break;
+
+    case TNC_CONNECTION_STATE_ACCESS_ALLOWED:
+    case TNC_CONNECTION_STATE_ACCESS_ISOLATED:
+    case TNC_CONNECTION_STATE_ACCESS_NONE:
+        state = ReplayResult( cid, stats );
+        if( state != recorded )
+            ++stats->nDiffering;
+
+        outfmt( OUT_LEVEL_NORMAL, "Handshake on connection %d completed with result `%s' (recorded `%s')\n",
+            cid, g_pszConnStates[ state ], g_pszConnStates[ recorded ] );
+        break;
+
+    case TNC_CONNECTION_STATE_DELETE:
+        outfmt( OUT_LEVEL_NORMAL, "Deleting connection (CID: %d)\n", cid );
+        break;
+    }
+
+    NotifyImvConnectionState( cid, state );
+
+    if( TNC_CONNECTION_STATE_DELETE == recorded )
+        QueueRelease( cid );
+}
+
+static void ReplayTrace(const TRACE_FILE *file, MESSAGE_BUFFER *buffer, unsigned bPaced, REPLAY_STATS *stats)
+{
+    const TRACE_RECORD *rec;
+    BENCH_TIME tStart;
+
+    tStart = BenchClock();
+    for( rec = TraceNext( file, NULL ); NULL != rec; rec = TraceNext( file, rec ) )
+    {
+        /* Only the IMC side is replayed; the IMVs answer for themselves */
+        switch( rec->event )
+        {
+        case TRACE_EVENT_SEND_MESSAGE:
+        case TRACE_EVENT_SEND_MESSAGE_SOH:
+        case TRACE_EVENT_SEND_MESSAGE_LONG:
+            if( rec->flags & TRACE_FLAG_TNCS )
+                continue;
+
+            if( bPaced )
+                ReplayWait( tStart, rec->timestamp );
+
+            ReplayTraceMessage( rec, file, buffer );
+            break;
+
+        case TRACE_EVENT_BATCH:
+            /* Only the batches the IMVs were given are replayed; there is no
+               IMC to take their replies. A batch that was partly pipelined is
+               delivered whole, at the point where it ended. */
+            if( QUEUE_TO_IMV != rec->direction )
+                continue;
+
+            if( bPaced )
+                ReplayWait( tStart, rec->timestamp );
+
+            ReplayDeliver( rec->cid, stats );
+            break;
+
+        case TRACE_EVENT_CONNECTION_STATE:
+            if( !(rec->flags & TRACE_FLAG_TNCS) || rec->value > TNC_CONNECTION_STATE_DELETE )
+                continue;
+
+            if( bPaced )
+                ReplayWait( tStart, rec->timestamp );
+
+            ReplayConnectionState( rec->cid, rec->value, stats );
+            break;
+        }
+    }
+}
+
+/* A corpus has no connections; each message is a handshake of its own,
+   which is what a fuzzing run wants */
+static void ReplayCorpus(const CORPUS *corpus, MESSAGE_BUFFER *buffer, REPLAY_STATS *stats)
+{
+    CORPUS_CURSOR cursor;
+    const CORPUS_ENTRY *entry;
+    TNC_ConnectionID cid = 0;
+    TNC_ConnectionState state;
+
+    memset( &cursor, 0, sizeof( cursor ) );
+    while( NULL != (entry = CorpusNext( corpus, &cursor )) )
+    {
+        ++cid;
+        ReplayConnectionState( cid, TNC_CONNECTION_STATE_CREATE, stats );
+        ReplayConnectionState( cid, TNC_CONNECTION_STATE_HANDSHAKE, stats );
+
+        ReplayQueueMessage( cid, entry->category, 0, entry->destinationID, entry->vendorID, entry->subtype, entry->flags,
+            CorpusPayload( corpus, entry ), entry->length, buffer );
+        if( ! IsQueueEmpty( cid, QUEUE_TO_IMV ) )
+            ReplayDeliver( cid, stats );
+
+        state = ReplayResult( cid, stats );
+        outfmt( OUT_LEVEL_NORMAL, "Handshake on connection %d completed with result `%s'\n", cid, g_pszConnStates[ state ] );
+        NotifyImvConnectionState( cid, state );
+
+        ReplayConnectionState( cid, TNC_CONNECTION_STATE_DELETE, stats );
+    }
+}
+
+int RunReplay(const char *pszPath, unsigned bPaced)
+{
+    TRACE_FILE *file;
+    CORPUS corpus;
+    MESSAGE_BUFFER *buffer;
+    REPLAY_STATS stats;
+    BENCH_TIME tStart, elapsed;
+    unsigned long long nCompleted = 0;
+    unsigned bCorpus = 0;
+    unsigned i;
+    int err;
+
+    file = (TRACE_FILE *) malloc( sizeof( *file ) );
+    if( NULL == file )
+        return TNC_RESULT_OTHER;
+
+    err = TraceOpen( pszPath, file );
+    if( EINVAL == err && 0 == (err = CorpusOpen( pszPath, &corpus )) )
+    {
+        *file = corpus.file;
+        bCorpus = 1;
+    }
+
+    if( 0 != err )
+    {
+        outfmt( OUT_LEVEL_SUMMARY, "Cannot replay %s: error %d\n", pszPath, err );
+        free( file );
+        return TNC_RESULT_OTHER;
+    }
+
+    buffer = BufferAttach( file->base, (TNC_UInt32) file->size, ReplayUnmap, file );
+    if( NULL == buffer )
+    {
+        ReplayUnmap( file, NULL, 0 );
+        return TNC_RESULT_OTHER;
+    }
+
+    memset( &stats, 0, sizeof( stats ) );
+    if( bCorpus )
+        outfmt( OUT_LEVEL_SUMMARY, "Replaying %llu messages of corpus %s\n", corpus.nEntries, pszPath );
+    else
+        outfmt( OUT_LEVEL_SUMMARY, "Replaying %s%s\n", pszPath, bPaced ? " at its recorded pace" : "" );
+
+    tStart = BenchClock();
+    if( bCorpus )
+        ReplayCorpus( &corpus, buffer, &stats );
+    else
+        ReplayTrace( file, buffer, bPaced, &stats );
+
+    elapsed = BenchClock() - tStart;
+    BufferRelease( buffer );
+
+    for( i = TNC_CONNECTION_STATE_ACCESS_ALLOWED; i <= TNC_CONNECTION_STATE_ACCESS_NONE; ++i )
+        nCompleted += stats.nResults[ i ];
+
+    outfmt( OUT_LEVEL_SUMMARY, "Replayed %llu messages in %llu batches on %llu connections in %.3f s, %.1f messages/sec\n",
+        stats.nMessages, stats.nBatches, stats.nConnections, elapsed / 1e9,
+        0 != elapsed ? stats.nMessages * 1e9 / elapsed : 0.0 );
+
+    outfmt( OUT_LEVEL_SUMMARY, "%llu handshakes completed:", nCompleted );
+    for( i = TNC_CONNECTION_STATE_ACCESS_ALLOWED; i <= TNC_CONNECTION_STATE_ACCESS_NONE; ++i )
+        outfmt( OUT_LEVEL_SUMMARY, " %s %llu%s", g_pszConnStates[ i ], stats.nResults[ i ],
+            i != TNC_CONNECTION_STATE_ACCESS_NONE ? "," : bCorpus ? "\n" : ";" );
+
+    if( ! bCorpus )
+        outfmt( OUT_LEVEL_SUMMARY, " %llu differ from the recording\n", stats.nDiffering );
+    return TNC_RESULT_SUCCESS;
+}
@@ -36,52 +36,193 @@
 #include "IMCIMVTNCC.h"
 #include "IMCIMVTester.h"
 #include "msgqueue.h"
+#include "typeindex.h"
+#include "soh.h"
+#include "trace.h"
+#include "corpus.h"
+#include "tncthread.h"
 #include "output.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-/* TNCC will assign this IMC ID after loading the IMC */
-#define IMC_ID  0
-
-/* List of functions implemented by IMC */
-static IMCFuncs imcFuncs;
-
-/* List of message types supported by IMC in TNC_TNCC_ReportMessageTypes */
-static TNC_MessageTypeList g_pImcMessageTypes = NULL;
-static TNC_UInt32 g_nImcMessageTypesCount = 0;
-
-/* List of message types supported by IMC in TNC_TNCC_ReportMessageTypesLong */
-static TNC_MessageSubtypeList g_pImcMessageLongSubtypes = NULL;
-static TNC_VendorIDList g_pImcVendorIDs = NULL;
-static TNC_UInt32 g_nImcMessageLongSubtypesCount = 0;
+/* IMCs loaded by the TNCC. An IMC's ID is its index in this table, so the
+   TNCC_* callbacks can find the calling IMC directly. Each IMC keeps its own
+   function table and the message types it registered for. */
+typedef struct IMC_MODULE_tag
+{
+    TNC_IMCID id;
+    void *hDLL;
+    IMCFuncs funcs;
+
+    /* Message types supported by IMC in TNC_TNCC_ReportMessageTypes */
+    TYPE_INDEX types;
+
+    /* Message types supported by IMC in TNC_TNCC_ReportMessageTypesLong */
+    TYPE_INDEX longTypes;
+} IMC_MODULE;
+
+static IMC_MODULE g_Imcs[ TNCC_MAX_IMCS ];
+static unsigned g_nImcCount = 0;
+
+/* Routing tables that map a message type to the IMCs receiving it. They are
+   replaced whenever an IMC reports its message types. A replaced table may
+   still be in use by a thread delivering messages, so it is retired rather
+   than freed until the IMCs are terminated. */
+static ROUTE_TABLE * volatile g_pBasicRoutes = NULL;
+static ROUTE_TABLE * volatile g_pLongRoutes = NULL;
+static ROUTE_TABLE * volatile g_pSohRoutes = NULL;
+static ROUTE_TABLE *g_pRetiredRoutes = NULL;
+static TNC_MUTEX g_RoutesLock;
 
 /* These functions are defined in platform specific files */
-int LoadImcDLL(const char *dllPath, IMCFuncs *funcTable);
-void UnloadImcDLL(void);
-
-/* These extract sub-information from TNC_MessageType */
-#define EXTRACT_VENDOR(x) (x >> 8)
-#define EXTRACT_SUBTYPE(x) (x & 0xff)
+int LoadImcDLL(const char *dllPath, IMCFuncs *funcTable, void **phDLL);
+void UnloadImcDLL(void *hDLL);
 
 char *g_pszConnStates[] = 
 {
     "Create", "Handshake", "Access Allowed", "Access Isolated", "Access DENIED", "Delete"
 };
 
+static IMC_MODULE* GetImc(TNC_IMCID imcID)
+{
+    return imcID < g_nImcCount ? &g_Imcs[ imcID ] : NULL;
+}
+
+/* An IMC receives a basic message if it registered the message type */
+static unsigned ImcReceivesBasic( void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype )
+{
+    IMC_MODULE *imc = &g_Imcs[ id ];
+
+    (void) context;
+
+    return NULL != imc->funcs.pfnReceiveMessage && TypeIndexFind( &imc->types, vendorID, subtype );
+}
+
+/* An IMC receives an SoHR entry if it registered the entry's System Health ID
+   as a message type; it takes the entry through TNC_IMC_ReceiveMessageSOH if
+   it has it, or else through TNC_IMC_ReceiveMessage */
+static unsigned ImcReceivesSoh( void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype )
+{
+    IMC_MODULE *imc = &g_Imcs[ id ];
+
+    (void) context;
+
+    return (NULL != imc->funcs.pfnReceiveMessageSOH || NULL != imc->funcs.pfnReceiveMessage) &&
+        TypeIndexFind( &imc->types, vendorID, subtype );
+}
+
+/* An IMC receives a long message through TNC_IMC_ReceiveMessageLong if it
+   registered the type with TNC_TNCC_ReportMessageTypesLong. An IMC without
+   that function can still receive it through TNC_IMC_ReceiveMessage if it 
+   registered the equivalent TNC_MessageType. */
+static unsigned ImcReceivesLong( void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype )
+{
+    IMC_MODULE *imc = &g_Imcs[ id ];
+    TNC_MessageType longMessageType;
+
+    (void) context;
+
+    if( NULL != imc->funcs.pfnReceiveMessageLong )
+        return TypeIndexFind( &imc->longTypes, vendorID, subtype );
+
+    longMessageType = (vendorID << 8 | subtype);
+    return NULL != imc->funcs.pfnReceiveMessage && 
+        TypeIndexFind( &imc->types, EXTRACT_VENDOR( longMessageType ), EXTRACT_SUBTYPE( longMessageType ) );
+}
+
+/* Rebuild the routing tables after an IMC changed its registrations. The
+   basic and SoH tables are keyed by the types registered with
+   ReportMessageTypes, the long table by those of either ReportMessageTypes
+   call. */
+static void ImcRebuildRoutes(void)
+{
+    TYPE_INDEX *indexes[ 2 * TNCC_MAX_IMCS ];
+    ROUTE_TABLE *pBasicRoutes, *pLongRoutes, *pSohRoutes;
+    unsigned i;
+
+    MutexLock( &g_RoutesLock );
+
+    for( i = 0; i < g_nImcCount; ++i )
+    {
+        indexes[ i ] = &g_Imcs[ i ].types;
+        indexes[ g_nImcCount + i ] = &g_Imcs[ i ].longTypes;
+    }
+
+    /* A table that cannot be built is left out; lookups then check every IMC */
+    pBasicRoutes = RouteTableBuild( indexes, g_nImcCount, g_nImcCount, ImcReceivesBasic, NULL );
+    pLongRoutes = RouteTableBuild( indexes, 2 * g_nImcCount, g_nImcCount, ImcReceivesLong, NULL );
+    pSohRoutes = RouteTableBuild( indexes, g_nImcCount, g_nImcCount, ImcReceivesSoh, NULL );
+
+    if( NULL != g_pBasicRoutes )
+    {
+        g_pBasicRoutes->next = g_pRetiredRoutes;
+        g_pRetiredRoutes = g_pBasicRoutes;
+    }
+
+    if( NULL != g_pLongRoutes )
+    {
+        g_pLongRoutes->next = g_pRetiredRoutes;
+        g_pRetiredRoutes = g_pLongRoutes;
+    }
+
+    if( NULL != g_pSohRoutes )
+    {
+        g_pSohRoutes->next = g_pRetiredRoutes;
+        g_pRetiredRoutes = g_pSohRoutes;
+    }
+
+    g_pBasicRoutes = pBasicRoutes;
+    g_pLongRoutes = pLongRoutes;
+    g_pSohRoutes = pSohRoutes;
+
+    MutexUnlock( &g_RoutesLock );
+}
+
+static void ImcFreeRoutes(void)
+{
+    ROUTE_TABLE *table;
+
+    RouteTableFree( g_pBasicRoutes );
+    RouteTableFree( g_pLongRoutes );
+    RouteTableFree( g_pSohRoutes );
+    g_pBasicRoutes = g_pLongRoutes = g_pSohRoutes = NULL;
+
+    while( NULL != g_pRetiredRoutes )
+    {
+        table = g_pRetiredRoutes;
+        g_pRetiredRoutes = table->next;
+        RouteTableFree( table );
+    }
+}
+
 int LoadIMC(const char *dllPath)
 {
+    IMC_MODULE *imc;
     int err;
 
+    if( g_nImcCount >= TNCC_MAX_IMCS )
+    {
+        outfmt( OUT_LEVEL_NORMAL, "Too many IMCs; \"%s\" not loaded\n", dllPath );
+        return TNC_RESULT_OTHER;
+    }
+
+    imc = &g_Imcs[ g_nImcCount ];
+    memset( imc, 0, sizeof( *imc ) );
+    imc->id = g_nImcCount;
+
     outfmt( OUT_LEVEL_NORMAL, "Loading IMC DLL: \"%s\"...", dllPath );
-    err = LoadImcDLL( dllPath, &imcFuncs );
+    err = LoadImcDLL( dllPath, &imc->funcs, &imc->hDLL );
     if (err) 
     {
         outfmt( OUT_LEVEL_NORMAL, " Error %d.\n", err );
+        if( NULL != imc->hDLL )
+            UnloadImcDLL( imc->hDLL );
         return err;
     }
 
-    outfmt( OUT_LEVEL_NORMAL, " Ok\n" );
+    ++g_nImcCount;
+    outfmt( OUT_LEVEL_NORMAL, " Ok (IMC ID %d)\n", imc->id );
     return TNC_RESULT_SUCCESS;
 }
 
@@ -89,102 +230,240 @@ int InitializeIMC(void)
 {
     TNC_Result result;
     TNC_Version actualVersion;
+    IMC_MODULE *imc;
+    unsigned i;
 
-    outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Initialize\n" );
-    result = (imcFuncs.pfnInitialize)(IMC_ID, TNC_IFIMC_VERSION_1, TNC_IFIMC_VERSION_1, &actualVersion);
-    outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Initialize result: %d.\n", result);
-    if (result != TNC_RESULT_SUCCESS) 
-        return result;
+    MutexInit( &g_RoutesLock );
 
-    if (imcFuncs.pfnProvideBind != NULL) 
+    for( i = 0; i < g_nImcCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ProvideBindFunction\n" );
-        result = (imcFuncs.pfnProvideBind)(0, &TNC_TNCC_BindFunction);
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ProvideBindFunction result: %d.\n", result);
+        imc = &g_Imcs[ i ];
+
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Initialize (IMC %d)\n", imc->id );
+        result = (imc->funcs.pfnInitialize)(imc->id, TNC_IFIMC_VERSION_1, TNC_IFIMC_VERSION_1, &actualVersion);
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Initialize result: %d.\n", result);
         if (result != TNC_RESULT_SUCCESS) 
             return result;
+
+        if (imc->funcs.pfnProvideBind != NULL) 
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ProvideBindFunction\n" );
+            result = (imc->funcs.pfnProvideBind)(imc->id, &TNC_TNCC_BindFunction);
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ProvideBindFunction result: %d.\n", result);
+            if (result != TNC_RESULT_SUCCESS) 
+                return result;
+        }
+
+        outfmt( OUT_LEVEL_NORMAL, "IMC %d initialized successfully\n\n", imc->id );
     }
 
-    outfmt( OUT_LEVEL_NORMAL, "IMC initialized successfully\n\n" );
     return 0;
 }
 
 int TerminateIMC(void)
 {
     TNC_Result result;
+    IMC_MODULE *imc;
+    unsigned i;
 
-    if( NULL != imcFuncs.pfnTerminate )
+    for( i = 0; i < g_nImcCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Terminate (IMC %d)\n", IMC_ID );
-        result = imcFuncs.pfnTerminate( IMC_ID );
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Terminate result: %d\n", result );
-    }
+        imc = &g_Imcs[ i ];
+
+        if( NULL != imc->funcs.pfnTerminate )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Terminate (IMC %d)\n", imc->id );
+            result = imc->funcs.pfnTerminate( imc->id );
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_Terminate result: %d\n", result );
+        }
 
-    free( g_pImcMessageTypes );
-    g_pImcMessageTypes = NULL;
-    g_nImcMessageTypesCount = 0;
+        TypeIndexFree( &imc->types );
+        TypeIndexFree( &imc->longTypes );
 
-	free( g_pImcMessageLongSubtypes );
-	free( g_pImcVendorIDs );
-	g_pImcMessageLongSubtypes = NULL;
-	g_pImcVendorIDs = NULL;
-	g_nImcMessageLongSubtypesCount = 0;
+        UnloadImcDLL( imc->hDLL );
+        memset( imc, 0, sizeof( *imc ) );
+    }
 
-    UnloadImcDLL();
+    ImcFreeRoutes();
+    MutexDestroy( &g_RoutesLock );
+
+    g_nImcCount = 0;
     return 0;
 }
 
-int IsMessageTypeSupported( TNC_MessageType type, TNC_MessageTypeList list, TNC_UInt32 count )
+/* Deliver a basic message to every IMC that registered its type */
+static void DeliverImcBasicMessage( TNC_ConnectionID cid, MESSAGE_BASIC *basicMessage )
 {
-    TNC_UInt32 i;
-    TNC_MessageType myType;
-    TNC_VendorID myVendor, vendor = EXTRACT_VENDOR( type );
-    TNC_MessageSubtype mySubtype, subtype = EXTRACT_SUBTYPE( type );
+    TNC_UInt32 buffer[ TNCC_MAX_IMCS ];
+    const TNC_UInt32 *ids;
+    IMC_MODULE *imc;
+    unsigned i, count;
+    TNC_Result rc;
 
-    if( NULL == list )
-        return 0;
+    count = RouteTableLookup( g_pBasicRoutes, EXTRACT_VENDOR( basicMessage->messageType ), 
+        EXTRACT_SUBTYPE( basicMessage->messageType ), g_nImcCount, ImcReceivesBasic, NULL, buffer, &ids );
 
-    for( i=0; i < count; ++i )
-    {
-        myType = list[ i ];
-        mySubtype = EXTRACT_SUBTYPE( myType );
-        myVendor = EXTRACT_VENDOR( myType );
-        if( myType == type 
-            || (TNC_VENDORID_ANY == myVendor && mySubtype == subtype)
-            || (TNC_SUBTYPE_ANY == mySubtype && myVendor == vendor)
-            || (TNC_SUBTYPE_ANY == mySubtype && TNC_VENDORID_ANY == myVendor) )
-            return 1;
-    }
+	if( 0 == count )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> Message type %#x not registered by any IMC; message not delivered!\n",
+			basicMessage->messageType );
+	}
 
-    return 0;
+	for( i = 0; i < count; ++i )
+	{
+		imc = &g_Imcs[ ids[ i ] ];
+
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage (IMC: %d, type: %#x, length: %d)\n", imc->id,
+			basicMessage->messageType, basicMessage->messageLength );
+
+		rc = imc->funcs.pfnReceiveMessage( imc->id, cid, basicMessage->message, 
+			basicMessage->messageLength, basicMessage->messageType );
+
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage result: %d\n", rc );
+	}
 }
 
-int IsMessageLongTypeSupported( TNC_MessageSubtype subtype, 
-							    TNC_VendorID vendorID,
-								TNC_MessageSubtypeList listOfSubTypes,
-							    TNC_VendorIDList listOfVendorIDs, 
-								TNC_UInt32 count )
+/* Deliver an SoHR entry to every IMC that registered its System Health ID */
+static void DeliverImcSohEntry( TNC_ConnectionID cid, const SOH_ENTRY *entry )
 {
-    TNC_UInt32 i;
-    TNC_VendorID myVendor;
-    TNC_MessageSubtype mySubtype;
+    TNC_UInt32 buffer[ TNCC_MAX_IMCS ];
+    const TNC_UInt32 *ids;
+    IMC_MODULE *imc;
+    unsigned i, count;
+    TNC_Result rc;
+
+    count = RouteTableLookup( g_pSohRoutes, EXTRACT_VENDOR( entry->systemHealthID ), EXTRACT_SUBTYPE( entry->systemHealthID ),
+        g_nImcCount, ImcReceivesSoh, NULL, buffer, &ids );
 
-	if( count == 0 )
-        return 0;
+	if( 0 == count )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> System health ID %#x not registered by any IMC; SoHR entry not delivered!\n",
+			entry->systemHealthID );
+	}
 
-    for( i=0; i < count; ++i )
+	for( i = 0; i < count; ++i )
+	{
+		imc = &g_Imcs[ ids[ i ] ];
+
+		/* This is the preferred way of delivery */
+		if( imc->funcs.pfnReceiveMessageSOH )
+		{
+			outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageSOH (IMC: %d, system health ID: %#x, length: %d)\n", imc->id,
+				entry->systemHealthID, entry->length );
+
+			rc = imc->funcs.pfnReceiveMessageSOH( imc->id, cid, entry->data, entry->length, entry->systemHealthID );
+
+			outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageSOH result: %d\n", rc );
+		}
+		else
+		{
+			/* Without TNC_IMC_ReceiveMessageSOH the entry goes to
+			   TNC_IMC_ReceiveMessage with its System Health ID as the type */
+			outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage (IMC: %d, type: %#x, length: %d)\n", imc->id,
+				entry->systemHealthID, entry->length );
+
+			rc = imc->funcs.pfnReceiveMessage( imc->id, cid, entry->data, entry->length, entry->systemHealthID );
+
+			outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage result: %d\n", rc );
+		}
+	}
+}
+
+/* Split an SoHR into its entries and deliver each one to the IMCs that
+   receive it. Entries before a malformed attribute have been delivered by the
+   time it is found; the rest of the message is dropped. */
+static void DeliverImcSohMessage( TNC_ConnectionID cid, MESSAGE_SOH *sohMessage )
+{
+    SOH_PARSER parser;
+    SOH_ENTRY entry;
+    eSOH_RESULT result;
+
+    SohParserInit( &parser, sohMessage->sohReportEntry, sohMessage->sohRELength );
+    while( SOH_RESULT_ENTRY == (result = SohNextEntry( &parser, &entry )) )
+        DeliverImcSohEntry( cid, &entry );
+
+    if( SOH_RESULT_MALFORMED == result )
     {
-        mySubtype = listOfSubTypes[i];
-		myVendor  = listOfVendorIDs[i];
-
-        if( (subtype == mySubtype && vendorID == myVendor)
-			|| (TNC_VENDORID_ANY == myVendor && mySubtype == subtype)
-            || (TNC_SUBTYPE_ANY == mySubtype && myVendor == vendorID)
-            || (TNC_SUBTYPE_ANY == mySubtype && TNC_VENDORID_ANY == myVendor) )
-            return 1;
+        outfmt( OUT_LEVEL_NORMAL, "> Malformed SoHR at offset %u of %d; rest of the message not delivered!\n",
+            SohParserOffset( &parser ), sohMessage->sohRELength );
     }
+}
 
-    return 0;
+/* Deliver a long message to one IMC that is known to receive it */
+static void DeliverImcLongMessageTo( IMC_MODULE *imc, TNC_ConnectionID cid, MESSAGE_LONG *longTypeMessage, char *pszDelivery )
+{
+	TNC_MessageType longMessageType = 0;
+    TNC_Result rc;
+
+	/* This is the preferred way of delivery */
+	if (imc->funcs.pfnReceiveMessageLong) 
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageLong (IMC: %d, vendorID: %#x, subtype: %#x, length: %d)\n", imc->id,
+			longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
+
+		rc = imc->funcs.pfnReceiveMessageLong( imc->id, cid, longTypeMessage->messageFlags, 
+			longTypeMessage->message, longTypeMessage->messageLength, 
+			longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, 
+			longTypeMessage->imvID, longTypeMessage->imcID);
+
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageLong%s result: %d\n", pszDelivery, rc );
+	} 
+	else
+	{
+		/* IMC doesn't implement TNC_IMC_ReceiveMessageLong function but
+		   TNCC can still delive the message using imc->funcs.pfnReceiveMessage.*/
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage (IMC: %d, vendorID: %#x, subtype: %#x, length: %d)\n", imc->id,
+			longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
+
+		/* Create a single message type from subtype and vendorID */
+		longMessageType = (longTypeMessage->messageVendorID << 8 | longTypeMessage->messageSubtype);
+
+		rc = imc->funcs.pfnReceiveMessage( imc->id, cid, longTypeMessage->message, 
+			longTypeMessage->messageLength, longMessageType );
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage%s result: %d\n", pszDelivery, rc );
+	}
+}
+
+/* Deliver a long message to the IMC it is addressed to if it is marked for
+   exclusive delivery, otherwise to every IMC that registered its type */
+static void DeliverImcLongMessage( TNC_ConnectionID cid, MESSAGE_LONG *longTypeMessage )
+{
+    TNC_UInt32 buffer[ TNCC_MAX_IMCS ];
+    const TNC_UInt32 *ids;
+    IMC_MODULE *imc;
+    unsigned i, count;
+
+	if( (longTypeMessage->messageFlags & TNC_MESSAGE_FLAGS_EXCLUSIVE) == TNC_MESSAGE_FLAGS_EXCLUSIVE )
+	{
+		/* Exclusive messages go to their destination only, whether or not it
+		   registered the type. This can fail if the destination is not loaded
+		   OR longTypeMessage->imcID == TNC_IMCID_ANY */
+		imc = GetImc( longTypeMessage->imcID );
+		if( NULL != imc && (NULL != imc->funcs.pfnReceiveMessageLong ||
+			ImcReceivesLong( NULL, imc->id, longTypeMessage->messageVendorID, longTypeMessage->messageSubtype )) )
+		{
+			DeliverImcLongMessageTo( imc, cid, longTypeMessage, " (Exclusive Delivery)" );
+		}
+		else
+		{
+			outfmt( OUT_LEVEL_NORMAL, "> Message marked for exclusive delivery to IMC %d; not delivered!\n",
+				longTypeMessage->imcID );
+		}
+
+		return;
+	}
+
+	count = RouteTableLookup( g_pLongRoutes, longTypeMessage->messageVendorID, longTypeMessage->messageSubtype,
+		g_nImcCount, ImcReceivesLong, NULL, buffer, &ids );
+
+	if( 0 == count )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> Message type (vendor ID %#x, message subtype %#x) not registered by any IMC; "
+			"message not delivered!\n", longTypeMessage->messageVendorID, longTypeMessage->messageSubtype );
+	}
+
+	for( i = 0; i < count; ++i )
+		DeliverImcLongMessageTo( &g_Imcs[ ids[ i ] ], cid, longTypeMessage, "" );
 }
 
 unsigned DeliverImcMessages( TNC_ConnectionID cid )
@@ -195,160 +474,32 @@ unsigned DeliverImcMessages( TNC_ConnectionID cid )
 	MESSAGE_BASIC  * basicMessage = NULL;
 	MESSAGE_SOH    * sohMessage = NULL;
 	MESSAGE_LONG   * longTypeMessage = NULL;
-	TNC_MessageType  sohMessageType = 0;
-	TNC_MessageType  longMessageType = 0;
-    TNC_Result rc;
-    unsigned i;
+	MESSAGE_BATCH batch;
+    unsigned i, count;
 
-	/* Deliver each message to the IMC */
-	for (i=0; i < QueueGetMessageCount(); ++i)
+	/* Deliver each message to the IMCs that receive it; each IMC still sees
+	   its messages in the order they were queued */
+	count = QueueGetBatch( cid, QUEUE_TO_IMC, &batch );
+	for (i=0; i < count; ++i)
 	{
 		/* Depending on the message category, it needs to be delivered differently */
-		messageCategory = QueueGetMessageCategory(i);
+		messageCategory = BatchGetMessageCategory(&batch, i);
 
 		if (messageCategory == MESSAGE_CATEGORY_BASIC) 
 		{
 			/* Now that we know the message type, retrieve the message */
-			QueueGetMessage(i, &basicMessage);
-
-			outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage (type: %#x, length: %d)\n", 
-				basicMessage->messageType, basicMessage->messageLength );
-
-			if( imcFuncs.pfnReceiveMessage )
-			{
-				if( IsMessageTypeSupported(basicMessage->messageType, g_pImcMessageTypes, g_nImcMessageTypesCount) )
-				{
-					rc = imcFuncs.pfnReceiveMessage( IMC_ID, cid, basicMessage->message, 
-						basicMessage->messageLength, basicMessage->messageType );
-
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			}
-			else
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage TYPE NOT SUPPORTED!\n" );
-			}
+			basicMessage = BatchGetMessage(&batch, i);
+			DeliverImcBasicMessage( cid, basicMessage );
 		}
-		else if (messageCategory == MESSAGE_CATEGORY_SOH)
+		else if (messageCategory == MESSAGE_CATEGORY_SOH) 
 		{
-			/* Now that we know the message type, retrieve the message */
-			QueueGetMessageSOH(i, &sohMessage);
-
-			/* This is the preferred way of delivery */
-			if (imcFuncs.pfnReceiveMessageSOH)
-			{
-				/* The received buffer is complete SOHReportEntry. TNCC will parse
-				   it into individual SOHRReportEntry buffers and deliver each buffer
-				   to the IMC if IMC is supposed to receive it. Since logic for 
-				   parsing SOH message is somewhat involved, it is not implemented.
-
-				   Deliver the parsed SOHRReportEntries using imcFuncs.pfnReceiveMessageSOH.
-				*/
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageSOH (length: %d)\n", 
-					sohMessage->sohRELength);
-				outfmt( OUT_LEVEL_NORMAL, "> Dispatching SOH messages to IMC **NOT IMPLEMENTED**\n");
-			} 
-			else if (imcFuncs.pfnReceiveMessage)
-			{
-				/* IMC didn't implement TNC_IMC_ReceiveMessageSOH function but 
-				   TNCC can still delive the message using the pfnReceiveMessage. 
-				   'sohMessageType' is extracted from the message. */
-
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage (type: %#x, length: %d)\n", 
-					sohMessageType, sohMessage->sohRELength);
-
-				if( IsMessageTypeSupported( sohMessageType, g_pImcMessageTypes, g_nImcMessageTypesCount ) )
-				{
-					rc = imcFuncs.pfnReceiveMessage( IMC_ID, cid, sohMessage->sohReportEntry, 
-						sohMessage->sohRELength, sohMessageType );
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			}
-			else 
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage and "
-						"TNC_IMC_ReceiveMessageSOH NOT SUPPORTED!\n" );
-			}
-		} 
+			sohMessage = BatchGetMessageSOH(&batch, i);
+			DeliverImcSohMessage( cid, sohMessage );
+		}
 		else if (messageCategory == MESSAGE_CATEGORY_LONG ) 
 		{
-			/* Now that we know the message type, retrieve the message */
-			QueueGetMessageLong(i, &longTypeMessage);
-
-			/* This is the preferred way of delivery */
-			if (imcFuncs.pfnReceiveMessageLong) 
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageLong (vendorID: %#x, subtype: %#x, length: %d)\n", 
-					longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
-
-				if( (longTypeMessage->messageFlags & TNC_MESSAGE_FLAGS_EXCLUSIVE) == TNC_MESSAGE_FLAGS_EXCLUSIVE )
-				{
-					if(longTypeMessage->imcID == IMC_ID)
-					{
-						rc = imcFuncs.pfnReceiveMessageLong( IMC_ID, cid, longTypeMessage->messageFlags, 
-							longTypeMessage->message, longTypeMessage->messageLength, 
-							longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, 
-							longTypeMessage->imvID, longTypeMessage->imcID);
-
-						outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageLong (Exclusive Delivery) result: %d\n", rc );
-					}
-					else
-					{
-						/* Ignore it. This can happen if,
-						   longTypeMessage->imcID matches with any other IMC OR
-						   longTypeMessage->imcID == TNC_IMCID_ANY */
-						outfmt( OUT_LEVEL_NORMAL, "> Message marked for exclusive delivery to another IMC; not delivered!\n" );
-					}
-				}
-				else if( IsMessageLongTypeSupported( longTypeMessage->messageSubtype, longTypeMessage->messageVendorID, 
-												g_pImcMessageLongSubtypes, g_pImcVendorIDs,
-												g_nImcMessageLongSubtypesCount) )
-				{
-					rc = imcFuncs.pfnReceiveMessageLong( IMC_ID, cid, longTypeMessage->messageFlags, 
-						longTypeMessage->message, longTypeMessage->messageLength, 
-						longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, 
-						longTypeMessage->imvID, longTypeMessage->imcID);
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessageLong result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			} 
-			else if (imcFuncs.pfnReceiveMessage) 
-			{
-				/* IMC doesn't implement TNC_IMC_ReceiveMessageLong function but 
-				   TNCC can still delive the message using imcFuncs.pfnReceiveMessage.*/
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage (vendorID: %#x, subtype: %#x, length: %d)\n", 
-					longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
-
-				/* Create a single message type from subtype and vendorID */
-				longMessageType = (longTypeMessage->messageVendorID << 8 | longTypeMessage->messageSubtype);
-
-				if( IsMessageTypeSupported( longMessageType, g_pImcMessageTypes, g_nImcMessageTypesCount ) )
-				{
-					rc = imcFuncs.pfnReceiveMessage( IMC_ID, cid, longTypeMessage->message, 
-						longTypeMessage->messageLength, longMessageType );
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			}
-			else
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_ReceiveMessage and "
-					"TNC_IMC_ReceiveMessageLong NOT SUPPORTED!\n" );
-			}
+			longTypeMessage = BatchGetMessageLong(&batch, i);
+			DeliverImcLongMessage( cid, longTypeMessage );
 		}
 	}
 
@@ -358,14 +509,23 @@ unsigned DeliverImcMessages( TNC_ConnectionID cid )
 unsigned NotifyImcConnectionState( TNC_ConnectionID cid, TNC_ConnectionState state )
 {
     TNC_Result rc = TNC_RESULT_SUCCESS;
+    IMC_MODULE *imc;
+    unsigned i;
+
+    TraceCall( TRACE_EVENT_CONNECTION_STATE, 0, cid, 0, state, 0, NULL, TNC_RESULT_SUCCESS );
 
-    if( NULL != imcFuncs.pfnNotifyConnChg )
+    for( i = 0; i < g_nImcCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_NotifyConnectionChange (IMC: %d, CID: %d, state: `%s')\n", 
-            IMC_ID, cid, g_pszConnStates[ state ] );
+        imc = &g_Imcs[ i ];
+
+        if( NULL != imc->funcs.pfnNotifyConnChg )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_NotifyConnectionChange (IMC: %d, CID: %d, state: `%s')\n", 
+                imc->id, cid, g_pszConnStates[ state ] );
 
-        rc = imcFuncs.pfnNotifyConnChg( IMC_ID, cid, state );
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_NotifyConnectionChange result: %d\n", rc );
+            rc = imc->funcs.pfnNotifyConnChg( imc->id, cid, state );
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_NotifyConnectionChange result: %d\n", rc );
+        }
     }
 
     return rc;
@@ -373,11 +533,18 @@ unsigned NotifyImcConnectionState( TNC_ConnectionID cid, TNC_ConnectionState sta
 
 unsigned ImcBeginHandshake( TNC_ConnectionID cid )
 {
-    TNC_Result rc;
+    TNC_Result rc = TNC_RESULT_SUCCESS;
+    IMC_MODULE *imc;
+    unsigned i;
 
-    outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BeginHandshake (IMC: %d, CID: %d)\n", IMC_ID, cid );
-    rc = imcFuncs.pfnBeginHandshake( IMC_ID, cid );
-    outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BeginHandshake result: %d\n", rc );
+    for( i = 0; i < g_nImcCount; ++i )
+    {
+        imc = &g_Imcs[ i ];
+
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BeginHandshake (IMC: %d, CID: %d)\n", imc->id, cid );
+        rc = imc->funcs.pfnBeginHandshake( imc->id, cid );
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BeginHandshake result: %d\n", rc );
+    }
 
     return rc;
 }
@@ -385,12 +552,19 @@ unsigned ImcBeginHandshake( TNC_ConnectionID cid )
 unsigned ImcBatchEnding( TNC_ConnectionID cid )
 {
     TNC_Result rc = TNC_RESULT_SUCCESS;
+    IMC_MODULE *imc;
+    unsigned i;
 
-    if( NULL != imcFuncs.pfnBatchEnding )
+    for( i = 0; i < g_nImcCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BatchEnding (IMC: %d, CID: %d)\n", IMC_ID, cid );
-        rc = imcFuncs.pfnBatchEnding( IMC_ID, cid );
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BatchEnding result: %d\n", rc );
+        imc = &g_Imcs[ i ];
+
+        if( NULL != imc->funcs.pfnBatchEnding )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BatchEnding (IMC: %d, CID: %d)\n", imc->id, cid );
+            rc = imc->funcs.pfnBatchEnding( imc->id, cid );
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMC_BatchEnding result: %d\n", rc );
+        }
     }
 
     return rc;
@@ -404,21 +578,23 @@ TNC_Result TNC_TNCC_ReportMessageTypes(
 /*in*/  TNC_MessageTypeList supportedTypes,
 /*in*/  TNC_UInt32 typeCount)
 {
+    IMC_MODULE *imc = GetImc( imcID );
+    TNC_Result rc;
     unsigned i;
 
-    if( typeCount > g_nImcMessageTypesCount )
-		g_pImcMessageTypes = (TNC_MessageTypeList) realloc( g_pImcMessageTypes, sizeof( *supportedTypes ) * typeCount );
+    if( NULL == imc )
+    {
+        TraceMessageTypes( 0, imcID, supportedTypes, typeCount, TNC_RESULT_INVALID_PARAMETER );
+        return TNC_RESULT_INVALID_PARAMETER;
+    }
 
     outfmt( OUT_LEVEL_NORMAL, "< TNC_TNCC_ReportMessageTypes (IMC %d)", imcID );
-    if( typeCount > 0 )
+    if( typeCount > 0 && NULL != supportedTypes )
     {
-        memcpy( g_pImcMessageTypes, supportedTypes, sizeof( *supportedTypes ) * typeCount );
-        g_nImcMessageTypesCount = typeCount;
-
         for( i=0; i < typeCount; ++i )
             outfmt( OUT_LEVEL_NORMAL, "%c%#x%c", 
                 0 == i ? '\n' : ' ', 
-                g_pImcMessageTypes[ i ], 
+                supportedTypes[ i ], 
                 i == typeCount - 1 ? '\n' : ',' );
     }
     else
@@ -426,7 +602,11 @@ TNC_Result TNC_TNCC_ReportMessageTypes(
         outfmt( OUT_LEVEL_NORMAL, "\nEmpty message list. No messages will be delivered to this IMC!\n" );
 	}
 
-    return TNC_RESULT_SUCCESS;
+    rc = TypeIndexBuild( &imc->types, supportedTypes, typeCount ) ? TNC_RESULT_OTHER : TNC_RESULT_SUCCESS;
+    ImcRebuildRoutes();
+    TraceMessageTypes( 0, imcID, supportedTypes, typeCount, rc );
+
+    return rc;
 }
 
 TNC_Result TNC_TNCC_ReportMessageTypesLong(
@@ -435,26 +615,24 @@ TNC_Result TNC_TNCC_ReportMessageTypesLong(
 /*in*/  TNC_MessageSubtypeList supportedSubtypes,
 /*in*/  TNC_UInt32 typeCount)
 {
+    IMC_MODULE *imc = GetImc( imcID );
+    TNC_Result rc;
     unsigned i;
 
-    if( typeCount > g_nImcMessageLongSubtypesCount )
-	{
-		g_pImcMessageLongSubtypes = (TNC_MessageSubtypeList) realloc( g_pImcMessageLongSubtypes, sizeof( *supportedSubtypes ) * typeCount );
-		g_pImcVendorIDs = (TNC_VendorIDList) realloc( g_pImcVendorIDs, sizeof(TNC_VendorID) * typeCount );
-	}
+    if( NULL == imc )
+    {
+        TraceMessageTypesLong( 0, imcID, supportedVendorIDs, supportedSubtypes, typeCount, TNC_RESULT_INVALID_PARAMETER );
+        return TNC_RESULT_INVALID_PARAMETER;
+    }
 
     outfmt( OUT_LEVEL_NORMAL, "< TNC_TNCC_ReportMessageTypesLong (IMC %d)", imcID );
-    if( typeCount > 0 )
+    if( typeCount > 0 && NULL != supportedVendorIDs && NULL != supportedSubtypes )
     {
-        memcpy( g_pImcMessageLongSubtypes, supportedSubtypes, sizeof( *supportedSubtypes ) * typeCount );
-		memcpy( g_pImcVendorIDs, supportedVendorIDs, sizeof( *supportedVendorIDs ) * typeCount );
-        g_nImcMessageLongSubtypesCount = typeCount;
-
         for( i=0; i < typeCount; ++i )
 			outfmt( OUT_LEVEL_NORMAL, "%c(vendor ID %#x, message subtype %#x)%c", 
                 0 == i ? '\n' : ' ', 
-				g_pImcVendorIDs[i],
-                g_pImcMessageLongSubtypes[i],
+				supportedVendorIDs[i],
+                supportedSubtypes[i],
                 i == typeCount - 1 ? '\n' : ',' );
     }
     else
@@ -462,7 +640,12 @@ TNC_Result TNC_TNCC_ReportMessageTypesLong(
         outfmt( OUT_LEVEL_NORMAL, "\nEmpty message list. No messages will be delivered to this IMC!\n" );
 	}
 
-    return TNC_RESULT_SUCCESS;
+    rc = TypeIndexBuildLong( &imc->longTypes, supportedVendorIDs, supportedSubtypes, typeCount ) ?
+        TNC_RESULT_OTHER : TNC_RESULT_SUCCESS;
+    ImcRebuildRoutes();
+    TraceMessageTypesLong( 0, imcID, supportedVendorIDs, supportedSubtypes, typeCount, rc );
+
+    return rc;
 }
 
 TNC_Result TNC_TNCC_SendMessage(
@@ -484,7 +667,11 @@ TNC_Result TNC_TNCC_SendMessage(
 	basicMessage.messageLength = messageLength;
 	basicMessage.messageType = messageType;
 
-    QueueAddMessage( &basicMessage );
+    QueueAddMessage( connectionID, QUEUE_TO_IMV, &basicMessage );
+
+    TraceMessage( TRACE_EVENT_SEND_MESSAGE, 0, connectionID, imcID, 0, EXTRACT_VENDOR( messageType ), EXTRACT_SUBTYPE( messageType ),
+        0, message, messageLength, TNC_RESULT_SUCCESS );
+    CorpusMessage( MESSAGE_CATEGORY_BASIC, EXTRACT_VENDOR( messageType ), EXTRACT_SUBTYPE( messageType ), 0, 0, message, messageLength );
 
     return TNC_RESULT_SUCCESS;
 }
@@ -506,7 +693,10 @@ TNC_Result TNC_TNCC_SendMessageSOH(
 	sohMessage.sohReportEntry = sohReportEntry;
 	sohMessage.sohRELength = sohRELength;
 
-    QueueAddMessageSOH( &sohMessage );
+    QueueAddMessageSOH( connectionID, QUEUE_TO_IMV, &sohMessage );
+
+    TraceMessage( TRACE_EVENT_SEND_MESSAGE_SOH, 0, connectionID, imcID, 0, 0, 0, 0, sohReportEntry, sohRELength, TNC_RESULT_SUCCESS );
+    CorpusMessage( MESSAGE_CATEGORY_SOH, 0, 0, 0, 0, sohReportEntry, sohRELength );
 
     return TNC_RESULT_SUCCESS;
 }
@@ -539,7 +729,11 @@ TNC_Result TNC_TNCC_SendMessageLong(
 	longTypeMessage.messageSubtype = messageSubtype;
 	longTypeMessage.messageVendorID = messageVendorID;
 
-    QueueAddMessageLong( &longTypeMessage );
+    QueueAddMessageLong( connectionID, QUEUE_TO_IMV, &longTypeMessage );
+
+    TraceMessage( TRACE_EVENT_SEND_MESSAGE_LONG, 0, connectionID, imcID, destinationIMVID, messageVendorID, messageSubtype,
+        messageFlags, message, messageLength, TNC_RESULT_SUCCESS );
+    CorpusMessage( MESSAGE_CATEGORY_LONG, messageVendorID, messageSubtype, messageFlags, destinationIMVID, message, messageLength );
 
     return TNC_RESULT_SUCCESS;
 }
@@ -549,6 +743,7 @@ TNC_Result TNC_TNCC_RequestHandshakeRetry(
 /*in*/  TNC_ConnectionID connectionID,
 /*in*/  TNC_RetryReason reason)
 {
+    TraceCall( TRACE_EVENT_REQUEST_RETRY, 0, connectionID, imcID, reason, 0, NULL, TNC_RESULT_SUCCESS );
     return TNC_RESULT_SUCCESS;
 }
 
@@ -580,5 +775,6 @@ TNC_Result TNC_TNCC_BindFunction(
     else if (!strcmp(functionName, "TNC_TNCC_SendMessageLong"))
         *pOutfunctionPointer = &TNC_TNCC_SendMessageLong;
 
+    TraceCall( TRACE_EVENT_BIND_FUNCTION, 0, 0, imcID, 0, 0, functionName, TNC_RESULT_SUCCESS );
     return TNC_RESULT_SUCCESS;
 }
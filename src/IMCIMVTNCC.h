@@ -52,6 +52,9 @@ typedef struct IMCFuncs_struct
     TNC_IMC_ProvideBindFunctionPointer			pfnProvideBind;
 } IMCFuncs;
 
+/* Maximum number of IMCs the TNCC can load at the same time */
+#define TNCC_MAX_IMCS  32
+
 int LoadIMC(const char *dllPath);
 int InitializeIMC(void);
 int TerminateIMC(void);
@@ -0,0 +1,123 @@
+/*
+ * IMCIMVTNCCUnix.c
+ *
+ * UNIX/Linux-specific portions of IMCIMVTester TNCC Code
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stddef.h>
+#include "IMCIMVTNCC.h"
+#include "IMCIMVTester.h"
+#include "output.h"
+
+
+/* LoadEntrypoint
+ *
+ * Load a shared object entrypoint into a function table.
+ *
+ * Load the entrypoint named "entryName" from the shared object
+ * with handle "dll" and store the function pointer at the location
+ * pointed to by "funcPtr". In case of error, store NULL as
+ * the function pointer.
+ */
+
+void LoadEntryPoint(void *dll, char *entryName, void **funcPtr) 
+{
+    *funcPtr = dlsym( dll, entryName );
+}
+
+
+/* OpenSharedObject
+ *
+ * dlopen the shared object at dllPath, binding symbols immediately
+ * unless lazy binding was requested and keeping its symbols local
+ * unless global visibility was requested. Local symbols keep
+ * several IMCs and IMVs that export the same names isolated from
+ * each other.
+ */
+
+void* OpenSharedObject(const char *dllPath)
+{
+    int flags;
+    void *dll;
+
+    flags = (g_nLoadFlags & LOAD_FLAG_LAZY) ? RTLD_LAZY : RTLD_NOW;
+    flags |= (g_nLoadFlags & LOAD_FLAG_GLOBAL) ? RTLD_GLOBAL : RTLD_LOCAL;
+
+    dll = dlopen( dllPath, flags );
+    if( NULL == dll )
+        outfmt( OUT_LEVEL_NORMAL, " %s", dlerror() );
+
+    return dll;
+}
+
+
+/* LoadImcDLL
+ *
+ * Load an IMC from the shared object with path dllPath, filling
+ * in function table at funcTable. The shared object handle is
+ * stored at phDLL even on failure so the caller can close it.
+ * Return an errno value in case of error, 0 for success
+ */
+
+int LoadImcDLL(const char *dllPath, IMCFuncs *funcTable, void **phDLL) 
+{
+    void *dll;
+
+    dll = *phDLL = OpenSharedObject( dllPath );
+    if( NULL == dll )
+        return ENOENT;
+    
+    LoadEntryPoint( dll, "TNC_IMC_Initialize", (void**)&funcTable->pfnInitialize );
+    if( NULL == funcTable->pfnInitialize )
+        return ENOSYS;
+
+    LoadEntryPoint( dll, "TNC_IMC_BeginHandshake", (void**)&funcTable->pfnBeginHandshake );
+    if( NULL == funcTable->pfnBeginHandshake )
+        return ENOSYS;
+
+    LoadEntryPoint( dll, "TNC_IMC_NotifyConnectionChange", (void**)&funcTable->pfnNotifyConnChg );
+    LoadEntryPoint( dll, "TNC_IMC_ReceiveMessage", (void**)&funcTable->pfnReceiveMessage );
+	LoadEntryPoint( dll, "TNC_IMC_ReceiveMessageSOH", (void**)&funcTable->pfnReceiveMessageSOH );
+	LoadEntryPoint( dll, "TNC_IMC_ReceiveMessageLong", (void**)&funcTable->pfnReceiveMessageLong );
+    LoadEntryPoint( dll, "TNC_IMC_BatchEnding", (void**)&funcTable->pfnBatchEnding );
+    LoadEntryPoint( dll, "TNC_IMC_Terminate", (void**)&funcTable->pfnTerminate );
+    LoadEntryPoint( dll, "TNC_IMC_ProvideBindFunction", (void**)&funcTable->pfnProvideBind );
+    return 0;
+}
+
+void UnloadImcDLL(void *hDLL)
+{
+    if( NULL != hDLL )
+        dlclose( hDLL );
+}
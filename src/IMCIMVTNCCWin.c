@@ -37,9 +37,6 @@
 #include "IMCIMVTNCC.h"
 
 
-static HMODULE g_imcDLL = 0;
-
-
 /* LoadEntrypoint
  *
  * Load a DLL entrypoint into a function table.
@@ -59,36 +56,40 @@ void LoadEntryPoint(HMODULE dll, char *entryName, void **funcPtr)
 /* LoadIMC
  *
  * Load an IMC from DLL with path dllPath, filling in function
- * table at funcTable.
+ * table at funcTable. The module handle is stored at phDLL
+ * even on failure so the caller can free it.
  * Return a Windows error code in case of error, 0 for success
  */
 
-int LoadImcDLL(const char *dllPath, IMCFuncs *funcTable) 
+int LoadImcDLL(const char *dllPath, IMCFuncs *funcTable, void **phDLL) 
 {
-    g_imcDLL = LoadLibrary( dllPath );
-    if( !g_imcDLL )
+    HMODULE dll;
+
+    dll = LoadLibrary( dllPath );
+    *phDLL = dll;
+    if( !dll )
         return GetLastError();
     
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_Initialize", (void**)&funcTable->pfnInitialize );
+    LoadEntryPoint( dll, "TNC_IMC_Initialize", (void**)&funcTable->pfnInitialize );
     if( NULL == funcTable->pfnInitialize )
         return GetLastError();
 
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_BeginHandshake", (void**)&funcTable->pfnBeginHandshake );
+    LoadEntryPoint( dll, "TNC_IMC_BeginHandshake", (void**)&funcTable->pfnBeginHandshake );
     if( NULL == funcTable->pfnBeginHandshake )
         return GetLastError();
 
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_NotifyConnectionChange", (void**)&funcTable->pfnNotifyConnChg );
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_ReceiveMessage", (void**)&funcTable->pfnReceiveMessage );
-	LoadEntryPoint( g_imcDLL, "TNC_IMC_ReceiveMessageSOH", (void**)&funcTable->pfnReceiveMessageSOH );
-	LoadEntryPoint( g_imcDLL, "TNC_IMC_ReceiveMessageLong", (void**)&funcTable->pfnReceiveMessageLong );
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_BatchEnding", (void**)&funcTable->pfnBatchEnding );
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_Terminate", (void**)&funcTable->pfnTerminate );
-    LoadEntryPoint( g_imcDLL, "TNC_IMC_ProvideBindFunction", (void**)&funcTable->pfnProvideBind );
+    LoadEntryPoint( dll, "TNC_IMC_NotifyConnectionChange", (void**)&funcTable->pfnNotifyConnChg );
+    LoadEntryPoint( dll, "TNC_IMC_ReceiveMessage", (void**)&funcTable->pfnReceiveMessage );
+	LoadEntryPoint( dll, "TNC_IMC_ReceiveMessageSOH", (void**)&funcTable->pfnReceiveMessageSOH );
+	LoadEntryPoint( dll, "TNC_IMC_ReceiveMessageLong", (void**)&funcTable->pfnReceiveMessageLong );
+    LoadEntryPoint( dll, "TNC_IMC_BatchEnding", (void**)&funcTable->pfnBatchEnding );
+    LoadEntryPoint( dll, "TNC_IMC_Terminate", (void**)&funcTable->pfnTerminate );
+    LoadEntryPoint( dll, "TNC_IMC_ProvideBindFunction", (void**)&funcTable->pfnProvideBind );
     return 0;
 }
 
-void UnloadImcDLL(void)
+void UnloadImcDLL(void *hDLL)
 {
-    if( NULL != g_imcDLL )
-        FreeLibrary( g_imcDLL );
+    if( NULL != hDLL )
+        FreeLibrary( (HMODULE) hDLL );
 }
@@ -36,103 +36,885 @@
 #include "IMCIMVTester.h"
 #include "IMCIMVTNCS.h"
 #include "msgqueue.h"
+#include "typeindex.h"
+#include "soh.h"
+#include "trace.h"
+#include "tncthread.h"
 #include "output.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-/* TNCS will assign this IMV ID after loading the IMV */
-#define IMV_ID  0
+/* IMVs loaded by the TNCS. An IMV's ID is its index in this table, so the
+   TNCS_* callbacks can find the calling IMV directly. */
+typedef struct IMV_MODULE_tag
+{
+    TNC_IMVID id;
+    void *hDLL;
+    IMVFuncs funcs;
+
+    /* Message types supported by IMV in TNC_TNCS_ReportMessageTypes */
+    TYPE_INDEX types;
+
+    /* Message types supported by IMV in TNC_TNCS_ReportMessageTypesLong */
+    TYPE_INDEX longTypes;
+} IMV_MODULE;
+
+static IMV_MODULE g_Imvs[ TNCS_MAX_IMVS ];
+static unsigned g_nImvCount = 0;
+
+/* Routing tables that map a message type to the IMVs receiving it. They are
+   replaced whenever an IMV reports its message types. A replaced table may
+   still be in use by a thread delivering messages, so it is retired rather
+   than freed until the IMVs are terminated. */
+static ROUTE_TABLE * volatile g_pBasicRoutes = NULL;
+static ROUTE_TABLE * volatile g_pLongRoutes = NULL;
+static ROUTE_TABLE * volatile g_pSohRoutes = NULL;
+static ROUTE_TABLE *g_pRetiredRoutes = NULL;
+static TNC_MUTEX g_RoutesLock;
+
+/* Recommendation an IMV provided in the current handshake of a connection */
+typedef struct IMV_RESULT_tag
+{
+    TNC_IMV_Action_Recommendation nRecommendation;
+    TNC_IMV_Evaluation_Result nEvaluation;
+    unsigned bProvided;
+} IMV_RESULT;
+
+/* An attribute of a connection, for TNC_TNCS_GetAttribute. Values up to
+   CONN_ATTRIBUTE_INLINE_SIZE bytes are kept in the entry itself; a larger one
+   holds a reference to the buffer it lies in, so the SOH of a batch is taken
+   from the message that carried it without being copied. */
+#define CONN_ATTRIBUTE_INLINE_SIZE 32
+#define CONN_ATTRIBUTE_MIN_SLOTS 4
+
+typedef struct CONN_ATTRIBUTE_tag
+{
+    TNC_AttributeID id;
+    TNC_IMVID imvID;					/* IMV that set it, or IMV_ID_ALL */
+    TNC_UInt32 length;
+    MESSAGE_BUFFER *buffer;				/* NULL if the value is inline */
+    TNC_BufferReference data;			/* Value within the buffer */
+    unsigned char value[ CONN_ATTRIBUTE_INLINE_SIZE ];
+} CONN_ATTRIBUTE;
+
+#define CONN_ATTRIBUTE_DATA(attr) (NULL != (attr)->buffer ? (attr)->data : (attr)->value)
+
+/* What the TNCS knows about a connection, from CREATE to DELETE. Only the
+   thread driving a connection creates and deletes it, so a connection that
+   was found stays valid for the rest of the call. Its attributes may be read
+   by several IMVs at once, so they are guarded by their own lock. */
+typedef struct TNCS_CONNECTION_tag
+{
+    struct TNCS_CONNECTION_tag *next;	/* Hash bucket chain */
+    TNC_ConnectionID cid;
+    TNC_MUTEX attributesLock;
+    CONN_ATTRIBUTE *attributes;
+    unsigned nAttributes;
+    unsigned nAttributeSlots;
+    IMV_RESULT results[ 1 ];			/* One per IMV */
+} TNCS_CONNECTION;
+
+/* Connections are kept in a sharded hash table, like the message queues */
+#define CONN_TABLE_SHARD_BITS 4
+#define CONN_TABLE_SHARDS (1 << CONN_TABLE_SHARD_BITS)
+#define CONN_TABLE_MIN_BUCKETS 16
+#define CONN_HASH(cid) ((unsigned) (cid) * 2654435761u)
+#define CONN_SHARD(hash) (&g_ConnShards[ (hash) >> (32 - CONN_TABLE_SHARD_BITS) ])
+
+typedef struct CONN_SHARD_tag
+{
+    TNC_MUTEX lock;
+    TNCS_CONNECTION **table;
+    unsigned size;
+    unsigned count;
+} CONN_SHARD;
+
+static CONN_SHARD g_ConnShards[ CONN_TABLE_SHARDS ];
+
+static eRECOMMENDATION_POLICY g_eRecommendationPolicy = RECOMMENDATION_POLICY_DENY_WINS;
+
+/* Preferred language of the endpoints, as the TNCC would report it; each
+   handshake starts with it as an attribute of the connection */
+static char *g_pszPreferredLanguage = NULL;
+
+/* Parallel delivery. The thread delivering a batch routes each of its
+   messages once, noting the IMVs it goes to, and splits the batch into one
+   task per IMV: the messages marked for that IMV, in queue order, followed
+   by its BatchEnding unless only part of the batch was taken, to pipeline
+   it. It posts the batch to g_pBatches and then claims tasks itself
+   alongside a few helper threads, so the batch never waits for a helper to
+   come around; it is done when the last IMV is. Idle helpers, and posters
+   waiting for the helpers to finish, sleep on condition variables. */
+typedef struct IMV_ITEM_tag
+{
+    unsigned long targets;          /* Bit i is set if IMV i receives it */
+    unsigned category;
+    void *message;                  /* MESSAGE_BASIC or MESSAGE_LONG */
+    SOH_ENTRY entry;                /* An entry of an SoH */
+} IMV_ITEM;
 
-/* List of functions implemented by IMV */
-static IMVFuncs imvFuncs;
+typedef struct IMV_BATCH_tag
+{
+    struct IMV_BATCH_tag *next;
+    TNC_ConnectionID cid;
+    IMV_ITEM *items;
+    unsigned nItems;
+    unsigned nItemSlots;
+    unsigned bFailed;               /* The items couldn't all be recorded */
+    unsigned bEnd;                  /* Call each IMV's BatchEnding after its messages */
+    unsigned nNext;                 /* Next IMV to be claimed */
+    unsigned nPending;              /* IMVs that aren't done yet */
+} IMV_BATCH;
+
+#define IMV_TARGET(id) (1UL << (id))
+
+/* The batch fields a task is claimed and finished with, the list of batches
+   and g_bStopImvHelpers are all guarded by g_BatchesLock */
+static unsigned g_bParallelDelivery = 0;
+static TNC_THREAD g_ImvHelpers[ TNCS_MAX_IMVS ];
+static unsigned g_nImvHelpers = 0;
+static unsigned g_bStopImvHelpers = 0;
+static IMV_BATCH *g_pBatches = NULL;
+static TNC_MUTEX g_BatchesLock;
+static TNC_COND g_BatchPosted;
+static TNC_COND g_BatchDone;
+
+/* Attributes that belong to the connection rather than to one IMV */
+#define IMV_ID_ALL TNCS_MAX_IMVS
 
-/* List of message types supported by IMV in TNC_TNCS_ReportMessageTypes */
-static TNC_MessageTypeList g_pImvMessageTypes = NULL;
-static TNC_UInt32 g_nImvMessageTypesCount = 0;
+/* Forward declarations */
+int LoadImvDLL(const char *dllPath, IMVFuncs *funcTable, void **phDLL);
+void UnloadImvDLL(void *hDLL);
+static void ImvHelperThread( void *arg );
+
+static IMV_MODULE* GetImv(TNC_IMVID imvID)
+{
+    return imvID < g_nImvCount ? &g_Imvs[ imvID ] : NULL;
+}
 
-/* List of message types supported by IMV in TNC_TNCS_ReportMessageTypesLong */
-static TNC_MessageSubtypeList g_pImvMessageLongSubtypes = NULL;
-static TNC_VendorIDList g_pImvVendorIDs = NULL;
-static TNC_UInt32 g_nImvMessageLongSubtypesCount = 0;
+/* Double the buckets of a shard; must be called with its lock held */
+static void ConnShardGrow( CONN_SHARD *shard )
+{
+    TNCS_CONNECTION **table, *conn, *next;
+    unsigned size = 0 != shard->size ? 2 * shard->size : CONN_TABLE_MIN_BUCKETS;
+    unsigned i, j;
 
-/* Related to evaluation of collected data */
-static TNC_IMV_Evaluation_Result g_nEvaluation = 0;
-static TNC_IMV_Action_Recommendation g_nRecommendation = 0;
-static unsigned g_bRecommendationProvided = 0;
+    table = (TNCS_CONNECTION **) calloc( size, sizeof( *table ) );
+    if( NULL == table )
+        return;
 
-/* Forward declarations */
-int LoadImvDLL(const char *dllPath, IMVFuncs *funcTable);
-void UnloadImvDLL(void);
-int IsMessageTypeSupported( TNC_MessageType type, TNC_MessageTypeList list, TNC_UInt32 count );
-int IsMessageLongTypeSupported( TNC_MessageSubtype subtype, 
-							    TNC_VendorID vendorID,
-								TNC_MessageSubtypeList listOfSubTypes,
-							    TNC_VendorIDList listOfVendorIDs, 
-								TNC_UInt32 count );
+    for( i = 0; i < shard->size; ++i )
+    {
+        for( conn = shard->table[ i ]; NULL != conn; conn = next )
+        {
+            next = conn->next;
+            j = CONN_HASH( conn->cid ) & (size - 1);
+            conn->next = table[ j ];
+            table[ j ] = conn;
+        }
+    }
+
+    free( shard->table );
+    shard->table = table;
+    shard->size = size;
+}
+
+/* Find a connection, or with bCreate set, add it if it isn't there */
+static TNCS_CONNECTION* ImvFindConnection( TNC_ConnectionID cid, unsigned bCreate )
+{
+    const unsigned hash = CONN_HASH( cid );
+    CONN_SHARD *shard = CONN_SHARD( hash );
+    TNCS_CONNECTION *conn = NULL;
+    unsigned i;
+
+    MutexLock( &shard->lock );
+
+    if( 0 != shard->size )
+        for( conn = shard->table[ hash & (shard->size - 1) ]; NULL != conn && conn->cid != cid; conn = conn->next );
+
+    if( NULL == conn && bCreate )
+    {
+        if( shard->count >= shard->size )
+            ConnShardGrow( shard );
+
+        if( 0 != shard->size )
+            conn = (TNCS_CONNECTION *) calloc( 1, sizeof( *conn ) + 
+                (g_nImvCount > 1 ? g_nImvCount - 1 : 0) * sizeof( conn->results[ 0 ] ) );
+
+        if( NULL != conn )
+        {
+            conn->cid = cid;
+            MutexInit( &conn->attributesLock );
+            i = hash & (shard->size - 1);
+            conn->next = shard->table[ i ];
+            shard->table[ i ] = conn;
+            ++shard->count;
+        }
+    }
+
+    MutexUnlock( &shard->lock );
+    return conn;
+}
+
+/* Release the values of all attributes of a connection */
+static void ConnClearAttributes( TNCS_CONNECTION *conn )
+{
+    unsigned i;
+
+    for( i = 0; i < conn->nAttributes; ++i )
+        if( NULL != conn->attributes[ i ].buffer )
+            BufferRelease( conn->attributes[ i ].buffer );
+
+    conn->nAttributes = 0;
+}
+
+static void ConnFree( TNCS_CONNECTION *conn )
+{
+    ConnClearAttributes( conn );
+    free( conn->attributes );
+    MutexDestroy( &conn->attributesLock );
+    free( conn );
+}
+
+/* Must be called with the attributes lock held */
+static CONN_ATTRIBUTE* ConnFindAttribute( TNCS_CONNECTION *conn, TNC_AttributeID id, TNC_IMVID imvID )
+{
+    CONN_ATTRIBUTE *attr = conn->attributes;
+    CONN_ATTRIBUTE *end = attr + conn->nAttributes;
+
+    for( ; attr < end; ++attr )
+        if( attr->id == id && attr->imvID == imvID )
+            return attr;
+
+    return NULL;
+}
+
+/* Set an attribute of a connection. A value that lies within a buffer is
+   passed with the buffer, whose reference is taken over; any other value is
+   copied, into the entry if it fits there. */
+static TNC_Result ConnSetAttribute( TNCS_CONNECTION *conn, TNC_AttributeID id, TNC_IMVID imvID,
+    TNC_BufferReference data, TNC_UInt32 length, MESSAGE_BUFFER *buffer )
+{
+    CONN_ATTRIBUTE *attr, *attributes;
+    unsigned size;
+
+    if( NULL == buffer && length > CONN_ATTRIBUTE_INLINE_SIZE )
+    {
+        buffer = BufferCreate( data, length );
+        if( NULL == buffer )
+            return TNC_RESULT_OTHER;
+
+        data = BufferGetData( buffer );
+    }
+
+    MutexLock( &conn->attributesLock );
+
+    attr = ConnFindAttribute( conn, id, imvID );
+    if( NULL == attr )
+    {
+        if( conn->nAttributes == conn->nAttributeSlots )
+        {
+            size = 0 != conn->nAttributeSlots ? 2 * conn->nAttributeSlots : CONN_ATTRIBUTE_MIN_SLOTS;
+            attributes = (CONN_ATTRIBUTE *) realloc( conn->attributes, size * sizeof( *attributes ) );
+            if( NULL == attributes )
+            {
+                MutexUnlock( &conn->attributesLock );
+                if( NULL != buffer )
+                    BufferRelease( buffer );
+                return TNC_RESULT_OTHER;
+            }
+
+            conn->attributes = attributes;
+            conn->nAttributeSlots = size;
+        }
+
+        attr = &conn->attributes[ conn->nAttributes++ ];
+        attr->id = id;
+        attr->imvID = imvID;
+    }
+    else if( NULL != attr->buffer )
+        BufferRelease( attr->buffer );
+
+    attr->length = length;
+    attr->buffer = buffer;
+    attr->data = data;
+    if( NULL == buffer && 0 != length )
+        memcpy( attr->value, data, length );
+
+    MutexUnlock( &conn->attributesLock );
+    return TNC_RESULT_SUCCESS;
+}
+
+/* Copy an attribute value out to an IMV. The length is always returned, but
+   the value is only copied if the buffer can hold all of it, so an IMV may
+   pass no buffer to learn how large a value is. */
+static TNC_Result CopyAttribute( const void *src, TNC_UInt32 srcLen, TNC_UInt32 dstLen, TNC_BufferReference dst,
+    TNC_UInt32 *pOutValueLength )
+{
+    if( NULL == pOutValueLength )
+        return TNC_RESULT_INVALID_PARAMETER;
+
+    *pOutValueLength = srcLen;
+    if( NULL != dst && dstLen >= srcLen && 0 != srcLen )
+        memcpy( dst, src, srcLen );
+
+    return TNC_RESULT_SUCCESS;
+}
+
+static TNC_Result ConnGetAttribute( TNCS_CONNECTION *conn, TNC_AttributeID id, TNC_IMVID imvID,
+    TNC_UInt32 bufferLength, TNC_BufferReference buffer, TNC_UInt32 *pOutValueLength )
+{
+    TNC_Result rc = TNC_RESULT_INVALID_PARAMETER;
+    CONN_ATTRIBUTE *attr;
+
+    MutexLock( &conn->attributesLock );
+
+    attr = ConnFindAttribute( conn, id, imvID );
+    if( NULL != attr )
+        rc = CopyAttribute( CONN_ATTRIBUTE_DATA( attr ), attr->length, bufferLength, buffer, pOutValueLength );
+
+    MutexUnlock( &conn->attributesLock );
+    return rc;
+}
+
+static void ImvDeleteConnection( TNC_ConnectionID cid )
+{
+    const unsigned hash = CONN_HASH( cid );
+    CONN_SHARD *shard = CONN_SHARD( hash );
+    TNCS_CONNECTION **link, *conn;
+
+    MutexLock( &shard->lock );
+
+    if( 0 != shard->size )
+    {
+        for( link = &shard->table[ hash & (shard->size - 1) ]; NULL != (conn = *link); link = &conn->next )
+        {
+            if( conn->cid == cid )
+            {
+                *link = conn->next;
+                --shard->count;
+                ConnFree( conn );
+                break;
+            }
+        }
+    }
+
+    MutexUnlock( &shard->lock );
+}
+
+static void ImvFreeConnections(void)
+{
+    TNCS_CONNECTION *conn, *next;
+    CONN_SHARD *shard;
+    unsigned i, j;
+
+    for( i = 0; i < CONN_TABLE_SHARDS; ++i )
+    {
+        shard = &g_ConnShards[ i ];
+        for( j = 0; j < shard->size; ++j )
+        {
+            for( conn = shard->table[ j ]; NULL != conn; conn = next )
+            {
+                next = conn->next;
+                ConnFree( conn );
+            }
+        }
+
+        free( shard->table );
+        shard->table = NULL;
+        shard->size = shard->count = 0;
+        MutexDestroy( &shard->lock );
+    }
+}
+
+void ImvSetRecommendationPolicy( eRECOMMENDATION_POLICY policy )
+{
+    g_eRecommendationPolicy = policy;
+}
+
+void ImvSetParallelDelivery( unsigned bParallel )
+{
+    g_bParallelDelivery = bParallel;
+}
+
+void ImvSetPreferredLanguage( char *pszLanguage )
+{
+    g_pszPreferredLanguage = pszLanguage;
+}
+
+/* An IMV receives a basic message if it registered the message type */
+static unsigned ImvReceivesBasic( void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype )
+{
+    IMV_MODULE *imv = &g_Imvs[ id ];
+
+    (void) context;
+
+    return NULL != imv->funcs.pfnReceiveMessage && TypeIndexFind( &imv->types, vendorID, subtype );
+}
+
+/* An IMV receives an SoH entry if it registered the entry's System Health ID
+   as a message type; it takes the entry through TNC_IMV_ReceiveMessageSOH if
+   it has it, or else through TNC_IMV_ReceiveMessage */
+static unsigned ImvReceivesSoh( void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype )
+{
+    IMV_MODULE *imv = &g_Imvs[ id ];
+
+    (void) context;
+
+    return (NULL != imv->funcs.pfnReceiveMessageSOH || NULL != imv->funcs.pfnReceiveMessage) &&
+        TypeIndexFind( &imv->types, vendorID, subtype );
+}
+
+/* An IMV receives a long message through TNC_IMV_ReceiveMessageLong if it
+   registered the type with TNC_TNCS_ReportMessageTypesLong. An IMV without
+   that function can still receive it through TNC_IMV_ReceiveMessage if it 
+   registered the equivalent TNC_MessageType. */
+static unsigned ImvReceivesLong( void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype )
+{
+    IMV_MODULE *imv = &g_Imvs[ id ];
+    TNC_MessageType longMessageType;
+
+    (void) context;
+
+    if( NULL != imv->funcs.pfnReceiveMessageLong )
+        return TypeIndexFind( &imv->longTypes, vendorID, subtype );
+
+    longMessageType = (vendorID << 8 | subtype);
+    return NULL != imv->funcs.pfnReceiveMessage && 
+        TypeIndexFind( &imv->types, EXTRACT_VENDOR( longMessageType ), EXTRACT_SUBTYPE( longMessageType ) );
+}
+
+/* Rebuild the routing tables after an IMV changed its registrations. The
+   basic and SoH tables are keyed by the types registered with
+   ReportMessageTypes, the long table by those of either ReportMessageTypes
+   call. */
+static void ImvRebuildRoutes(void)
+{
+    TYPE_INDEX *indexes[ 2 * TNCS_MAX_IMVS ];
+    ROUTE_TABLE *pBasicRoutes, *pLongRoutes, *pSohRoutes;
+    unsigned i;
+
+    MutexLock( &g_RoutesLock );
+
+    for( i = 0; i < g_nImvCount; ++i )
+    {
+        indexes[ i ] = &g_Imvs[ i ].types;
+        indexes[ g_nImvCount + i ] = &g_Imvs[ i ].longTypes;
+    }
+
+    /* A table that cannot be built is left out; lookups then check every IMV */
+    pBasicRoutes = RouteTableBuild( indexes, g_nImvCount, g_nImvCount, ImvReceivesBasic, NULL );
+    pLongRoutes = RouteTableBuild( indexes, 2 * g_nImvCount, g_nImvCount, ImvReceivesLong, NULL );
+    pSohRoutes = RouteTableBuild( indexes, g_nImvCount, g_nImvCount, ImvReceivesSoh, NULL );
+
+    if( NULL != g_pBasicRoutes )
+    {
+        g_pBasicRoutes->next = g_pRetiredRoutes;
+        g_pRetiredRoutes = g_pBasicRoutes;
+    }
+
+    if( NULL != g_pLongRoutes )
+    {
+        g_pLongRoutes->next = g_pRetiredRoutes;
+        g_pRetiredRoutes = g_pLongRoutes;
+    }
+
+    if( NULL != g_pSohRoutes )
+    {
+        g_pSohRoutes->next = g_pRetiredRoutes;
+        g_pRetiredRoutes = g_pSohRoutes;
+    }
+
+    g_pBasicRoutes = pBasicRoutes;
+    g_pLongRoutes = pLongRoutes;
+    g_pSohRoutes = pSohRoutes;
+
+    MutexUnlock( &g_RoutesLock );
+}
+
+static void ImvFreeRoutes(void)
+{
+    ROUTE_TABLE *table;
+
+    RouteTableFree( g_pBasicRoutes );
+    RouteTableFree( g_pLongRoutes );
+    RouteTableFree( g_pSohRoutes );
+    g_pBasicRoutes = g_pLongRoutes = g_pSohRoutes = NULL;
+
+    while( NULL != g_pRetiredRoutes )
+    {
+        table = g_pRetiredRoutes;
+        g_pRetiredRoutes = table->next;
+        RouteTableFree( table );
+    }
+}
 
 int LoadIMV(const char *dllPath)
 {
+    IMV_MODULE *imv;
     int err;
 
+    if( g_nImvCount >= TNCS_MAX_IMVS )
+    {
+        outfmt( OUT_LEVEL_NORMAL, "Too many IMVs; \"%s\" not loaded\n", dllPath );
+        return TNC_RESULT_OTHER;
+    }
+
+    imv = &g_Imvs[ g_nImvCount ];
+    memset( imv, 0, sizeof( *imv ) );
+    imv->id = g_nImvCount;
+
 	outfmt( OUT_LEVEL_NORMAL, "Loading IMV DLL: \"%s\"...", dllPath );
-    err = LoadImvDLL( dllPath, &imvFuncs );
+    err = LoadImvDLL( dllPath, &imv->funcs, &imv->hDLL );
     if (err) 
     {
         outfmt( OUT_LEVEL_NORMAL, " Error %d.\n", err);
+        if( NULL != imv->hDLL )
+            UnloadImvDLL( imv->hDLL );
         return TNC_RESULT_OTHER;
     }
 
-    outfmt( OUT_LEVEL_NORMAL, " Ok\n" );
+    ++g_nImvCount;
+    outfmt( OUT_LEVEL_NORMAL, " Ok (IMV ID %d)\n", imv->id );
     return TNC_RESULT_SUCCESS;
 }
 
 int InitializeIMV(void)
 {
-    TNC_Result result;
+    TNC_Result result = TNC_RESULT_SUCCESS;
     TNC_Version actualVersion;
+    IMV_MODULE *imv;
+    unsigned i, n;
 
-    outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Initialize\n" );
-    result = (imvFuncs.pfnInitialize)(IMV_ID, TNC_IFIMV_VERSION_1, TNC_IFIMV_VERSION_1, &actualVersion);
-    outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Initialize result = %d.\n", result);
-    if (result != TNC_RESULT_SUCCESS) 
-        return TNC_RESULT_OTHER;
+    MutexInit( &g_RoutesLock );
+    MutexInit( &g_BatchesLock );
+    CondInit( &g_BatchPosted );
+    CondInit( &g_BatchDone );
+    for( i = 0; i < CONN_TABLE_SHARDS; ++i )
+        MutexInit( &g_ConnShards[ i ].lock );
 
-    if (imvFuncs.pfnProvideBind != NULL) 
+    for( i = 0; i < g_nImvCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ProvideBindFunction\n" );
-        result = (imvFuncs.pfnProvideBind)(IMV_ID, &TNC_TNCS_BindFunction);
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ProvideBindFunction result = %d.\n", result);
+        imv = &g_Imvs[ i ];
+
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Initialize (IMV %d)\n", imv->id );
+        result = (imv->funcs.pfnInitialize)(imv->id, TNC_IFIMV_VERSION_1, TNC_IFIMV_VERSION_1, &actualVersion);
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Initialize result = %d.\n", result);
         if (result != TNC_RESULT_SUCCESS) 
             return TNC_RESULT_OTHER;
+
+        if (imv->funcs.pfnProvideBind != NULL) 
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ProvideBindFunction\n" );
+            result = (imv->funcs.pfnProvideBind)(imv->id, &TNC_TNCS_BindFunction);
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ProvideBindFunction result = %d.\n", result);
+            if (result != TNC_RESULT_SUCCESS) 
+                return TNC_RESULT_OTHER;
+        }
+
+        outfmt( OUT_LEVEL_NORMAL, "IMV %d initialized successfully\n\n", imv->id );
+    }
+
+    /* The thread delivering a batch takes one of the IMVs itself; there is
+       no point in more helpers than there are other processors */
+    g_bStopImvHelpers = 0;
+    if( g_bParallelDelivery && g_nImvCount > 1 )
+    {
+        n = ThreadGetProcessorCount();
+        n = n > 1 ? n - 1 : 1;
+        if( n > g_nImvCount - 1 )
+            n = g_nImvCount - 1;
+
+        for( g_nImvHelpers = 0; g_nImvHelpers < n; ++g_nImvHelpers )
+            if( 0 != ThreadCreate( &g_ImvHelpers[ g_nImvHelpers ], ImvHelperThread, NULL ) )
+                break;
+
+        outfmt( OUT_LEVEL_NORMAL, "Delivering batches to IMVs in parallel on %u helper threads\n\n", g_nImvHelpers );
     }
 
-    outfmt( OUT_LEVEL_NORMAL, "IMV initialized successfully\n\n" );
     return result;
 }
 
 void TerminateIMV(void)
 {
     TNC_Result result;
+    IMV_MODULE *imv;
+    unsigned i;
+
+    MutexLock( &g_BatchesLock );
+    g_bStopImvHelpers = 1;
+    CondBroadcast( &g_BatchPosted );
+    MutexUnlock( &g_BatchesLock );
 
-    if( NULL != imvFuncs.pfnTerminate )
+    for( i = 0; i < g_nImvHelpers; ++i )
+        ThreadJoin( g_ImvHelpers[ i ] );
+    g_nImvHelpers = 0;
+
+    for( i = 0; i < g_nImvCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Terminate (IMV %d)\n", IMV_ID );
-        result = imvFuncs.pfnTerminate( IMV_ID );
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Terminate result: %d\n", result );
+        imv = &g_Imvs[ i ];
+
+        if( NULL != imv->funcs.pfnTerminate )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Terminate (IMV %d)\n", imv->id );
+            result = imv->funcs.pfnTerminate( imv->id );
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_Terminate result: %d\n", result );
+        }
+
+        TypeIndexFree( &imv->types );
+        TypeIndexFree( &imv->longTypes );
+
+        UnloadImvDLL( imv->hDLL );
+        memset( imv, 0, sizeof( *imv ) );
     }
 
-    free( g_pImvMessageTypes );
-    g_pImvMessageTypes = NULL;
-    g_nImvMessageTypesCount = 0;
+    ImvFreeRoutes();
+    MutexDestroy( &g_RoutesLock );
+    MutexDestroy( &g_BatchesLock );
+    CondDestroy( &g_BatchPosted );
+    CondDestroy( &g_BatchDone );
+    ImvFreeConnections();
+
+    g_nImvCount = 0;
+}
+
+/* Find the IMVs a basic message goes to; says so if there are none */
+static unsigned ImvRouteBasic( MESSAGE_BASIC *basicMessage, TNC_UInt32 *buffer, const TNC_UInt32 **ids )
+{
+    unsigned count;
 
-	free( g_pImvMessageLongSubtypes );
-	free( g_pImvVendorIDs );
-	g_pImvMessageLongSubtypes = NULL;
-	g_pImvVendorIDs = NULL;
-	g_nImvMessageLongSubtypesCount = 0;
+    count = RouteTableLookup( g_pBasicRoutes, EXTRACT_VENDOR( basicMessage->messageType ), 
+        EXTRACT_SUBTYPE( basicMessage->messageType ), g_nImvCount, ImvReceivesBasic, NULL, buffer, ids );
 
-    UnloadImvDLL();
+	if( 0 == count )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> Message type %#x not registered by any IMV; message not delivered!\n",
+			basicMessage->messageType );
+	}
+
+    return count;
+}
+
+/* Deliver a basic message to one IMV that is known to receive it */
+static void DeliverImvBasicMessageTo( IMV_MODULE *imv, TNC_ConnectionID cid, MESSAGE_BASIC *basicMessage )
+{
+    TNC_Result rc;
+
+	outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage (IMV: %d, type: %#x, length: %d)\n", imv->id,
+		basicMessage->messageType, basicMessage->messageLength );
+
+	rc = imv->funcs.pfnReceiveMessage( imv->id, cid, basicMessage->message, 
+		basicMessage->messageLength, basicMessage->messageType );
+
+	outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage result: %d\n", rc );
+}
+
+/* Deliver a basic message to every IMV that registered its type */
+static void DeliverImvBasicMessage( TNC_ConnectionID cid, MESSAGE_BASIC *basicMessage )
+{
+    TNC_UInt32 buffer[ TNCS_MAX_IMVS ];
+    const TNC_UInt32 *ids;
+    unsigned i, count;
+
+    count = ImvRouteBasic( basicMessage, buffer, &ids );
+	for( i = 0; i < count; ++i )
+		DeliverImvBasicMessageTo( &g_Imvs[ ids[ i ] ], cid, basicMessage );
+}
+
+/* Find the IMVs an SoH entry goes to; says so if there are none */
+static unsigned ImvRouteSohEntry( const SOH_ENTRY *entry, TNC_UInt32 *buffer, const TNC_UInt32 **ids )
+{
+    unsigned count;
+
+    count = RouteTableLookup( g_pSohRoutes, EXTRACT_VENDOR( entry->systemHealthID ), EXTRACT_SUBTYPE( entry->systemHealthID ),
+        g_nImvCount, ImvReceivesSoh, NULL, buffer, ids );
+
+	if( 0 == count )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> System health ID %#x not registered by any IMV; SoH entry not delivered!\n",
+			entry->systemHealthID );
+	}
+
+    return count;
+}
+
+/* Deliver an SoH entry to one IMV that is known to receive it */
+static void DeliverImvSohEntryTo( IMV_MODULE *imv, TNC_ConnectionID cid, const SOH_ENTRY *entry )
+{
+    TNC_Result rc;
+
+	/* This is the preferred way of delivery */
+	if( imv->funcs.pfnReceiveMessageSOH )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageSOH (IMV: %d, system health ID: %#x, length: %d)\n", imv->id,
+			entry->systemHealthID, entry->length );
+
+		rc = imv->funcs.pfnReceiveMessageSOH( imv->id, cid, entry->data, entry->length, entry->systemHealthID );
+
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageSOH result: %d\n", rc );
+	}
+	else
+	{
+		/* Without TNC_IMV_ReceiveMessageSOH the entry goes to
+		   TNC_IMV_ReceiveMessage with its System Health ID as the type */
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage (IMV: %d, type: %#x, length: %d)\n", imv->id,
+			entry->systemHealthID, entry->length );
+
+		rc = imv->funcs.pfnReceiveMessage( imv->id, cid, entry->data, entry->length, entry->systemHealthID );
+
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage result: %d\n", rc );
+	}
+}
+
+/* Deliver an SoH entry to every IMV that registered its System Health ID;
+   an SOH_ENTRY_CALLBACK whose context is the connection ID */
+static void DeliverImvSohEntry( void *context, const SOH_ENTRY *entry )
+{
+    const TNC_ConnectionID cid = *(const TNC_ConnectionID *) context;
+    TNC_UInt32 buffer[ TNCS_MAX_IMVS ];
+    const TNC_UInt32 *ids;
+    unsigned i, count;
+
+    count = ImvRouteSohEntry( entry, buffer, &ids );
+	for( i = 0; i < count; ++i )
+		DeliverImvSohEntryTo( &g_Imvs[ ids[ i ] ], cid, entry );
+}
+
+/* Split an SoH into its entries and pass each one to pfnEntry. The whole
+   SoH is in the message already, so it is parsed in place: every entry lies
+   within the message and stays valid for as long as the batch does. Entries
+   before a malformed attribute have been passed on by the time it is found;
+   the rest of the message is dropped. */
+static void ImvSplitSoh( MESSAGE_SOH *sohMessage, SOH_ENTRY_CALLBACK pfnEntry, void *context )
+{
+    eSOH_RESULT result;
+    SOH_PARSER parser;
+    SOH_ENTRY entry;
+
+    SohParserInit( &parser, sohMessage->sohReportEntry, sohMessage->sohRELength );
+    while( SOH_RESULT_ENTRY == (result = SohNextEntry( &parser, &entry )) )
+        pfnEntry( context, &entry );
+
+    if( SOH_RESULT_MALFORMED == result )
+    {
+        outfmt( OUT_LEVEL_NORMAL, "> Malformed SoH at offset %u of %d; rest of the message not delivered!\n",
+            SohParserOffset( &parser ), sohMessage->sohRELength );
+    }
+}
+
+/* Deliver a long message to one IMV that is known to receive it */
+static void DeliverImvLongMessageTo( IMV_MODULE *imv, TNC_ConnectionID cid, MESSAGE_LONG *longTypeMessage, char *pszDelivery )
+{
+	TNC_MessageType longMessageType = 0;
+    TNC_Result rc;
+
+	/* This is the preferred way of delivery */
+	if (imv->funcs.pfnReceiveMessageLong) 
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageLong (IMV: %d, vendorID: %#x, subtype: %#x, length: %d)\n", imv->id,
+			longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
+
+		rc = imv->funcs.pfnReceiveMessageLong( imv->id, cid, longTypeMessage->messageFlags, 
+			longTypeMessage->message, longTypeMessage->messageLength, 
+			longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, 
+			longTypeMessage->imcID, longTypeMessage->imvID);
+
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageLong%s result: %d\n", pszDelivery, rc );
+	} 
+	else
+	{
+		/* IMV doesn't implement TNC_IMV_ReceiveMessageLong function but
+		   TNCS can still delive the message using imv->funcs.pfnReceiveMessage.*/
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage (IMV: %d, vendorID: %#x, subtype: %#x, length: %d)\n", imv->id,
+			longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
+
+		/* Create a single message type from subtype and vendorID */
+		longMessageType = (longTypeMessage->messageVendorID << 8 | longTypeMessage->messageSubtype);
+
+		rc = imv->funcs.pfnReceiveMessage( imv->id, cid, longTypeMessage->message, 
+			longTypeMessage->messageLength, longMessageType );
+		outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage%s result: %d\n", pszDelivery, rc );
+	}
+}
+
+static char* ImvLongDelivery( MESSAGE_LONG *longTypeMessage )
+{
+	return (longTypeMessage->messageFlags & TNC_MESSAGE_FLAGS_EXCLUSIVE) == TNC_MESSAGE_FLAGS_EXCLUSIVE ?
+		" (Exclusive Delivery)" : "";
+}
+
+/* Find the IMVs a long message goes to: the one it is addressed to if it is
+   marked for exclusive delivery, otherwise every IMV that registered its
+   type. Says so if there are none. */
+static unsigned ImvRouteLong( MESSAGE_LONG *longTypeMessage, TNC_UInt32 *buffer, const TNC_UInt32 **ids )
+{
+    IMV_MODULE *imv;
+    unsigned count;
+
+	if( (longTypeMessage->messageFlags & TNC_MESSAGE_FLAGS_EXCLUSIVE) == TNC_MESSAGE_FLAGS_EXCLUSIVE )
+	{
+		/* Exclusive messages go to their destination only, whether or not it
+		   registered the type. This can fail if the destination is not loaded
+		   OR longTypeMessage->imvID == TNC_IMVID_ANY */
+		imv = GetImv( longTypeMessage->imvID );
+		if( NULL != imv && (NULL != imv->funcs.pfnReceiveMessageLong ||
+			ImvReceivesLong( NULL, imv->id, longTypeMessage->messageVendorID, longTypeMessage->messageSubtype )) )
+		{
+			buffer[ 0 ] = imv->id;
+			*ids = buffer;
+			return 1;
+		}
+
+		outfmt( OUT_LEVEL_NORMAL, "> Message marked for exclusive delivery to IMV %d; not delivered!\n",
+			longTypeMessage->imvID );
+		return 0;
+	}
+
+	count = RouteTableLookup( g_pLongRoutes, longTypeMessage->messageVendorID, longTypeMessage->messageSubtype,
+		g_nImvCount, ImvReceivesLong, NULL, buffer, ids );
+
+	if( 0 == count )
+	{
+		outfmt( OUT_LEVEL_NORMAL, "> Message type (vendor ID %#x, message subtype %#x) not registered by any IMV; "
+			"message not delivered!\n", longTypeMessage->messageVendorID, longTypeMessage->messageSubtype );
+	}
+
+	return count;
+}
+
+static void DeliverImvLongMessage( TNC_ConnectionID cid, MESSAGE_LONG *longTypeMessage )
+{
+    TNC_UInt32 buffer[ TNCS_MAX_IMVS ];
+    const TNC_UInt32 *ids;
+    unsigned i, count;
+
+	count = ImvRouteLong( longTypeMessage, buffer, &ids );
+	for( i = 0; i < count; ++i )
+		DeliverImvLongMessageTo( &g_Imvs[ ids[ i ] ], cid, longTypeMessage, ImvLongDelivery( longTypeMessage ) );
+}
+
+/* Keep the last SOH of a batch as the SOH attribute of its connection. It
+   is set before the batch is delivered, so every IMV sees the same value. */
+static void ImvCacheSoh( TNC_ConnectionID cid )
+{
+    TNCS_CONNECTION *conn;
+    MESSAGE_SOH *sohMessage;
+    MESSAGE_BATCH batch;
+    unsigned i;
+
+    for( i = QueueGetBatch( cid, QUEUE_TO_IMV, &batch ); i-- > 0; )
+    {
+        if( MESSAGE_CATEGORY_SOH == BatchGetMessageCategory( &batch, i ) )
+        {
+            conn = ImvFindConnection( cid, 0 );
+            sohMessage = BatchGetMessageSOH( &batch, i );
+            if( NULL != conn )
+                ConnSetAttribute( conn, TNC_ATTRIBUTEID_SOH, IMV_ID_ALL, sohMessage->sohReportEntry,
+                    sohMessage->sohRELength, BatchGetMessageBuffer( &batch, i ) );
+            break;
+        }
+    }
 }
 
 unsigned DeliverImvMessages( TNC_ConnectionID cid )
@@ -143,160 +925,34 @@ unsigned DeliverImvMessages( TNC_ConnectionID cid )
 	MESSAGE_BASIC  * basicMessage = NULL;
 	MESSAGE_SOH    * sohMessage = NULL;
 	MESSAGE_LONG   * longTypeMessage = NULL;
-	TNC_MessageType sohType = 0;
-	TNC_MessageType longMessageType = 0;
-    TNC_Result rc;
-    unsigned i;
+	MESSAGE_BATCH batch;
+    unsigned i, count;
+
+    ImvCacheSoh( cid );
 
-	/* Deliver each message to the IMV */
-	for (i=0; i < QueueGetMessageCount(); ++i)
+	/* Deliver each message to the IMVs that receive it; each IMV still sees
+	   its messages in the order they were queued */
+	count = QueueGetBatch( cid, QUEUE_TO_IMV, &batch );
+	for (i=0; i < count; ++i)
 	{
 		/* Depending on the message category, it needs to be delivered differently */
-		messageCategory = QueueGetMessageCategory(i);
+		messageCategory = BatchGetMessageCategory(&batch, i);
 
 		if (messageCategory == MESSAGE_CATEGORY_BASIC) 
 		{
 			/* Now that we know the message type, retrieve the message */
-			QueueGetMessage(i, &basicMessage);
-
-			outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage (type: %#x, length: %d)\n", 
-				basicMessage->messageType, basicMessage->messageLength );
-
-			if( imvFuncs.pfnReceiveMessage )
-			{
-				if( IsMessageTypeSupported( basicMessage->messageType, g_pImvMessageTypes, g_nImvMessageTypesCount ) )
-				{
-					rc = imvFuncs.pfnReceiveMessage( IMV_ID, cid, basicMessage->message, 
-						basicMessage->messageLength, basicMessage->messageType );
-
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			}
-			else
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage TYPE NOT SUPPORTED!\n" );
-			}
+			basicMessage = BatchGetMessage(&batch, i);
+			DeliverImvBasicMessage( cid, basicMessage );
 		}
 		else if (messageCategory == MESSAGE_CATEGORY_SOH) 
 		{
-			/* Now that we know the message type, retrieve the message */
-			QueueGetMessageSOH(i, &sohMessage);
-
-			/* This is the preferred way of delivery */
-			if (imvFuncs.pfnReceiveMessageSOH) 
-			{
-				/* The received buffer is complete SOHReportEntry. TNCS will parse
-				   it into individual SOHRReportEntry buffers and deliver each buffer
-				   to the IMV if IMV is supposed to receive it. Since logic for 
-				   parsing SOH message is somewhat involved, it is not implemented.
-
-				   Deliver the parsed SOHRReportEntries using imvFuncs.pfnReceiveMessageSOH.
-				*/
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageSOH (length: %d)\n", 
-					sohMessage->sohRELength);
-				outfmt( OUT_LEVEL_NORMAL, "> Dispatching SOH messages to IMV **NOT IMPLEMENTED**\n");
-			} 
-			else if (imvFuncs.pfnReceiveMessage)
-			{
-				/* IMV didn't implement TNC_IMV_ReceiveMessageSOH function but 
-				   TNCS can still delive the message using the pfnReceiveMessage. 
-				   'sohType' is extracted from the message. */
-
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage (type: %#x, length: %d)\n", 
-					sohType, sohMessage->sohRELength);
-
-				if( IsMessageTypeSupported( sohType, g_pImvMessageTypes, g_nImvMessageTypesCount ) )
-				{
-					rc = imvFuncs.pfnReceiveMessage( IMV_ID, cid, sohMessage->sohReportEntry, 
-						sohMessage->sohRELength, sohType );
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			}
-			else 
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage and "
-						"TNC_IMV_ReceiveMessageSOH NOT SUPPORTED!\n" );
-			}
-		} 
+			sohMessage = BatchGetMessageSOH(&batch, i);
+			ImvSplitSoh( sohMessage, DeliverImvSohEntry, &cid );
+		}
 		else if (messageCategory == MESSAGE_CATEGORY_LONG ) 
 		{
-			/* Now that we know the message type, retrieve the message */
-			QueueGetMessageLong(i, &longTypeMessage);
-
-			/* This is the preferred way of delivery */
-			if (imvFuncs.pfnReceiveMessageLong) 
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageLong (vendorID: %#x, subtype: %#x, length: %d)\n", 
-					longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
-
-				if( (longTypeMessage->messageFlags & TNC_MESSAGE_FLAGS_EXCLUSIVE) == TNC_MESSAGE_FLAGS_EXCLUSIVE )
-				{
-					if(longTypeMessage->imvID == IMV_ID)
-					{
-						rc = imvFuncs.pfnReceiveMessageLong( IMV_ID, cid, longTypeMessage->messageFlags, 
-							longTypeMessage->message, longTypeMessage->messageLength, 
-							longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, 
-							longTypeMessage->imcID, longTypeMessage->imvID);
-
-						outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageLong (Exclusive Delivery) result: %d\n", rc );
-					}
-					else
-					{
-						/* Ignore it. This can happen if,
-						   longTypeMessage->imvID matches with any other IMV OR
-						   longTypeMessage->imvID == TNC_IMVID_ANY */
-						outfmt( OUT_LEVEL_NORMAL, "> Message marked for exclusive delivery to another IMV; not delivered!\n" );
-					}
-				}
-				else if( IsMessageLongTypeSupported( longTypeMessage->messageSubtype, longTypeMessage->messageVendorID, 
-												g_pImvMessageLongSubtypes, g_pImvVendorIDs,
-												g_nImvMessageLongSubtypesCount) )
-				{
-					rc = imvFuncs.pfnReceiveMessageLong( IMV_ID, cid, longTypeMessage->messageFlags, 
-						longTypeMessage->message, longTypeMessage->messageLength, 
-						longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, 
-						longTypeMessage->imvID, longTypeMessage->imvID);
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessageLong result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			} 
-			else if (imvFuncs.pfnReceiveMessage)
-			{
-				/* IMV doesn't implement TNC_IMV_ReceiveMessageLong function but
-				   TNCS can still delive the message using imvFuncs.pfnReceiveMessage.*/
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage (vendorID: %#x, subtype: %#x, length: %d)\n", 
-					longTypeMessage->messageVendorID, longTypeMessage->messageSubtype, longTypeMessage->messageLength );
-
-				/* Create a single message type from subtype and vendorID */
-				longMessageType = (longTypeMessage->messageVendorID << 8 | longTypeMessage->messageSubtype);
-
-				if( IsMessageTypeSupported( longMessageType, g_pImvMessageTypes, g_nImvMessageTypesCount ) )
-				{
-					rc = imvFuncs.pfnReceiveMessage( IMV_ID, cid, longTypeMessage->message, 
-						longTypeMessage->messageLength, longMessageType );
-					outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage result: %d\n", rc );
-				}
-				else
-				{
-					outfmt( OUT_LEVEL_NORMAL, "> Message type not registered; message not delivered!\n" );
-				}
-			}
-			else
-			{
-				outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_ReceiveMessage and "
-					"TNC_IMV_ReceiveMessageLong NOT SUPPORTED!\n" );
-			}
+			longTypeMessage = BatchGetMessageLong(&batch, i);
+			DeliverImvLongMessage( cid, longTypeMessage );
 		}
 	}
 
@@ -307,56 +963,411 @@ unsigned NotifyImvConnectionState( TNC_ConnectionID cid, TNC_ConnectionState sta
 {
     TNC_Result rc = TNC_RESULT_SUCCESS;
     extern char *g_pszConnStates[];
+    TNCS_CONNECTION *conn;
+    IMV_MODULE *imv;
+    unsigned i;
+
+    TraceCall( TRACE_EVENT_CONNECTION_STATE, TRACE_FLAG_TNCS, cid, 0, state, 0, NULL, TNC_RESULT_SUCCESS );
 
-    if( NULL != imvFuncs.pfnNotifyConnectionChange )
+    /* Recommendations only count for the handshake they were given in */
+    if( TNC_CONNECTION_STATE_CREATE == state )
+        ImvFindConnection( cid, 1 );
+    else if( TNC_CONNECTION_STATE_HANDSHAKE == state && NULL != (conn = ImvFindConnection( cid, 0 )) )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_NotifyConnectionChange (IMV: %d, CID: %d, state: `%s')\n", 
-            IMV_ID, cid, g_pszConnStates[ state ] );
+        memset( conn->results, 0, g_nImvCount * sizeof( conn->results[ 0 ] ) );
+
+        MutexLock( &conn->attributesLock );
+        ConnClearAttributes( conn );
+        MutexUnlock( &conn->attributesLock );
 
-        rc = imvFuncs.pfnNotifyConnectionChange( IMV_ID, cid, state );
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_NotifyConnectionChange result: %d\n", rc );
+        if( NULL != g_pszPreferredLanguage )
+            ConnSetAttribute( conn, TNC_ATTRIBUTEID_PREFERRED_LANGUAGE, IMV_ID_ALL,
+                (TNC_BufferReference) g_pszPreferredLanguage, (TNC_UInt32) strlen( g_pszPreferredLanguage ), NULL );
     }
 
+    for( i = 0; i < g_nImvCount; ++i )
+    {
+        imv = &g_Imvs[ i ];
+
+        if( NULL != imv->funcs.pfnNotifyConnectionChange )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_NotifyConnectionChange (IMV: %d, CID: %d, state: `%s')\n", 
+                imv->id, cid, g_pszConnStates[ state ] );
+
+            rc = imv->funcs.pfnNotifyConnectionChange( imv->id, cid, state );
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_NotifyConnectionChange result: %d\n", rc );
+        }
+    }
+
+    if( TNC_CONNECTION_STATE_DELETE == state )
+        ImvDeleteConnection( cid );
+
     return rc;
 }
 
-unsigned ImvBatchEnding( TNC_ConnectionID cid )
+static TNC_Result ImvBatchEndingFor( IMV_MODULE *imv, TNC_ConnectionID cid )
 {
     TNC_Result rc = TNC_RESULT_SUCCESS;
 
-    if( NULL != imvFuncs.pfnBatchEnding )
+    if( NULL != imv->funcs.pfnBatchEnding )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_BatchEnding (IMV: %d, CID: %d)\n", IMV_ID, cid );
-        rc = imvFuncs.pfnBatchEnding( IMV_ID, cid );
+        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_BatchEnding (IMV: %d, CID: %d)\n", imv->id, cid );
+        rc = imv->funcs.pfnBatchEnding( imv->id, cid );
         outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_BatchEnding result: %d\n", rc );
     }
 
     return rc;
 }
 
+unsigned ImvBatchEnding( TNC_ConnectionID cid )
+{
+    TNC_Result rc = TNC_RESULT_SUCCESS;
+    unsigned i;
+
+    for( i = 0; i < g_nImvCount; ++i )
+        rc = ImvBatchEndingFor( &g_Imvs[ i ], cid );
+
+    return rc;
+}
+
+/* Note an item of a parallel batch for the IMVs in ids. Items no IMV
+   receives are left out. */
+static IMV_ITEM* ImvBatchAdd( IMV_BATCH *batch, unsigned category, const TNC_UInt32 *ids, unsigned count )
+{
+    unsigned long targets = 0;
+    IMV_ITEM *items;
+    unsigned size;
+
+    while( count-- > 0 )
+        targets |= IMV_TARGET( ids[ count ] );
+
+    if( 0 == targets || batch->bFailed )
+        return NULL;
+
+    if( batch->nItems == batch->nItemSlots )
+    {
+        size = 0 != batch->nItemSlots ? 2 * batch->nItemSlots : 16;
+        items = (IMV_ITEM *) realloc( batch->items, size * sizeof( *items ) );
+        if( NULL == items )
+        {
+            batch->bFailed = 1;
+            return NULL;
+        }
+
+        batch->items = items;
+        batch->nItemSlots = size;
+    }
+
+    batch->items[ batch->nItems ].targets = targets;
+    batch->items[ batch->nItems ].category = category;
+    return &batch->items[ batch->nItems++ ];
+}
+
+/* An SOH_ENTRY_CALLBACK whose context is the batch being built */
+static void ImvBatchAddSohEntry( void *context, const SOH_ENTRY *entry )
+{
+    TNC_UInt32 buffer[ TNCS_MAX_IMVS ];
+    const TNC_UInt32 *ids;
+    IMV_ITEM *item;
+    unsigned count;
+
+    count = ImvRouteSohEntry( entry, buffer, &ids );
+    item = ImvBatchAdd( (IMV_BATCH *) context, MESSAGE_CATEGORY_SOH, ids, count );
+    if( NULL != item )
+        item->entry = *entry;
+}
+
+/* Route every message of the batch once. SoHs are split in place, so their
+   entries stay valid while the tasks run. Returns 0 on success. */
+static unsigned ImvBuildBatch( IMV_BATCH *batch )
+{
+    TNC_UInt32 buffer[ TNCS_MAX_IMVS ];
+    const TNC_UInt32 *ids;
+    MESSAGE_BATCH messages;
+    MESSAGE_BASIC *basicMessage;
+    MESSAGE_LONG *longTypeMessage;
+    IMV_ITEM *item;
+    unsigned i, n, count;
+
+    count = QueueGetBatch( batch->cid, QUEUE_TO_IMV, &messages );
+    for( i = 0; i < count; ++i )
+    {
+        switch( BatchGetMessageCategory( &messages, i ) )
+        {
+        case MESSAGE_CATEGORY_BASIC:
+            basicMessage = BatchGetMessage( &messages, i );
+            n = ImvRouteBasic( basicMessage, buffer, &ids );
+            item = ImvBatchAdd( batch, MESSAGE_CATEGORY_BASIC, ids, n );
+            if( NULL != item )
+                item->message = basicMessage;
+            break;
+
+        case MESSAGE_CATEGORY_SOH:
+            ImvSplitSoh( BatchGetMessageSOH( &messages, i ), ImvBatchAddSohEntry, batch );
+            break;
+
+        case MESSAGE_CATEGORY_LONG:
+            longTypeMessage = BatchGetMessageLong( &messages, i );
+            n = ImvRouteLong( longTypeMessage, buffer, &ids );
+            item = ImvBatchAdd( batch, MESSAGE_CATEGORY_LONG, ids, n );
+            if( NULL != item )
+                item->message = longTypeMessage;
+            break;
+        }
+    }
+
+    return batch->bFailed;
+}
+
+/* Deliver the items of a batch that one IMV receives, then end the batch
+   for it */
+static void ImvRunTask( IMV_BATCH *batch, unsigned id )
+{
+    IMV_MODULE *imv = &g_Imvs[ id ];
+    const unsigned long target = IMV_TARGET( id );
+    const IMV_ITEM *item = batch->items;
+    const IMV_ITEM *end = item + batch->nItems;
+
+    for( ; item < end; ++item )
+    {
+        if( 0 == (item->targets & target) )
+            continue;
+
+        switch( item->category )
+        {
+        case MESSAGE_CATEGORY_BASIC:
+            DeliverImvBasicMessageTo( imv, batch->cid, (MESSAGE_BASIC *) item->message );
+            break;
+
+        case MESSAGE_CATEGORY_SOH:
+            DeliverImvSohEntryTo( imv, batch->cid, &item->entry );
+            break;
+
+        case MESSAGE_CATEGORY_LONG:
+            DeliverImvLongMessageTo( imv, batch->cid, (MESSAGE_LONG *) item->message,
+                ImvLongDelivery( (MESSAGE_LONG *) item->message ) );
+            break;
+        }
+    }
+
+    if( batch->bEnd )
+        ImvBatchEndingFor( imv, batch->cid );
+}
+
+static void ImvHelperThread( void *arg )
+{
+    IMV_BATCH *batch;
+    unsigned i;
+
+    (void) arg;
+
+    MutexLock( &g_BatchesLock );
+    while( ! g_bStopImvHelpers )
+    {
+        for( batch = g_pBatches; NULL != batch && batch->nNext >= g_nImvCount; batch = batch->next );
+
+        if( NULL == batch )
+        {
+            CondWait( &g_BatchPosted, &g_BatchesLock );
+            continue;
+        }
+
+        /* Once a task is claimed the poster waits for it, so the batch stays
+           valid until it is done */
+        i = batch->nNext++;
+        MutexUnlock( &g_BatchesLock );
+
+        ImvRunTask( batch, i );
+
+        MutexLock( &g_BatchesLock );
+        if( 0 == --batch->nPending )
+            CondBroadcast( &g_BatchDone );
+    }
+    MutexUnlock( &g_BatchesLock );
+}
+
+/* Deliver the messages taken from the queue, and end the batch if bEnd is
+   set, on the helpers if there are any */
+static unsigned ImvDeliverParallel( TNC_ConnectionID cid, unsigned bEnd )
+{
+    IMV_BATCH batch, **ppBatch;
+    unsigned i;
+
+    if( 0 == g_nImvHelpers )
+    {
+        DeliverImvMessages( cid );
+        return bEnd ? ImvBatchEnding( cid ) : TNC_RESULT_SUCCESS;
+    }
+
+    ImvCacheSoh( cid );
+
+    memset( &batch, 0, sizeof( batch ) );
+    batch.cid = cid;
+    batch.bEnd = bEnd;
+    batch.nPending = g_nImvCount;
+
+    if( 0 != ImvBuildBatch( &batch ) )
+    {
+        /* Out of memory; deliver it one IMV after another instead */
+        free( batch.items );
+        DeliverImvMessages( cid );
+        return bEnd ? ImvBatchEnding( cid ) : TNC_RESULT_SUCCESS;
+    }
+
+    MutexLock( &g_BatchesLock );
+    batch.next = g_pBatches;
+    g_pBatches = &batch;
+    CondBroadcast( &g_BatchPosted );
+
+    while( batch.nNext < g_nImvCount )
+    {
+        i = batch.nNext++;
+        MutexUnlock( &g_BatchesLock );
+
+        ImvRunTask( &batch, i );
+
+        MutexLock( &g_BatchesLock );
+        --batch.nPending;
+    }
+
+    /* Every task has been claimed; take the batch down, then wait for the
+       helpers to finish theirs */
+    for( ppBatch = &g_pBatches; &batch != *ppBatch; ppBatch = &(*ppBatch)->next );
+    *ppBatch = batch.next;
+
+    while( 0 != batch.nPending )
+        CondWait( &g_BatchDone, &g_BatchesLock );
+    MutexUnlock( &g_BatchesLock );
+
+    free( batch.items );
+    return TNC_RESULT_SUCCESS;
+}
+
+unsigned ImvDeliverBatch( TNC_ConnectionID cid )
+{
+    return ImvDeliverParallel( cid, 1 );
+}
+
+unsigned ImvDeliverPipelined( TNC_ConnectionID cid )
+{
+    return ImvDeliverParallel( cid, 0 );
+}
+
+/* Order of the recommendations from least to most restrictive */
+static const unsigned g_nRecommendationRank[] = { 1, 3, 2, 0 };
+
+/* Combine the recommendations of all IMVs into one according to the policy.
+   Returns the index of the IMV whose recommendation was taken, or
+   g_nImvCount if none gave one. */
+static unsigned ImvCombineRecommendations( const IMV_RESULT *results )
+{
+    unsigned votes[ TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION + 1 ];
+    unsigned first[ TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION + 1 ];
+    unsigned i, winner = g_nImvCount;
+    unsigned rank = g_nRecommendationRank[ TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION ];
+    TNC_IMV_Action_Recommendation r, best;
+
+    switch( g_eRecommendationPolicy )
+    {
+    case RECOMMENDATION_POLICY_FIRST_ALLOW:
+        for( i = 0; i < g_nImvCount; ++i )
+            if( results[ i ].bProvided && TNC_IMV_ACTION_RECOMMENDATION_ALLOW == results[ i ].nRecommendation )
+                return i;
+        break;
+
+    case RECOMMENDATION_POLICY_MAJORITY:
+        /* IMVs without a recommendation don't vote */
+        memset( votes, 0, sizeof( votes ) );
+        for( i = 0; i < g_nImvCount; ++i )
+        {
+            r = results[ i ].nRecommendation;
+            if( results[ i ].bProvided && TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION != r && 0 == votes[ r ]++ )
+                first[ r ] = i;
+        }
+
+        best = TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION;
+        for( r = 0; r < TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION; ++r )
+        {
+            if( 0 != votes[ r ] && (TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION == best || votes[ r ] > votes[ best ] ||
+                (votes[ r ] == votes[ best ] && g_nRecommendationRank[ r ] > g_nRecommendationRank[ best ])) )
+                best = r;
+        }
+
+        if( TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION != best )
+            return first[ best ];
+        break;
+
+    default:
+        break;
+    }
+
+    /* The most restrictive recommendation of all IMVs wins; also the
+       fallback when no IMV allows access under RECOMMENDATION_POLICY_FIRST_ALLOW */
+    for( i = 0; i < g_nImvCount; ++i )
+    {
+        if( results[ i ].bProvided && g_nRecommendationRank[ results[ i ].nRecommendation ] > rank )
+        {
+            winner = i;
+            rank = g_nRecommendationRank[ results[ i ].nRecommendation ];
+        }
+    }
+
+    return winner;
+}
+
 unsigned ImvGetRecommendation( TNC_ConnectionID cid, unsigned *result )
 {
     TNC_Result rc;
+    TNC_IMV_Action_Recommendation recommendation = TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION;
+    TNC_IMV_Evaluation_Result evaluation = TNC_IMV_EVALUATION_RESULT_DONT_KNOW;
+    TNCS_CONNECTION *conn;
+    IMV_MODULE *imv;
+    char reason[ 256 ];
+    TNC_UInt32 length;
+    unsigned i;
     static unsigned nRecommendation2ConnState[] = 
     {
         TNC_CONNECTION_STATE_ACCESS_ALLOWED, TNC_CONNECTION_STATE_ACCESS_NONE, 
         TNC_CONNECTION_STATE_ACCESS_ISOLATED, TNC_CONNECTION_STATE_ACCESS_NONE
     };
 
-    if( ! g_bRecommendationProvided )
+    conn = ImvFindConnection( cid, 0 );
+    if( NULL == conn )
+        return -1;
+
+    for( i = 0; i < g_nImvCount; ++i )
     {
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_SolicitRecommendation (IMV: %d, CID: %d)\n", IMV_ID, cid );
-        rc = imvFuncs.pfnSolicitRecommendation( IMV_ID, cid );
-        outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_SolicitRecommendation result %d\n", rc );
+        imv = &g_Imvs[ i ];
+
+        if( ! conn->results[ i ].bProvided )
+        {
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_SolicitRecommendation (IMV: %d, CID: %d)\n", imv->id, cid );
+            rc = imv->funcs.pfnSolicitRecommendation( imv->id, cid );
+            outfmt( OUT_LEVEL_NORMAL, "> TNC_IMV_SolicitRecommendation result %d\n", rc );
 
-        if( TNC_RESULT_SUCCESS != rc )
-            return -1;
+            if( TNC_RESULT_SUCCESS != rc )
+                return -1;
+        }
+    }
+
+    i = ImvCombineRecommendations( conn->results );
+    if( i < g_nImvCount )
+    {
+        recommendation = conn->results[ i ].nRecommendation;
+        evaluation = conn->results[ i ].nEvaluation;
+
+        if( TNC_RESULT_SUCCESS == ConnGetAttribute( conn, TNC_ATTRIBUTEID_REASON_STRING, i, sizeof( reason ),
+                (TNC_BufferReference) reason, &length ) && length < sizeof( reason ) )
+        {
+            reason[ length ] = '\0';
+            outfmt( OUT_LEVEL_NORMAL, "IMV %d gave the reason '%s' (CID: %d)\n", i, reason, cid );
+        }
     }
 
     if( NULL != result )
-        *result = g_nEvaluation;
+        *result = evaluation;
 
-    return nRecommendation2ConnState[ g_nRecommendation ];
+    return nRecommendation2ConnState[ recommendation ];
 }
 
 TNC_Result TNC_TNCS_SendMessage(
@@ -378,7 +1389,10 @@ TNC_Result TNC_TNCS_SendMessage(
 	basicMessage.messageLength = messageLength;
 	basicMessage.messageType = messageType;
 
-    QueueAddMessage( &basicMessage );
+    QueueAddMessage( connectionID, QUEUE_TO_IMC, &basicMessage );
+
+    TraceMessage( TRACE_EVENT_SEND_MESSAGE, TRACE_FLAG_TNCS, connectionID, imvID, 0, EXTRACT_VENDOR( messageType ), EXTRACT_SUBTYPE( messageType ),
+        0, message, messageLength, TNC_RESULT_OTHER );
 
     return TNC_RESULT_OTHER;
 }
@@ -400,7 +1414,9 @@ TNC_Result TNC_TNCS_SendMessageSOH(
 	sohMessage.sohReportEntry = sohReportEntry;
 	sohMessage.sohRELength = sohRELength;
 
-    QueueAddMessageSOH( &sohMessage );
+    QueueAddMessageSOH( connectionID, QUEUE_TO_IMC, &sohMessage );
+
+    TraceMessage( TRACE_EVENT_SEND_MESSAGE_SOH, TRACE_FLAG_TNCS, connectionID, imvID, 0, 0, 0, 0, sohReportEntry, sohRELength, TNC_RESULT_SUCCESS );
 
     return TNC_RESULT_SUCCESS;
 }
@@ -433,7 +1449,10 @@ TNC_Result TNC_TNCS_SendMessageLong(
 	longTypeMessage.messageSubtype = messageSubtype;
 	longTypeMessage.messageVendorID = messageVendorID;
 
-    QueueAddMessageLong( &longTypeMessage );
+    QueueAddMessageLong( connectionID, QUEUE_TO_IMC, &longTypeMessage );
+
+    TraceMessage( TRACE_EVENT_SEND_MESSAGE_LONG, TRACE_FLAG_TNCS, connectionID, imvID, destinationIMCID, messageVendorID, messageSubtype,
+        messageFlags, message, messageLength, TNC_RESULT_SUCCESS );
 
     return TNC_RESULT_SUCCESS;
 }
@@ -454,12 +1473,25 @@ TNC_Result TNC_TNCS_ProvideRecommendation(
         "Compliant", "minor noncompliance", "MAJOR noncompliance", "Error", "Don't know"
     };
 
+    IMV_MODULE *imv = GetImv( imvID );
+    TNCS_CONNECTION *conn = NULL != imv ? ImvFindConnection( connectionID, 0 ) : NULL;
+
+    if( NULL == conn || recommendation > TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION ||
+        compliance > TNC_IMV_EVALUATION_RESULT_DONT_KNOW )
+    {
+        TraceCall( TRACE_EVENT_PROVIDE_RECOMMENDATION, TRACE_FLAG_TNCS, connectionID, imvID, recommendation, compliance,
+            NULL, TNC_RESULT_INVALID_PARAMETER );
+        return TNC_RESULT_INVALID_PARAMETER;
+    }
+
     outfmt( OUT_LEVEL_NORMAL, "< TNC_TNCS_ProvideRecommendation: IMV %d, CID %d, '%s', '%s'\n",
         imvID, connectionID, rs[ recommendation ], cs[ compliance ] );
 
-    g_nRecommendation = recommendation;
-    g_nEvaluation = compliance;
-    g_bRecommendationProvided = 1;
+    conn->results[ imvID ].nRecommendation = recommendation;
+    conn->results[ imvID ].nEvaluation = compliance;
+    conn->results[ imvID ].bProvided = 1;
+    TraceCall( TRACE_EVENT_PROVIDE_RECOMMENDATION, TRACE_FLAG_TNCS, connectionID, imvID, recommendation, compliance,
+        NULL, TNC_RESULT_SUCCESS );
     return TNC_RESULT_SUCCESS;
 }
 
@@ -468,21 +1500,23 @@ TNC_Result TNC_TNCS_ReportMessageTypes(
 /*in*/  TNC_MessageTypeList supportedTypes,
 /*in*/  TNC_UInt32 typeCount) 
 {
+    IMV_MODULE *imv = GetImv( imvID );
+    TNC_Result rc;
     unsigned i;
 
-    if( typeCount > g_nImvMessageTypesCount )
-        g_pImvMessageTypes = (TNC_MessageTypeList) realloc( g_pImvMessageTypes, sizeof( *supportedTypes ) * typeCount );
+    if( NULL == imv )
+    {
+        TraceMessageTypes( TRACE_FLAG_TNCS, imvID, supportedTypes, typeCount, TNC_RESULT_INVALID_PARAMETER );
+        return TNC_RESULT_INVALID_PARAMETER;
+    }
 
     outfmt( OUT_LEVEL_NORMAL, "< TNC_TNCS_ReportMessageTypes (IMV %d)", imvID );
-    if( typeCount > 0 )
+    if( typeCount > 0 && NULL != supportedTypes )
     {
-        memcpy( g_pImvMessageTypes, supportedTypes, sizeof( *supportedTypes ) * typeCount );
-        g_nImvMessageTypesCount = typeCount;
-
         for( i=0; i < typeCount; ++i )
             outfmt( OUT_LEVEL_NORMAL, "%c%#x%c", 
                 0 == i ? '\n' : ' ', 
-                g_pImvMessageTypes[ i ], 
+                supportedTypes[ i ], 
                 i == typeCount - 1 ? '\n' : ',' );
     }
     else
@@ -490,7 +1524,11 @@ TNC_Result TNC_TNCS_ReportMessageTypes(
         outfmt( OUT_LEVEL_NORMAL, "\nEmpty message list. No messages will be delivered to this IMV!\n" );
 	}
 
-    return TNC_RESULT_SUCCESS;
+    rc = TypeIndexBuild( &imv->types, supportedTypes, typeCount ) ? TNC_RESULT_OTHER : TNC_RESULT_SUCCESS;
+    ImvRebuildRoutes();
+    TraceMessageTypes( TRACE_FLAG_TNCS, imvID, supportedTypes, typeCount, rc );
+
+    return rc;
 }
 
 TNC_Result TNC_TNCS_ReportMessageTypesLong(
@@ -499,26 +1537,24 @@ TNC_Result TNC_TNCS_ReportMessageTypesLong(
 /*in*/  TNC_MessageSubtypeList supportedSubtypes,
 /*in*/  TNC_UInt32 typeCount)
 {
+    IMV_MODULE *imv = GetImv( imvID );
+    TNC_Result rc;
     unsigned i;
 
-    if( typeCount > g_nImvMessageLongSubtypesCount )
-	{
-		g_pImvMessageLongSubtypes = (TNC_MessageSubtypeList) realloc( g_pImvMessageLongSubtypes, sizeof( *supportedSubtypes ) * typeCount );
-		g_pImvVendorIDs = (TNC_VendorIDList) realloc( g_pImvVendorIDs, sizeof(TNC_VendorID) * typeCount );
-	}
+    if( NULL == imv )
+    {
+        TraceMessageTypesLong( TRACE_FLAG_TNCS, imvID, supportedVendorIDs, supportedSubtypes, typeCount, TNC_RESULT_INVALID_PARAMETER );
+        return TNC_RESULT_INVALID_PARAMETER;
+    }
 
     outfmt( OUT_LEVEL_NORMAL, "< TNC_TNCS_ReportMessageTypesLong (IMV %d)", imvID );
-    if( typeCount > 0 )
+    if( typeCount > 0 && NULL != supportedVendorIDs && NULL != supportedSubtypes )
     {
-        memcpy( g_pImvMessageLongSubtypes, supportedSubtypes, sizeof( *supportedSubtypes ) * typeCount );
-		memcpy( g_pImvVendorIDs, supportedVendorIDs, sizeof( *supportedVendorIDs ) * typeCount );
-        g_nImvMessageLongSubtypesCount = typeCount;
-
         for( i=0; i < typeCount; ++i )
 			outfmt( OUT_LEVEL_NORMAL, "%c(vendor ID %#x, message subtype %#x)%c", 
                 0 == i ? '\n' : ' ', 
-				g_pImvVendorIDs[i],
-                g_pImvMessageLongSubtypes[i], 
+				supportedVendorIDs[i],
+                supportedSubtypes[i],
                 i == typeCount - 1 ? '\n' : ',' );
     }
     else
@@ -526,7 +1562,12 @@ TNC_Result TNC_TNCS_ReportMessageTypesLong(
         outfmt( OUT_LEVEL_NORMAL, "\nEmpty message list. No messages will be delivered to this IMV!\n" );
 	}
 
-    return TNC_RESULT_SUCCESS;
+    rc = TypeIndexBuildLong( &imv->longTypes, supportedVendorIDs, supportedSubtypes, typeCount ) ?
+        TNC_RESULT_OTHER : TNC_RESULT_SUCCESS;
+    ImvRebuildRoutes();
+    TraceMessageTypesLong( TRACE_FLAG_TNCS, imvID, supportedVendorIDs, supportedSubtypes, typeCount, rc );
+
+    return rc;
 }
 
 TNC_Result TNC_TNCS_RequestHandshakeRetry(
@@ -534,20 +1575,93 @@ TNC_Result TNC_TNCS_RequestHandshakeRetry(
 /*in*/  TNC_ConnectionID connectionID,
 /*in*/  TNC_RetryReason reason)
 {
+    TraceCall( TRACE_EVENT_REQUEST_RETRY, TRACE_FLAG_TNCS, connectionID, imvID, reason, 0, NULL, TNC_RESULT_SUCCESS );
     return TNC_RESULT_SUCCESS;
 }
 
-static TNC_Result CopyBuffer( const char *src, TNC_UInt32 dstLen, TNC_BufferReference dst, TNC_UInt32 *strLen )
+TNC_Result TNC_TNCS_GetAttribute(
+/*in*/  TNC_IMVID imvID,
+/*in*/  TNC_ConnectionID connectionID,
+/*in*/  TNC_AttributeID attributeID,
+/*in*/  TNC_UInt32 bufferLength,
+/*out*/ TNC_BufferReference buffer,
+/*out*/ TNC_UInt32 *pOutValueLength)
 {
-    *strLen = 1 + strlen( src );
+    TNCS_CONNECTION *conn;
+    unsigned char value[ 4 ];
+    TNC_UInt32 number;
 
-    if( dstLen < *strLen )
-        return TNC_RESULT_OTHER;
+    if( NULL == GetImv( imvID ) )
+        return TNC_RESULT_INVALID_PARAMETER;
 
-    strcpy( (char*) dst, src );
-    return TNC_RESULT_SUCCESS;
+    /* Attributes of the TNCS itself are answered without finding the
+       connection, as IMVs tend to ask for them with every message. The
+       booleans are a single byte, the numbers a UInt32 in network order. */
+    switch( attributeID )
+    {
+    case TNC_ATTRIBUTEID_HAS_LONG_TYPES:
+    case TNC_ATTRIBUTEID_HAS_EXCLUSIVE:
+    case TNC_ATTRIBUTEID_HAS_SOH:
+        value[ 0 ] = 1;
+        return CopyAttribute( value, 1, bufferLength, buffer, pOutValueLength );
+
+    case TNC_ATTRIBUTEID_MAX_ROUND_TRIPS:
+        number = 0 != g_nMaxRoundTrips ? (TNC_UInt32) g_nMaxRoundTrips : 0xFFFFFFFF;
+        break;
+
+    case TNC_ATTRIBUTEID_MAX_MESSAGE_SIZE:
+        number = 0xFFFFFFFF;
+        break;
+
+    case TNC_ATTRIBUTEID_PRIMARY_IMV_ID:
+        number = imvID;
+        break;
+
+    case TNC_ATTRIBUTEID_SOH:
+    case TNC_ATTRIBUTEID_PREFERRED_LANGUAGE:
+        conn = ImvFindConnection( connectionID, 0 );
+        return NULL != conn ? ConnGetAttribute( conn, attributeID, IMV_ID_ALL, bufferLength, buffer, pOutValueLength ) :
+            TNC_RESULT_INVALID_PARAMETER;
+
+    case TNC_ATTRIBUTEID_REASON_STRING:
+    case TNC_ATTRIBUTEID_REASON_LANGUAGE:
+        conn = ImvFindConnection( connectionID, 0 );
+        return NULL != conn ? ConnGetAttribute( conn, attributeID, imvID, bufferLength, buffer, pOutValueLength ) :
+            TNC_RESULT_INVALID_PARAMETER;
+
+    /* The tester's TNCC and TNCS share no TLS session, so there is no
+       TLS-Unique value for an IMV to bind to */
+    case TNC_ATTRIBUTEID_TLS_UNIQUE:
+    default:
+        return TNC_RESULT_INVALID_PARAMETER;
+    }
+
+    value[ 0 ] = (unsigned char) (number >> 24);
+    value[ 1 ] = (unsigned char) (number >> 16);
+    value[ 2 ] = (unsigned char) (number >> 8);
+    value[ 3 ] = (unsigned char) number;
+    return CopyAttribute( value, sizeof( value ), bufferLength, buffer, pOutValueLength );
 }
 
+TNC_Result TNC_TNCS_SetAttribute(
+/*in*/  TNC_IMVID imvID,
+/*in*/  TNC_ConnectionID connectionID,
+/*in*/  TNC_AttributeID attributeID,
+/*in*/  TNC_UInt32 bufferLength,
+/*in*/  TNC_BufferReference buffer)
+{
+    TNCS_CONNECTION *conn = NULL != GetImv( imvID ) ? ImvFindConnection( connectionID, 0 ) : NULL;
+
+    /* IMVs only give the reasons for their recommendations */
+    if( NULL == conn || (NULL == buffer && 0 != bufferLength) ||
+        (TNC_ATTRIBUTEID_REASON_STRING != attributeID && TNC_ATTRIBUTEID_REASON_LANGUAGE != attributeID) )
+        return TNC_RESULT_INVALID_PARAMETER;
+
+    outfmt( OUT_LEVEL_NORMAL, "< TNC_TNCS_SetAttribute: IMV %d, CID %d, attribute %#x, length %d\n",
+        imvID, connectionID, attributeID, bufferLength );
+
+    return ConnSetAttribute( conn, attributeID, imvID, buffer, bufferLength, NULL );
+}
 
 TNC_Result TNC_TNCS_BindFunction(
 /*in*/  TNC_IMVID imvID,
@@ -579,5 +1693,12 @@ TNC_Result TNC_TNCS_BindFunction(
     else if (!strcmp(functionName, "TNC_TNCS_RequestHandshakeRetry"))
         *pOutfunctionPointer = &TNC_TNCS_RequestHandshakeRetry;
 
+    else if (!strcmp(functionName, "TNC_TNCS_GetAttribute"))
+        *pOutfunctionPointer = &TNC_TNCS_GetAttribute;
+
+    else if (!strcmp(functionName, "TNC_TNCS_SetAttribute"))
+        *pOutfunctionPointer = &TNC_TNCS_SetAttribute;
+
+    TraceCall( TRACE_EVENT_BIND_FUNCTION, TRACE_FLAG_TNCS, 0, imvID, 0, 0, functionName, TNC_RESULT_SUCCESS );
     return TNC_RESULT_SUCCESS;
 }
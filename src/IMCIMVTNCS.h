@@ -52,13 +52,42 @@ typedef struct IMVFuncs
     TNC_IMV_BatchEndingPointer				pfnBatchEnding;
 } IMVFuncs;
 
+/* Maximum number of IMVs the TNCS can load at the same time */
+#define TNCS_MAX_IMVS  32
+
+/* How the recommendations of several IMVs are combined into the outcome of
+   a handshake. IMVs that were asked for a recommendation and gave none are
+   left out. */
+typedef enum eRECOMMENDATION_POLICY_tag
+{
+    RECOMMENDATION_POLICY_DENY_WINS,	/* The most restrictive recommendation wins */
+    RECOMMENDATION_POLICY_MAJORITY,		/* The recommendation most IMVs gave wins; ties go to the more restrictive */
+    RECOMMENDATION_POLICY_FIRST_ALLOW	/* Access is allowed if any IMV allows it; otherwise deny wins */
+} eRECOMMENDATION_POLICY;
+
 int LoadIMV(const char *dllPath);
 int InitializeIMV(void);
 void TerminateIMV(void);
 unsigned DeliverImvMessages( TNC_ConnectionID cid );
 unsigned NotifyImvConnectionState( TNC_ConnectionID cid, TNC_ConnectionState state );
 unsigned ImvBatchEnding( TNC_ConnectionID cid );
+
+/* Deliver the current batch and end it. With parallel delivery, each IMV gets
+   its messages and its BatchEnding on a thread of its own, in order, while the
+   other IMVs get theirs; the IMVs must then be safe to call concurrently for
+   the same connection. Parallel delivery is set before InitializeIMV. */
+unsigned ImvDeliverBatch( TNC_ConnectionID cid );
+
+/* Deliver the part of a batch that was taken early, while the IMCs were
+   still sending it, the same way but without ending it */
+unsigned ImvDeliverPipelined( TNC_ConnectionID cid );
+void ImvSetParallelDelivery( unsigned bParallel );
 unsigned ImvGetRecommendation( TNC_ConnectionID cid, unsigned *result );
+void ImvSetRecommendationPolicy( eRECOMMENDATION_POLICY policy );
+
+/* The language TNC_ATTRIBUTEID_PREFERRED_LANGUAGE reports, in the form of an
+   HTTP Accept-Language header; by default there is none */
+void ImvSetPreferredLanguage( char *pszLanguage );
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,95 @@
+/*
+ * IMCIMVTNCSUnix.c
+ *
+ * UNIX/Linux-specific portions of IMCIMVTester TNCS Code
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stddef.h>
+#include "IMCIMVTNCS.h"
+
+
+/* LoadEntrypoint
+ *
+ * Load a shared object entrypoint into a function table.
+ *
+ * Load the entrypoint named "entryName" from the shared object
+ * with handle "dll" and store the function pointer at the location
+ * pointed to by "funcPtr". In case of error, store NULL as
+ * the function pointer.
+ */
+
+void LoadEntryPoint(void *dll, char *entryName, void **funcPtr);
+void* OpenSharedObject(const char *dllPath);
+
+
+/* LoadImvDLL
+ *
+ * Load an IMV from the shared object with path dllPath, filling
+ * in function table at funcTable. The shared object handle is
+ * stored at phDLL even on failure so the caller can close it.
+ * Return an errno value in case of error, 0 for success
+ */
+
+int LoadImvDLL(const char *dllPath, IMVFuncs *funcTable, void **phDLL) 
+{
+    void *dll;
+
+    dll = *phDLL = OpenSharedObject( dllPath );
+    if (!dll)
+        return ENOENT;
+    
+    LoadEntryPoint(dll, "TNC_IMV_Initialize", (void**)&funcTable->pfnInitialize );
+    if( NULL == funcTable->pfnInitialize )
+        return ENOSYS;
+
+    LoadEntryPoint(dll, "TNC_IMV_SolicitRecommendation", (void**)&funcTable->pfnSolicitRecommendation );
+    if( NULL == funcTable->pfnSolicitRecommendation )
+        return ENOSYS;
+
+    LoadEntryPoint(dll, "TNC_IMV_ProvideBindFunction", (void**)&funcTable->pfnProvideBind );
+    LoadEntryPoint(dll, "TNC_IMV_NotifyConnectionChange", (void**)&funcTable->pfnNotifyConnectionChange );
+    LoadEntryPoint(dll, "TNC_IMV_ReceiveMessage", (void**)&funcTable->pfnReceiveMessage );
+    LoadEntryPoint(dll, "TNC_IMV_ReceiveMessageSOH", (void**)&funcTable->pfnReceiveMessageSOH );
+    LoadEntryPoint(dll, "TNC_IMV_ReceiveMessageLong", (void**)&funcTable->pfnReceiveMessageLong );
+    LoadEntryPoint(dll, "TNC_IMV_Terminate", (void**)&funcTable->pfnTerminate );
+    LoadEntryPoint(dll, "TNC_IMV_BatchEnding", (void**)&funcTable->pfnBatchEnding );
+    return 0;
+}
+
+
+void UnloadImvDLL(void *hDLL)
+{
+    if( NULL != hDLL )
+        dlclose( hDLL );
+}
@@ -37,8 +37,6 @@
 #include "IMCIMVTNCS.h"
 
 
-static HMODULE g_imvDLL = 0;
-
 /* LoadEntrypoint
  *
  * Load a DLL entrypoint into a function table.
@@ -55,37 +53,41 @@ void LoadEntryPoint(HMODULE dll, char *entryName, void **funcPtr);
 /* LoadImvDLL
  *
  * Load an IMV from DLL with path dllPath, filling in function
- * table at funcTable.
+ * table at funcTable. The module handle is stored at phDLL
+ * even on failure so the caller can free it.
  * Return a Windows error code in case of error, 0 for success
  */
 
-int LoadImvDLL(const char *dllPath, IMVFuncs *funcTable) 
+int LoadImvDLL(const char *dllPath, IMVFuncs *funcTable, void **phDLL) 
 {
-    g_imvDLL = LoadLibrary( dllPath );
-    if (!g_imvDLL)
+    HMODULE dll;
+
+    dll = LoadLibrary( dllPath );
+    *phDLL = dll;
+    if (!dll)
         return GetLastError();
     
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_Initialize", (void**)&funcTable->pfnInitialize );
+    LoadEntryPoint(dll, "TNC_IMV_Initialize", (void**)&funcTable->pfnInitialize );
     if( NULL == funcTable->pfnInitialize )
         return GetLastError();
 
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_SolicitRecommendation", (void**)&funcTable->pfnSolicitRecommendation );
+    LoadEntryPoint(dll, "TNC_IMV_SolicitRecommendation", (void**)&funcTable->pfnSolicitRecommendation );
     if( NULL == funcTable->pfnSolicitRecommendation )
         return GetLastError();
 
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_ProvideBindFunction", (void**)&funcTable->pfnProvideBind );
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_NotifyConnectionChange", (void**)&funcTable->pfnNotifyConnectionChange );
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_ReceiveMessage", (void**)&funcTable->pfnReceiveMessage );
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_ReceiveMessageSOH", (void**)&funcTable->pfnReceiveMessageSOH );
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_ReceiveMessageLong", (void**)&funcTable->pfnReceiveMessageLong );
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_Terminate", (void**)&funcTable->pfnTerminate );
-    LoadEntryPoint(g_imvDLL, "TNC_IMV_BatchEnding", (void**)&funcTable->pfnBatchEnding );
+    LoadEntryPoint(dll, "TNC_IMV_ProvideBindFunction", (void**)&funcTable->pfnProvideBind );
+    LoadEntryPoint(dll, "TNC_IMV_NotifyConnectionChange", (void**)&funcTable->pfnNotifyConnectionChange );
+    LoadEntryPoint(dll, "TNC_IMV_ReceiveMessage", (void**)&funcTable->pfnReceiveMessage );
+    LoadEntryPoint(dll, "TNC_IMV_ReceiveMessageSOH", (void**)&funcTable->pfnReceiveMessageSOH );
+    LoadEntryPoint(dll, "TNC_IMV_ReceiveMessageLong", (void**)&funcTable->pfnReceiveMessageLong );
+    LoadEntryPoint(dll, "TNC_IMV_Terminate", (void**)&funcTable->pfnTerminate );
+    LoadEntryPoint(dll, "TNC_IMV_BatchEnding", (void**)&funcTable->pfnBatchEnding );
     return 0;
 }
 
 
-void UnloadImvDLL(void)
+void UnloadImvDLL(void *hDLL)
 {
-    if( NULL != g_imvDLL )
-        FreeLibrary( g_imvDLL );
+    if( NULL != hDLL )
+        FreeLibrary( (HMODULE) hDLL );
 }
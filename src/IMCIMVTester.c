@@ -37,14 +37,21 @@
 #include "IMCIMVTester.h"
 #include "IMCIMVTNCC.h"
 #include "IMCIMVTNCS.h"
+#include "IMCIMVDriver.h"
+#include "IMCIMVBench.h"
+#include "IMCIMVReplay.h"
+#include "corpus.h"
 #include "msgqueue.h"
 #include "output.h"
+#include "trace.h"
 
 #ifdef WIN32
-#define _WIN32_WINNT 0x0400
+#define _WIN32_WINNT 0x0600	/* tncthread.h uses condition variables */
 #include <windows.h>
 #endif
 
+#include "tncthread.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -63,15 +70,58 @@ static char g_pszImcPathName[_MAX_PATH] = {"./SimpleIMC.dll"};
 static char g_pszImvPathName[_MAX_PATH] = {"./SimpleIMV.dll"};
 #endif
 
+/* Modules named with -imc and -imv, in command line order. The defaults
+   above are loaded only when none are given. */
+static char *g_pszImcPaths[ TNCC_MAX_IMCS ];
+static unsigned g_nImcPaths = 0;
+static char *g_pszImvPaths[ TNCS_MAX_IMVS ];
+static unsigned g_nImvPaths = 0;
+
 unsigned g_nAsciiOutput = 1;
-unsigned g_nVerbose = 0;
+unsigned g_nVerbose = OUT_LEVEL_NORMAL;
 TNC_ConnectionID g_nCID = 0;
+unsigned g_nLoadFlags = 0;
+unsigned g_nMaxRoundTrips = 0;
+unsigned g_bPipeline = 0;
+
+/* Number of simultaneous connections and worker threads; a connection count
+   of zero runs the classic interactive single handshake */
+static unsigned g_nConnections = 0;
+static unsigned g_nThreads = 0;
+
+/* Benchmark mode repeats handshakes for a fixed count or number of seconds */
+static unsigned g_bBenchmark = 0;
+static unsigned g_nBenchHandshakes = 0;
+static unsigned g_nBenchSeconds = 0;
+
+/* Output can be handed to a background thread so that console I/O doesn't
+   throttle the handshakes */
+static unsigned g_bAsyncOutput = 0;
+static eOUT_POLICY g_eOutPolicy = OUT_POLICY_BLOCK;
+
+/* Binary trace of the calls into the TNCC and TNCS, and corpus of the IMC
+   messages, if requested, and a trace or corpus to replay against the IMVs
+   instead of running any IMC */
+static char *g_pszTracePath = NULL;
+static char *g_pszCorpusPath = NULL;
+static char *g_pszReplayPath = NULL;
+static unsigned g_bReplayPaced = 0;
+
+static void WaitForEnter(void)
+{
+    outflush();
+    if( 0 == g_nConnections && ! g_bBenchmark && NULL == g_pszReplayPath )
+        getchar();
+}
 
 
 int main(int argc, char * argv[])
 {
-    extern char *g_pszConnStates[];
-    unsigned state, result;
+    unsigned result;
+    DRIVER_OPTIONS options;
+    BENCH_STATS stats;
+    BENCH_TIME tStart;
+    unsigned i;
 
 
 #ifdef WIN32
@@ -81,20 +131,48 @@ int main(int argc, char * argv[])
 
     outfmt( OUT_LEVEL_NORMAL, "TNC SDK IMC/IMV Tester v1.3 r1 \n\n");
     ParseCommandLine( argc, argv );
+    QueueInitialize();
+
+    if( g_bAsyncOutput )
+        outstart( g_eOutPolicy );
+
+    if( NULL != g_pszTracePath && 0 != TraceStart( g_pszTracePath ) )
+        outfmt( OUT_LEVEL_SUMMARY, "Cannot create trace file %s; tracing is off\n", g_pszTracePath );
+
+    if( NULL != g_pszCorpusPath && 0 != CorpusStart( g_pszCorpusPath ) )
+        outfmt( OUT_LEVEL_SUMMARY, "Cannot write corpus %s; no messages will be added to it\n", g_pszCorpusPath );
+
+    /* Tracing every call would measure nothing but the console */
+    if( g_bBenchmark && OUT_LEVEL_NORMAL == g_nVerbose )
+        g_nVerbose = OUT_LEVEL_SUMMARY;
+
+    if( 0 == g_nImcPaths && NULL == g_pszReplayPath )
+        g_pszImcPaths[ g_nImcPaths++ ] = g_pszImcPathName;
+
+    if( 0 == g_nImvPaths )
+        g_pszImvPaths[ g_nImvPaths++ ] = g_pszImvPathName;
+
     do
     {
-        result = LoadIMC( g_pszImcPathName );
+        result = TNC_RESULT_SUCCESS;
+        for( i = 0; i < g_nImcPaths && TNC_RESULT_SUCCESS == result; ++i )
+            result = LoadIMC( g_pszImcPaths[ i ] );
+
         if (result != TNC_RESULT_SUCCESS) 
             break;
 
-        result = LoadIMV( g_pszImvPathName );
+        for( i = 0; i < g_nImvPaths && TNC_RESULT_SUCCESS == result; ++i )
+            result = LoadIMV( g_pszImvPaths[ i ] );
+
         if (result != TNC_RESULT_SUCCESS) 
             break;
 
         outfmt( OUT_LEVEL_NORMAL, "IMC and IMV DLLs loaded successfully. Press Enter to continue\n\n" );
-        getchar();
+        WaitForEnter();
 
-        result = InitializeIMC();
+        tStart = BenchClock();
+        if( NULL == g_pszReplayPath )
+            result = InitializeIMC();
         if (result != TNC_RESULT_SUCCESS) 
             break;
 
@@ -102,59 +180,56 @@ int main(int argc, char * argv[])
         if (result != TNC_RESULT_SUCCESS) 
             break;
 
-        outfmt( OUT_LEVEL_NORMAL, "Establishing new connection (CID: %d)\n", g_nCID );
-        NotifyImcConnectionState( g_nCID, TNC_CONNECTION_STATE_CREATE );
-        NotifyImvConnectionState( g_nCID, TNC_CONNECTION_STATE_CREATE );
-
-        outfmt( OUT_LEVEL_NORMAL, "Beginning new handshake on connection %d\n", g_nCID );
-        NotifyImcConnectionState( g_nCID, TNC_CONNECTION_STATE_HANDSHAKE );
-        NotifyImvConnectionState( g_nCID, TNC_CONNECTION_STATE_HANDSHAKE );
-
-        QueueClearMessages();
-        ImcBeginHandshake( g_nCID );
-        ImcBatchEnding( g_nCID );
-
-        while( 0 == IsQueueEmpty() )
+        if( NULL != g_pszReplayPath )
         {
-            QueueSaveState();
-            outfmt( OUT_LEVEL_NORMAL, "Deliver queued messages to IMVs\n" );
-            DeliverImvMessages( g_nCID );
-            ImvBatchEnding( g_nCID );
-
-            if( IsQueueEmpty() )
-                break;
-
-            QueueSaveState();
-            outfmt( OUT_LEVEL_NORMAL, "Deliver queued messages to IMCs\n" );
-            DeliverImcMessages( g_nCID );
-            ImcBatchEnding( g_nCID );
+            RunReplay( g_pszReplayPath, g_bReplayPaced );
         }
+        else if( g_bBenchmark )
+        {
+            BenchInit( &stats );
+            BenchRecord( &stats, BENCH_PHASE_INITIALIZE, BenchClock() - tStart );
+
+            /* Same concurrency as -conn, with one connection per worker
+               unless told otherwise */
+            options.nThreads = 0 != g_nThreads ? g_nThreads : ThreadGetProcessorCount();
+            options.nConnections = 0 != g_nConnections ? g_nConnections : options.nThreads;
+            options.nHandshakes = g_nBenchHandshakes;
+            options.nSeconds = g_nBenchSeconds;
+            RunConcurrentHandshakes( &options, &stats );
+        }
+        else if( 0 != g_nConnections )
+        {
+            options.nConnections = g_nConnections;
+            options.nThreads = 0 != g_nThreads ? g_nThreads : ThreadGetProcessorCount();
+            options.nHandshakes = g_nConnections;
+            options.nSeconds = 0;
+            RunConcurrentHandshakes( &options, NULL );
+        }
+        else
+        {
+            RunHandshake( g_nCID );
 
-        QueueClearMessages();
-        outfmt( OUT_LEVEL_NORMAL, "No more messages to deliver. Get results from IMVs\n" );
-
-        // 5. IMV solicit recommendations
-        state = ImvGetRecommendation( g_nCID, &result );
-
-        NotifyImcConnectionState( g_nCID, state );
-        NotifyImvConnectionState( g_nCID, state );
+            outfmt( OUT_LEVEL_NORMAL, "Handshake complete. Press Enter to unload IMC and IMV modules.\n" );
+            WaitForEnter();
+        }
 
-        outfmt( OUT_LEVEL_NORMAL, "Handshake on connection %d completed with result `%s'\n", g_nCID, g_pszConnStates[ state ] );
+        if( NULL == g_pszReplayPath )
+            TerminateIMC();
+        TerminateIMV();
 
-        outfmt( OUT_LEVEL_NORMAL, "Deleting connection (CID: %d)\n", g_nCID );
-        NotifyImcConnectionState( g_nCID, TNC_CONNECTION_STATE_DELETE );
-        NotifyImvConnectionState( g_nCID, TNC_CONNECTION_STATE_DELETE );
+    }while( 0 );
 
-        outfmt( OUT_LEVEL_NORMAL, "Handshake complete. Press Enter to unload IMC and IMV modules.\n" );
-        getchar();
+    QueueTerminate();
 
-        TerminateIMC();
-        TerminateIMV();
+    if( 0 != TraceStop() )
+        outfmt( OUT_LEVEL_SUMMARY, "Trace file %s is incomplete\n", g_pszTracePath );
 
-    }while( 0 );
+    if( 0 != CorpusStop() )
+        outfmt( OUT_LEVEL_SUMMARY, "Corpus %s is incomplete\n", g_pszCorpusPath );
 
     outfmt( OUT_LEVEL_NORMAL, "Test complete. Press Enter to exit.\n");
-    getchar();
+    WaitForEnter();
+    outstop();
 
 #ifdef WIN32
     CoUninitialize();
@@ -165,13 +240,33 @@ int main(int argc, char * argv[])
 
 int PrintUsage(void)
 {
-    outfmt( OUT_LEVEL_NORMAL, 
-        "ImcImvTester [-?] [-imc path] [-imv path] [-v] [-b] [-u username] [-p policy] [-l language]\n"
+    outfmt( OUT_LEVEL_SUMMARY, 
+        "ImcImvTester [-?] [-imc path] [-imv path] [-v] [-q] [-b] [-conn count] [-threads count] [-bench count] [-time seconds] [-lazy] [-global] [-async] [-drop] [-trace file] [-corpus file] [-replay file] [-paced] [-combine policy] [-parallel] [-roundtrips count] [-pipeline] [-u username] [-p policy] [-l language]\n"
         "   -?\t\tPrint this message.\n"
-        "   -imc path\tPath to the IMC DLL. (Default \"%s\")\n"
-        "   -imv path\tPath to the IMV DLL. (Default \"%s\")\n"
+        "   -imc path\tPath to an IMC DLL; repeat to load several. (Default \"%s\")\n"
+        "   -imv path\tPath to an IMV DLL; repeat to load several. (Default \"%s\")\n"
         "   -v\t\tVerbose output\n"
+        "   -q\t\tQuiet output; only print summaries\n"
         "   -b\t\tPrint IMC/IMV messages in binary format (default: ASCII)\n"
+        "   -conn count\tRun count simultaneous handshakes without prompting\n"
+        "   -threads count\tWorker threads for -conn and -bench (Default: one per processor)\n"
+        "   -bench count\tBenchmark count handshakes and report throughput and latency\n"
+        "\t\t(Default: one connection per worker thread)\n"
+        "   -time seconds\tBenchmark for a number of seconds instead of a count\n"
+        "   -lazy\t\tBind IMC/IMV symbols lazily (UNIX only; default: immediately)\n"
+        "   -global\tMake IMC/IMV symbols globally visible (UNIX only; default: local)\n"
+        "   -async\tWrite output from a background thread\n"
+        "   -drop\t\tLike -async, but drop output rather than wait when it backs up\n"
+        "   -trace file\tRecord every call into the TNCC and TNCS to a binary trace file\n"
+        "   -corpus file\tAppend every message the IMCs send to a corpus file\n"
+        "   -replay file\tReplay the IMC messages of a trace or corpus against the IMVs; no IMC is loaded\n"
+        "   -paced\tReplay at the pace the trace was recorded at (default: as fast as possible)\n"
+        "   -combine policy\tHow the IMVs' recommendations are combined: deny, majority or allow\n"
+        "\t\t(Default: deny; the most restrictive wins)\n"
+        "   -parallel\tDeliver each batch to the IMVs concurrently; the IMVs must be thread safe\n"
+        "   -roundtrips count\tEnd a handshake after count round trips (Default: no limit)\n"
+        "   -pipeline\tDeliver replies to a batch while it is still being delivered\n"
+        "   -l language\tPreferred language the TNCS reports to the IMVs, e.g. \"en, fr\"\n"
         "\n", g_pszImcPathName, g_pszImvPathName
         );
     exit( 0 );
@@ -181,9 +276,21 @@ int PrintUsage(void)
 #define strcmpi strcasecmp
 #endif
 
+/* The command line is parsed from the last argument to the first, so each
+   module path is put in front of the ones already seen */
+static void AddModulePath( char **paths, unsigned *count, unsigned max, char *path )
+{
+    if( NULL == path || *count >= max )
+        PrintUsage();
+
+    memmove( paths + 1, paths, *count * sizeof( *paths ) );
+    paths[ 0 ] = path;
+    ++*count;
+}
+
 int ParseCommandLine(int argc, char * argv[])
 {
-    static char *pOpts[] = {"?", "imc", "imv", "v", "b"};
+    static char *pOpts[] = {"?", "imc", "imv", "v", "b", "q", "conn", "threads", "bench", "time", "lazy", "global", "async", "drop", "trace", "replay", "paced", "corpus", "combine", "parallel", "roundtrips", "pipeline", "l"};
     char *p;
     unsigned i;
     const unsigned n = sizeof( pOpts ) / sizeof( char* );
@@ -202,27 +309,136 @@ int ParseCommandLine(int argc, char * argv[])
                 PrintUsage();
 
             case 1:
-                if( argv[ argc + 1 ] )
-                    strncpy( g_pszImcPathName, argv[ argc + 1 ], _MAX_PATH - 1 ); 
+                AddModulePath( g_pszImcPaths, &g_nImcPaths, TNCC_MAX_IMCS, argv[ argc + 1 ] );
+                break;
+
+            case 2:
+                AddModulePath( g_pszImvPaths, &g_nImvPaths, TNCS_MAX_IMVS, argv[ argc + 1 ] );
+                break;
+
+            case 3:
+                g_nVerbose = OUT_LEVEL_VERBOSE;
+                break;
+
+            case 4:
+                g_nAsciiOutput = 0;
+                break;
+
+            case 5:
+                g_nVerbose = OUT_LEVEL_SUMMARY;
+                break;
+
+            case 6:
+                if( argv[ argc + 1 ] && 0 != atoi( argv[ argc + 1 ] ) )
+                    g_nConnections = atoi( argv[ argc + 1 ] );
                 else
                     PrintUsage();
 
                 break;
 
-            case 2:
-                if( argv[ argc + 1 ] )
-                    strncpy( g_pszImvPathName, argv[ argc + 1 ], _MAX_PATH - 1 ); 
+            case 7:
+                if( argv[ argc + 1 ] && 0 != atoi( argv[ argc + 1 ] ) )
+                    g_nThreads = atoi( argv[ argc + 1 ] );
                 else
                     PrintUsage();
 
                 break;
 
-            case 3:
-                g_nVerbose = 1;
+            case 8:
+                if( argv[ argc + 1 ] && 0 != atoi( argv[ argc + 1 ] ) )
+                    g_nBenchHandshakes = atoi( argv[ argc + 1 ] );
+                else
+                    PrintUsage();
+
+                g_bBenchmark = 1;
                 break;
 
-            case 4:
-                g_nAsciiOutput = 0;
+            case 9:
+                if( argv[ argc + 1 ] && 0 != atoi( argv[ argc + 1 ] ) )
+                    g_nBenchSeconds = atoi( argv[ argc + 1 ] );
+                else
+                    PrintUsage();
+
+                g_bBenchmark = 1;
+                break;
+
+            case 10:
+                g_nLoadFlags |= LOAD_FLAG_LAZY;
+                break;
+
+            case 11:
+                g_nLoadFlags |= LOAD_FLAG_GLOBAL;
+                break;
+
+            case 12:
+                g_bAsyncOutput = 1;
+                break;
+
+            case 13:
+                g_bAsyncOutput = 1;
+                g_eOutPolicy = OUT_POLICY_DROP;
+                break;
+
+            case 14:
+                if( NULL == argv[ argc + 1 ] )
+                    PrintUsage();
+
+                g_pszTracePath = argv[ argc + 1 ];
+                break;
+
+            case 15:
+                if( NULL == argv[ argc + 1 ] )
+                    PrintUsage();
+
+                g_pszReplayPath = argv[ argc + 1 ];
+                break;
+
+            case 16:
+                g_bReplayPaced = 1;
+                break;
+
+            case 17:
+                if( NULL == argv[ argc + 1 ] )
+                    PrintUsage();
+
+                g_pszCorpusPath = argv[ argc + 1 ];
+                break;
+
+            case 18:
+                if( NULL == argv[ argc + 1 ] )
+                    PrintUsage();
+
+                if( ! strcmpi( argv[ argc + 1 ], "deny" ) )
+                    ImvSetRecommendationPolicy( RECOMMENDATION_POLICY_DENY_WINS );
+                else if( ! strcmpi( argv[ argc + 1 ], "majority" ) )
+                    ImvSetRecommendationPolicy( RECOMMENDATION_POLICY_MAJORITY );
+                else if( ! strcmpi( argv[ argc + 1 ], "allow" ) )
+                    ImvSetRecommendationPolicy( RECOMMENDATION_POLICY_FIRST_ALLOW );
+                else
+                    PrintUsage();
+                break;
+
+            case 19:
+                ImvSetParallelDelivery( 1 );
+                break;
+
+            case 20:
+                if( argv[ argc + 1 ] && 0 != atoi( argv[ argc + 1 ] ) )
+                    g_nMaxRoundTrips = atoi( argv[ argc + 1 ] );
+                else
+                    PrintUsage();
+
+                break;
+
+            case 21:
+                g_bPipeline = 1;
+                break;
+
+            case 22:
+                if( NULL == argv[ argc + 1 ] )
+                    PrintUsage();
+
+                ImvSetPreferredLanguage( argv[ argc + 1 ] );
                 break;
             }
         }
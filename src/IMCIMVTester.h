@@ -43,6 +43,20 @@ extern unsigned g_nAsciiOutput;
 extern unsigned g_nVerbose;
 extern TNC_ConnectionID g_nCID;
 
+/* Handshakes are cut off after g_nMaxRoundTrips batches have been delivered
+   to the IMVs, unless it is zero. g_bPipeline delivers the replies to a batch
+   while the batch is still being delivered and ended. */
+extern unsigned g_nMaxRoundTrips;
+extern unsigned g_bPipeline;
+
+/* How the platform loaders open IMC and IMV modules. These only apply to
+   the UNIX/Linux loader; by default symbols are bound immediately and kept
+   local to each module. */
+#define LOAD_FLAG_LAZY      0x01
+#define LOAD_FLAG_GLOBAL    0x02
+
+extern unsigned g_nLoadFlags;
+
 #ifdef __cplusplus
 }
 #endif
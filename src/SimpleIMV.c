@@ -37,14 +37,102 @@
 #include <string.h>
 #include "tncifimv.h"
 
+#ifdef WIN32
+#include <windows.h>
+#endif
+
 /* This message type is for experimental purposes only. You MUST change
  * this message type for production use. Use your own vendor ID.
  */
 #define TCG_EXPERIMENTAL_MESSAGE_TYPE ((TNC_VENDORID_TCG_NEW<<8) | 254)
 
 static TNC_TNCS_ProvideRecommendationPointer provideRec = NULL;
-static TNC_IMV_Action_Recommendation lastRecommendation = TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION;
-static TNC_IMV_Evaluation_Result lastEvaluation = TNC_IMV_EVALUATION_RESULT_DONT_KNOW;
+
+/* The TNCS may run many handshakes at once, each on its own thread, so the
+ * result of each connection is kept in a table indexed by connection ID.
+ * The table is open addressed with linear probing, so a lookup usually reads
+ * a single slot, and it takes no locks: each slot has a state word that is
+ * changed with compare-and-swap, and a slot is only written by the thread
+ * that claimed it. Deleted slots are marked and reused by later
+ * connections. The table has a fixed size; if it fills up, connections
+ * that don't fit just get no recommendation when one is solicited.
+ */
+#define CONN_TABLE_BITS     14
+#define CONN_TABLE_SIZE     (1 << CONN_TABLE_BITS)
+
+#define SLOT_EMPTY      0
+#define SLOT_BUSY       1       /* Being filled in */
+#define SLOT_LIVE       2
+#define SLOT_DELETED    3
+
+#ifdef WIN32
+#define ATOMIC_CAS(p, x, c)     InterlockedCompareExchange( (p), (x), (c) )
+#define ATOMIC_GET(p)           InterlockedExchangeAdd( (p), 0 )
+#define ATOMIC_SET(p, x)        InterlockedExchange( (p), (x) )
+#else
+#define ATOMIC_CAS(p, x, c)     __sync_val_compare_and_swap( (p), (c), (x) )
+#define ATOMIC_GET(p)           __sync_fetch_and_add( (p), 0 )
+#define ATOMIC_SET(p, x)        ((void) __sync_lock_test_and_set( (p), (x) ))
+#endif
+
+/* The recommendation and evaluation are packed into one word so that they
+ * are always read and written together */
+#define PACK_RESULT(rec, eval)  ((long) ((rec) << 8 | (eval)))
+#define RESULT_REC(x)           ((TNC_IMV_Action_Recommendation) ((x) >> 8))
+#define RESULT_EVAL(x)          ((TNC_IMV_Evaluation_Result) ((x) & 0xff))
+
+typedef struct CONN_SLOT_tag {
+    volatile long state;
+    volatile long cid;
+    volatile long result;
+} CONN_SLOT;
+
+static CONN_SLOT connTable[ CONN_TABLE_SIZE ];
+
+static unsigned long HashConnection(TNC_ConnectionID connectionID) {
+    /* Fibonacci hashing spreads consecutive IDs across the table */
+    return ((connectionID * 2654435761UL) & 0xffffffffUL) >> (32 - CONN_TABLE_BITS);
+}
+
+/* Find the slot of a connection. If it has none and bCreate is set, claim
+ * an empty or deleted slot for it. Returns NULL if it isn't found or the
+ * table is full. */
+static CONN_SLOT *FindConnection(TNC_ConnectionID connectionID, int bCreate) {
+    unsigned long i = HashConnection(connectionID);
+    unsigned long n;
+    CONN_SLOT *slot;
+    long state;
+
+    for (n = 0; n < CONN_TABLE_SIZE; ++n, i = (i + 1) & (CONN_TABLE_SIZE - 1)) {
+        slot = &connTable[i];
+        state = ATOMIC_GET(&slot->state);
+        if (state == SLOT_LIVE && (TNC_ConnectionID) ATOMIC_GET(&slot->cid) == connectionID)
+            return slot;
+        if (state == SLOT_EMPTY)
+            break;
+    }
+
+    if (!bCreate)
+        return NULL;
+
+    /* A connection is only created by the thread running its handshake, so
+     * nobody else can be adding the same one */
+    i = HashConnection(connectionID);
+    for (n = 0; n < CONN_TABLE_SIZE; ++n, i = (i + 1) & (CONN_TABLE_SIZE - 1)) {
+        slot = &connTable[i];
+        state = ATOMIC_GET(&slot->state);
+        if ((state == SLOT_EMPTY || state == SLOT_DELETED) &&
+            ATOMIC_CAS(&slot->state, SLOT_BUSY, state) == state) {
+            ATOMIC_SET(&slot->cid, (long) connectionID);
+            ATOMIC_SET(&slot->result, PACK_RESULT(TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION,
+                TNC_IMV_EVALUATION_RESULT_DONT_KNOW));
+            ATOMIC_SET(&slot->state, SLOT_LIVE);
+            return slot;
+        }
+    }
+
+    return NULL;
+}
 
 
 TNC_IMV_API TNC_Result TNC_IMV_Initialize(
@@ -82,6 +170,38 @@ TNC_IMV_API TNC_Result TNC_IMV_ProvideBindFunction(
     return TNC_RESULT_SUCCESS;
 }
 
+TNC_IMV_API TNC_Result TNC_IMV_NotifyConnectionChange(
+/*in*/  TNC_IMVID imvID,
+/*in*/  TNC_ConnectionID connectionID,
+/*in*/  TNC_ConnectionState newState) {
+
+    CONN_SLOT *slot;
+
+    (void) imvID;
+
+    switch (newState) {
+    case TNC_CONNECTION_STATE_CREATE:
+        FindConnection(connectionID, 1);
+        break;
+
+    case TNC_CONNECTION_STATE_HANDSHAKE:
+        /* A retried handshake starts from scratch */
+        slot = FindConnection(connectionID, 0);
+        if (slot != NULL)
+            ATOMIC_SET(&slot->result, PACK_RESULT(TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION,
+                TNC_IMV_EVALUATION_RESULT_DONT_KNOW));
+        break;
+
+    case TNC_CONNECTION_STATE_DELETE:
+        slot = FindConnection(connectionID, 0);
+        if (slot != NULL)
+            ATOMIC_SET(&slot->state, SLOT_DELETED);
+        break;
+    }
+
+    return TNC_RESULT_SUCCESS;
+}
+
 TNC_IMV_API TNC_Result TNC_IMV_ReceiveMessage(
 /*in*/  TNC_IMVID imvID,
 /*in*/  TNC_ConnectionID connectionID,
@@ -91,6 +211,7 @@ TNC_IMV_API TNC_Result TNC_IMV_ReceiveMessage(
 
     TNC_IMV_Action_Recommendation recommendation;
     TNC_IMV_Evaluation_Result evaluation;
+    CONN_SLOT *slot;
 
     if (messageType != TCG_EXPERIMENTAL_MESSAGE_TYPE)
         return TNC_RESULT_OTHER;
@@ -109,8 +230,10 @@ TNC_IMV_API TNC_Result TNC_IMV_ReceiveMessage(
     else
         evaluation = TNC_IMV_EVALUATION_RESULT_NONCOMPLIANT_MAJOR;
 
-    lastRecommendation = recommendation;
-    lastEvaluation = evaluation;
+    /* A TNCS that didn't announce the connection gets a slot made for it */
+    slot = FindConnection(connectionID, 1);
+    if (slot != NULL)
+        ATOMIC_SET(&slot->result, PACK_RESULT(recommendation, evaluation));
 
     if (provideRec == NULL)
         return TNC_RESULT_OTHER;
@@ -122,13 +245,16 @@ TNC_IMV_API TNC_Result TNC_IMV_SolicitRecommendation(
 /*in*/  TNC_IMVID imvID,
 /*in*/  TNC_ConnectionID connectionID) {
 
-    /* This approach to implementing TNC_IMV_SolicitRecommendation won't work
-     * if there can be more than one simultaneous handshake. To handle that case,
-     * you could implement a thread-safe table indexed by connectionID.
-     */
+    CONN_SLOT *slot;
+    long result = PACK_RESULT(TNC_IMV_ACTION_RECOMMENDATION_NO_RECOMMENDATION,
+        TNC_IMV_EVALUATION_RESULT_DONT_KNOW);
 
     if (provideRec == NULL)
         return TNC_RESULT_OTHER;
 
-    return provideRec(imvID, connectionID, lastRecommendation, lastEvaluation);
+    slot = FindConnection(connectionID, 0);
+    if (slot != NULL)
+        result = ATOMIC_GET(&slot->result);
+
+    return provideRec(imvID, connectionID, RESULT_REC(result), RESULT_EVAL(result));
 }
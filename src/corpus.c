@@ -0,0 +1,373 @@
+/*
+ * corpus.c
+ *
+ * Append-only, mappable corpus of captured IMC messages
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "corpus.h"
+#include "tncthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#endif
+
+/* As with the trace, payloads from all threads go into one buffer under a
+   lock and reach the end of the file in large writes. The block being filled
+   is kept in memory and written over its reserved place in the file when it
+   fills up or the corpus is closed. */
+#define CORPUS_BUFFER_SIZE	(256 * 1024)
+
+static FILE *g_pCorpusFile = NULL;
+static TNC_MUTEX g_CorpusLock;
+static char *g_pCorpusBuffer = NULL;
+static size_t g_nCorpusBuffered = 0;
+static unsigned long long g_nCorpusOffset = 0;		/* Offset of the next byte appended */
+static CORPUS_BLOCK *g_pCorpusBlock = NULL;
+static unsigned long long g_nCorpusBlockOffset = 0;
+static int g_nCorpusError = 0;
+
+static int CorpusSeek(FILE *file, unsigned long long offset)
+{
+#ifdef WIN32
+    return _fseeki64( file, (__int64) offset, SEEK_SET );
+#else
+    return fseeko( file, (off_t) offset, SEEK_SET );
+#endif
+}
+
+static unsigned long long CorpusFileSize(FILE *file)
+{
+#ifdef WIN32
+    _fseeki64( file, 0, SEEK_END );
+    return (unsigned long long) _ftelli64( file );
+#else
+    fseeko( file, 0, SEEK_END );
+    return (unsigned long long) ftello( file );
+#endif
+}
+
+static void CorpusFlush(void)
+{
+    if( 0 != g_nCorpusBuffered && fwrite( g_pCorpusBuffer, 1, g_nCorpusBuffered, g_pCorpusFile ) != g_nCorpusBuffered )
+        g_nCorpusError = errno ? errno : EIO;
+
+    g_nCorpusBuffered = 0;
+}
+
+static void CorpusAppend(const void *p, size_t n)
+{
+    if( g_nCorpusBuffered + n > CORPUS_BUFFER_SIZE )
+        CorpusFlush();
+
+    /* Payloads too big to buffer go straight to the file */
+    if( n > CORPUS_BUFFER_SIZE )
+    {
+        if( fwrite( p, 1, n, g_pCorpusFile ) != n )
+            g_nCorpusError = errno ? errno : EIO;
+    }
+    else
+    {
+        memcpy( g_pCorpusBuffer + g_nCorpusBuffered, p, n );
+        g_nCorpusBuffered += n;
+    }
+
+    g_nCorpusOffset += n;
+}
+
+/* Write the block being filled over its place in the file, and go back to
+   the end for the next payload */
+static void CorpusWriteBlock(void)
+{
+    const size_t size = CORPUS_BLOCK_SIZE( g_pCorpusBlock->capacity );
+
+    CorpusFlush();
+    if( 0 != CorpusSeek( g_pCorpusFile, g_nCorpusBlockOffset ) ||
+        fwrite( g_pCorpusBlock, 1, size, g_pCorpusFile ) != size ||
+        0 != CorpusSeek( g_pCorpusFile, g_nCorpusOffset ) )
+        g_nCorpusError = errno ? errno : EIO;
+}
+
+/* Reserve an empty block at the end of the file and start filling it */
+static void CorpusAppendBlock(void)
+{
+    memset( g_pCorpusBlock, 0, CORPUS_BLOCK_SIZE( CORPUS_BLOCK_ENTRIES ) );
+    g_pCorpusBlock->capacity = CORPUS_BLOCK_ENTRIES;
+    g_nCorpusBlockOffset = g_nCorpusOffset;
+    CorpusAppend( g_pCorpusBlock, CORPUS_BLOCK_SIZE( CORPUS_BLOCK_ENTRIES ) );
+}
+
+/* Find the last block of an existing corpus and read it in to carry on
+   filling it */
+static int CorpusLoad(FILE *file)
+{
+    CORPUS_HEADER header;
+    CORPUS_BLOCK block;
+    unsigned long long size, offset;
+    unsigned capacity;
+
+    size = CorpusFileSize( file );
+    if( 0 != CorpusSeek( file, 0 ) || fread( &header, sizeof( header ), 1, file ) != 1 ||
+        0 != memcmp( header.magic, CORPUS_MAGIC, sizeof( header.magic ) ) ||
+        CORPUS_VERSION != header.version || sizeof( CORPUS_ENTRY ) != header.entrySize )
+        return EINVAL;
+
+    offset = sizeof( header );
+    for( ;; )
+    {
+        if( offset + sizeof( block ) > size || 0 != CorpusSeek( file, offset ) ||
+            fread( &block, sizeof( block ), 1, file ) != 1 || block.count > block.capacity ||
+            offset + CORPUS_BLOCK_SIZE( (unsigned long long) block.capacity ) > size )
+            return EINVAL;
+
+        if( 0 == block.next )
+            break;
+
+        if( block.next <= offset )
+            return EINVAL;
+
+        offset = block.next;
+    }
+
+    capacity = block.capacity > CORPUS_BLOCK_ENTRIES ? block.capacity : CORPUS_BLOCK_ENTRIES;
+    g_pCorpusBlock = (CORPUS_BLOCK *) malloc( CORPUS_BLOCK_SIZE( capacity ) );
+    if( NULL == g_pCorpusBlock )
+        return ENOMEM;
+
+    if( 0 != CorpusSeek( file, offset ) ||
+        fread( g_pCorpusBlock, CORPUS_BLOCK_SIZE( block.capacity ), 1, file ) != 1 ||
+        0 != CorpusSeek( file, size ) )
+    {
+        free( g_pCorpusBlock );
+        g_pCorpusBlock = NULL;
+        return errno ? errno : EIO;
+    }
+
+    g_nCorpusBlockOffset = offset;
+    g_nCorpusOffset = size;
+    return 0;
+}
+
+int CorpusStart(const char *pszPath)
+{
+    static const char zeros[ CORPUS_ALIGN ] = { 0 };
+    CORPUS_HEADER header;
+    int err;
+
+    g_pCorpusBuffer = (char *) malloc( CORPUS_BUFFER_SIZE );
+    if( NULL == g_pCorpusBuffer )
+        return ENOMEM;
+
+    g_nCorpusBuffered = 0;
+    g_nCorpusError = 0;
+
+    g_pCorpusFile = fopen( pszPath, "r+b" );
+    if( NULL != g_pCorpusFile )
+    {
+        err = CorpusLoad( g_pCorpusFile );
+        if( 0 != err )
+            goto fail;
+
+        /* Payloads after the last one indexed were orphaned by a writer that
+           didn't finish; leave them be, but keep new ones aligned */
+        CorpusAppend( zeros, (size_t) (CORPUS_ROUND( g_nCorpusOffset ) - g_nCorpusOffset) );
+    }
+    else
+    {
+        g_pCorpusFile = fopen( pszPath, "w+b" );
+        if( NULL == g_pCorpusFile )
+        {
+            err = errno ? errno : EIO;
+            goto fail;
+        }
+
+        g_pCorpusBlock = (CORPUS_BLOCK *) malloc( CORPUS_BLOCK_SIZE( CORPUS_BLOCK_ENTRIES ) );
+        if( NULL == g_pCorpusBlock )
+        {
+            err = ENOMEM;
+            goto fail;
+        }
+
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, CORPUS_MAGIC, sizeof( header.magic ) );
+        header.version = CORPUS_VERSION;
+        header.entrySize = sizeof( CORPUS_ENTRY );
+        header.createTime = (unsigned long long) time( NULL );
+
+        g_nCorpusOffset = 0;
+        CorpusAppend( &header, sizeof( header ) );
+        CorpusAppendBlock();
+    }
+
+    MutexInit( &g_CorpusLock );
+    return 0;
+
+fail:
+    if( NULL != g_pCorpusFile )
+        fclose( g_pCorpusFile );
+    g_pCorpusFile = NULL;
+    free( g_pCorpusBuffer );
+    g_pCorpusBuffer = NULL;
+    return err;
+}
+
+int CorpusStop(void)
+{
+    if( NULL == g_pCorpusFile )
+        return 0;
+
+    CorpusWriteBlock();
+    if( 0 != fclose( g_pCorpusFile ) && 0 == g_nCorpusError )
+        g_nCorpusError = errno ? errno : EIO;
+
+    g_pCorpusFile = NULL;
+    free( g_pCorpusBuffer );
+    g_pCorpusBuffer = NULL;
+    free( g_pCorpusBlock );
+    g_pCorpusBlock = NULL;
+    MutexDestroy( &g_CorpusLock );
+
+    return g_nCorpusError;
+}
+
+void CorpusMessage(unsigned category, TNC_VendorID vendorID, TNC_MessageSubtype subtype, TNC_UInt32 flags,
+    TNC_UInt32 destinationID, TNC_BufferReference message, TNC_UInt32 length)
+{
+    static const char zeros[ CORPUS_ALIGN ] = { 0 };
+    CORPUS_ENTRY *entry;
+
+    if( NULL == g_pCorpusFile )
+        return;
+
+    if( NULL == message )
+        length = 0;
+
+    MutexLock( &g_CorpusLock );
+
+    if( g_pCorpusBlock->count == g_pCorpusBlock->capacity )
+    {
+        g_pCorpusBlock->next = g_nCorpusOffset;
+        CorpusWriteBlock();
+        CorpusAppendBlock();
+    }
+
+    entry = &g_pCorpusBlock->entries[ g_pCorpusBlock->count++ ];
+    entry->offset = g_nCorpusOffset;
+    entry->length = (unsigned int) length;
+    entry->category = category;
+    entry->vendorID = (unsigned int) vendorID;
+    entry->subtype = (unsigned int) subtype;
+    entry->flags = (unsigned int) flags;
+    entry->destinationID = (unsigned int) destinationID;
+
+    if( 0 != length )
+        CorpusAppend( message, length );
+    CorpusAppend( zeros, (size_t) (CORPUS_ROUND( length ) - length) );
+
+    MutexUnlock( &g_CorpusLock );
+}
+
+int CorpusOpen(const char *pszPath, CORPUS *corpus)
+{
+    const CORPUS_HEADER *header;
+    const CORPUS_BLOCK *block;
+    unsigned long long offset;
+    int err;
+
+    err = MapFile( pszPath, &corpus->file );
+    if( 0 != err )
+        return err;
+
+    header = (const CORPUS_HEADER *) corpus->file.base;
+    if( corpus->file.size < sizeof( *header ) || 0 != memcmp( header->magic, CORPUS_MAGIC, sizeof( header->magic ) ) ||
+        CORPUS_VERSION != header->version || sizeof( CORPUS_ENTRY ) != header->entrySize )
+        goto fail;
+
+    /* Blocks only ever follow the one before them, so the chain can't loop */
+    corpus->nEntries = 0;
+    for( offset = sizeof( *header ); 0 != offset; offset = block->next )
+    {
+        if( 0 != offset % CORPUS_ALIGN || offset + sizeof( *block ) > corpus->file.size )
+            goto fail;
+
+        block = (const CORPUS_BLOCK *) (corpus->file.base + offset);
+        if( block->count > block->capacity || offset + CORPUS_BLOCK_SIZE( (unsigned long long) block->capacity ) > corpus->file.size ||
+            (0 != block->next && block->next <= offset) )
+            goto fail;
+
+        corpus->nEntries += block->count;
+    }
+
+    return 0;
+
+fail:
+    UnmapFile( &corpus->file );
+    return EINVAL;
+}
+
+void CorpusClose(CORPUS *corpus)
+{
+    UnmapFile( &corpus->file );
+}
+
+const CORPUS_ENTRY* CorpusNext(const CORPUS *corpus, CORPUS_CURSOR *cursor)
+{
+    const CORPUS_BLOCK *block = cursor->block;
+    const CORPUS_ENTRY *entry;
+
+    if( NULL == block )
+    {
+        block = (const CORPUS_BLOCK *) (corpus->file.base + sizeof( CORPUS_HEADER ));
+        cursor->index = 0;
+    }
+
+    while( cursor->index >= block->count )
+    {
+        if( 0 == block->next )
+            return NULL;
+
+        block = (const CORPUS_BLOCK *) (corpus->file.base + block->next);
+        cursor->index = 0;
+    }
+
+    entry = &block->entries[ cursor->index ];
+    if( entry->offset > corpus->file.size || entry->length > corpus->file.size - entry->offset )
+        return NULL;
+
+    cursor->block = block;
+    ++cursor->index;
+    return entry;
+}
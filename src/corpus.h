@@ -0,0 +1,138 @@
+/*
+ * corpus.h
+ *
+ * Append-only, mappable corpus of captured IMC messages
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CORPUS_H
+#define _CORPUS_H
+
+#include "tncifimc.h"
+#include "mapfile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A corpus holds the messages IMCs sent, for replaying them against IMVs or
+   feeding them to a fuzzer. Unlike a trace it has no calls, connections or
+   timing; what it does have is an index, so a reader that maps the file can
+   walk it and use each payload in place without parsing anything.
+
+   The file starts with a CORPUS_HEADER. The index is a chain of
+   CORPUS_BLOCKs, each a fixed array of CORPUS_ENTRYs describing payloads
+   that are stored after it; the first block follows the header, and each
+   further one is appended when the one before it fills up. Payloads are
+   padded to a multiple of CORPUS_ALIGN. Nothing once written is moved, and
+   writing to an existing corpus appends to it. A block's entries are only
+   written out when it fills up or the corpus is closed, so a writer that
+   dies loses the messages of its last block. All fields are in host byte
+   order. */
+
+#define CORPUS_MAGIC		"TNCCORPS"
+#define CORPUS_VERSION		1
+#define CORPUS_ALIGN		8
+#define CORPUS_ROUND(x)		(((x) + CORPUS_ALIGN - 1) & ~((unsigned long long) CORPUS_ALIGN - 1))
+#define CORPUS_BLOCK_ENTRIES	4096
+
+typedef struct CORPUS_HEADER_tag
+{
+    char magic[ 8 ];				/* CORPUS_MAGIC, not NUL terminated */
+    unsigned int version;			/* CORPUS_VERSION */
+    unsigned int entrySize;			/* sizeof( CORPUS_ENTRY ) */
+    unsigned long long createTime;	/* Seconds since the epoch when the corpus was created */
+} CORPUS_HEADER;
+
+typedef struct CORPUS_ENTRY_tag
+{
+    unsigned long long offset;		/* File offset of the payload */
+    unsigned int length;			/* Payload bytes */
+    unsigned int category;			/* MESSAGE_CATEGORY_* */
+    unsigned int vendorID;			/* Message type; basic ones are split up */
+    unsigned int subtype;
+    unsigned int flags;				/* Long messages: the message flags */
+    unsigned int destinationID;		/* Long messages: the receiving IMV */
+} CORPUS_ENTRY;
+
+typedef struct CORPUS_BLOCK_tag
+{
+    unsigned long long next;		/* File offset of the next block; 0 for the last */
+    unsigned int capacity;			/* Entries the block has room for */
+    unsigned int count;				/* Entries in use */
+    CORPUS_ENTRY entries[ 1 ];		/* 'capacity' of them */
+} CORPUS_BLOCK;
+
+#define CORPUS_BLOCK_SIZE(capacity)	(sizeof( CORPUS_BLOCK ) + ((capacity) - 1) * sizeof( CORPUS_ENTRY ))
+
+/* Opens a corpus to add messages to, creating it if it doesn't exist.
+   Returns 0 on success, or an errno value; EINVAL if the file exists and
+   isn't a corpus. */
+int CorpusStart(const char *pszPath);
+
+/* Writes out the index and closes the file; returns 0 if all of the corpus
+   made it to disk */
+int CorpusStop(void);
+
+/* Adds a message to the corpus, if one is open; safe to call from any thread */
+void CorpusMessage(unsigned category, TNC_VendorID vendorID, TNC_MessageSubtype subtype, TNC_UInt32 flags,
+    TNC_UInt32 destinationID, TNC_BufferReference message, TNC_UInt32 length);
+
+/* A corpus is read back by mapping it; CorpusNext walks the index from a
+   zeroed cursor and returns NULL at the end, or where the index or a payload
+   lies outside the file. CorpusOpen checks the whole chain of blocks and
+   counts the messages, touching only the index. */
+typedef struct CORPUS_tag
+{
+    MAPPED_FILE file;
+    unsigned long long nEntries;
+} CORPUS;
+
+typedef struct CORPUS_CURSOR_tag
+{
+    const CORPUS_BLOCK *block;
+    unsigned int index;
+} CORPUS_CURSOR;
+
+/* Returns 0 on success, or an errno value; EINVAL if it isn't a corpus */
+int CorpusOpen(const char *pszPath, CORPUS *corpus);
+
+void CorpusClose(CORPUS *corpus);
+
+const CORPUS_ENTRY* CorpusNext(const CORPUS *corpus, CORPUS_CURSOR *cursor);
+
+#define CorpusPayload(corpus, entry)	((TNC_BufferReference) ((corpus)->file.base + (entry)->offset))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * mapfile.c
+ *
+ * Read-only mapping of whole files into memory
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mapfile.h"
+#include <errno.h>
+#include <stddef.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+int MapFile(const char *pszPath, MAPPED_FILE *file)
+{
+#ifdef WIN32
+    HANDLE hFile;
+    LARGE_INTEGER size;
+
+    hFile = CreateFileA( pszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if( INVALID_HANDLE_VALUE == hFile )
+        return ENOENT;
+
+    file->hMapping = NULL;
+    file->base = NULL;
+    if( GetFileSizeEx( hFile, &size ) && 0 != size.QuadPart )
+        file->hMapping = CreateFileMapping( hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+
+    CloseHandle( hFile );
+    if( NULL != file->hMapping )
+        file->base = (unsigned char *) MapViewOfFile( file->hMapping, FILE_MAP_COPY, 0, 0, 0 );
+
+    if( NULL == file->base )
+    {
+        if( NULL != file->hMapping )
+            CloseHandle( file->hMapping );
+        return EINVAL;
+    }
+
+    file->size = (unsigned long long) size.QuadPart;
+#else
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open( pszPath, O_RDONLY );
+    if( fd < 0 )
+        return errno;
+
+    if( 0 != fstat( fd, &st ) || 0 == st.st_size )
+    {
+        close( fd );
+        return EINVAL;
+    }
+
+    p = mmap( NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( MAP_FAILED == p )
+        return errno;
+
+    madvise( p, (size_t) st.st_size, MADV_SEQUENTIAL );
+    file->base = (unsigned char *) p;
+    file->size = (unsigned long long) st.st_size;
+#endif
+
+    return 0;
+}
+
+void UnmapFile(MAPPED_FILE *file)
+{
+    if( NULL == file->base )
+        return;
+
+#ifdef WIN32
+    UnmapViewOfFile( file->base );
+    CloseHandle( file->hMapping );
+#else
+    munmap( file->base, (size_t) file->size );
+#endif
+    file->base = NULL;
+}
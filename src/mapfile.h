@@ -0,0 +1,65 @@
+/*
+ * mapfile.h
+ *
+ * Read-only mapping of whole files into memory
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MAPFILE_H
+#define _MAPFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Trace and corpus files are read by mapping them whole and using their
+   records where they lie. The mapping is copy-on-write, so a module that
+   scribbles on a payload it was handed doesn't fault and the file itself is
+   never changed. */
+typedef struct MAPPED_FILE_tag
+{
+    unsigned char *base;
+    unsigned long long size;
+#ifdef WIN32
+    void *hMapping;
+#endif
+} MAPPED_FILE;
+
+/* Returns 0 on success, or an errno value; empty files can't be mapped */
+int MapFile(const char *pszPath, MAPPED_FILE *file);
+
+void UnmapFile(MAPPED_FILE *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,6 +34,8 @@
  */
 
 #include "msgqueue.h"
+#include "tncthread.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -41,10 +43,11 @@
 
 /* Generic structure in the message queue; can refer to either of suitable 
    MESSAGE_* structure */
-typedef struct MESSAGE_NODE_tag
+struct MESSAGE_NODE_tag
 {
     struct MESSAGE_NODE_tag *next;
 	TNC_UInt32	messageCategory;
+	MESSAGE_BUFFER *buffer;		/* Holds the payload unless it is inline */
 	union
 	{
 		MESSAGE_BASIC	basicMessage;
@@ -52,132 +55,727 @@ typedef struct MESSAGE_NODE_tag
 		MESSAGE_LONG	longTypeMessage;
 	};
 
-} MESSAGE_NODE;
+};
 
-/* Pointers to head and tail of the list. Once the client (TNCC/TNCS) is done 
- * inserting the messages into the queue, these messages are ready to be delivered
- * to the other side of the network. At that time, the g_Msg* nodes are copied over
- * to g_Copy* list.
+/* Large payloads are kept out of the arena in reference counted buffers. The
+ * queue node holds one reference and every receiver reads the same bytes, so a
+ * payload is copied at most once on its way through the TNCC/TNCS no matter
+ * how many modules it fans out to; a buffer that is queued again (replayed or
+ * relayed) is not copied at all. A buffer either carries its bytes right
+ * behind the header or wraps memory owned by someone else, which is handed
+ * back through pfnFree when the last reference goes away.
  */
-static MESSAGE_NODE *g_MsgListHead = NULL, *g_MsgListTail = NULL;
-static MESSAGE_NODE *g_CopyListHead = NULL, *g_CopyListTail = NULL;
+struct MESSAGE_BUFFER_tag
+{
+	volatile long refs;
+	TNC_BufferReference data;
+	TNC_UInt32 length;
+	MESSAGE_BUFFER_FREE pfnFree;
+	void *context;
+};
+
+/* Queue nodes and their payloads are carved out of a per-batch arena rather
+ * than malloc'd one at a time. A node header is immediately followed by its
+ * payload bytes, so the delivery loop walks memory that is mostly contiguous.
+ * The whole arena is released in a single reset when the batch is rotated.
+ * Several threads may allocate from an arena at once: space is reserved by
+ * atomically bumping the chunk's fill mark, and whoever overruns a chunk
+ * installs a fresh one with a compare-and-swap. Only the reset has to run
+ * on its own. Most connections only ever queue a few small messages, so an
+ * arena starts with a small chunk and doubles the size of each new one, up
+ * to ARENA_CHUNK_MAX.
+ */
+#define ARENA_ALIGN			16
+#define ARENA_CHUNK_MIN		(1024)
+#define ARENA_CHUNK_MAX		(64 * 1024)
+#define ARENA_ROUND(x)		(((x) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/* Read a pointer that other threads swap in, with a barrier so that whatever
+   it points to is seen fully initialized */
+#define ATOMIC_READ_POINTER(p)	AtomicCompareExchangePointer( (void * volatile *) (p), NULL, NULL )
+
+typedef struct ARENA_CHUNK_tag
+{
+	struct ARENA_CHUNK_tag *next;
+	size_t size;
+	volatile long used;		/* May run past size once the chunk is full */
+} ARENA_CHUNK;
+
+typedef struct MESSAGE_ARENA_tag
+{
+	ARENA_CHUNK * volatile head;	/* Chunk currently being filled */
+	volatile long total;			/* Bytes handed out since the last reset */
+} MESSAGE_ARENA;
+
+/* Per-connection message queue, one for each direction. IMCs and IMVs may send from threads of their
+ * own, so messages being sent are pushed onto the msgList with a
+ * compare-and-swap and no lock; the list is kept newest first. Once the
+ * client (TNCC/TNCS) is done inserting the messages into the queue, these
+ * messages are ready to be delivered to the other side of the network. At that
+ * time, the single consumer detaches the whole msgList with one exchange and
+ * freezes it, oldest first, into the copy* array so that the delivery loop
+ * can count and index them in constant time. Each list owns the arena its nodes
+ * were allocated from.
+ */
+typedef struct MESSAGE_QUEUE_tag
+{
+	struct MESSAGE_QUEUE_tag *next;		/* Hash bucket chain */
+	TNC_ConnectionID cid;
+	unsigned direction;					/* QUEUE_TO_IMV or QUEUE_TO_IMC */
+	MESSAGE_NODE * volatile msgList;
+	QUEUE_WATCH * volatile watch;		/* Told about every message sent */
+	MESSAGE_NODE **copyList;
+	unsigned copyListCount;
+	unsigned bTakenEarly;				/* Part of the batch was taken before it was saved */
+	unsigned copyListCapacity;
+	MESSAGE_ARENA msgArena;
+	MESSAGE_ARENA copyArena;
+} MESSAGE_QUEUE;
+
+/* Queues are kept in a chained hash table keyed by connection ID and
+   direction. So that
+   concurrent connections rarely contend, the table is split into shards that
+   each have their own lock; the top bits of the hash select the shard and the
+   low bits the bucket. A shard's bucket count is a power of two and doubles
+   whenever its load factor reaches one. The queue itself is not locked; any
+   number of threads may add messages to it, but only one thread at a time
+   drives a given connection through its batches. */
+#define QUEUE_TABLE_SHARD_BITS 4
+#define QUEUE_TABLE_SHARDS (1 << QUEUE_TABLE_SHARD_BITS)
+#define QUEUE_TABLE_MIN_BUCKETS 16
+#define QUEUE_HASH(cid, direction) ((unsigned) ((cid) * 2 + (direction)) * 2654435761u)
+#define QUEUE_SHARD(hash) (&g_QueueShards[ (hash) >> (32 - QUEUE_TABLE_SHARD_BITS) ])
+
+typedef struct QUEUE_SHARD_tag
+{
+    TNC_MUTEX lock;
+    MESSAGE_QUEUE **table;
+    unsigned size;
+    unsigned count;
+} QUEUE_SHARD;
+
+static QUEUE_SHARD g_QueueShards[ QUEUE_TABLE_SHARDS ];
+
+static void QueueReleaseQueue(TNC_ConnectionID cid, unsigned direction);
+
+static void* ArenaAlloc(MESSAGE_ARENA *arena, size_t size)
+{
+	ARENA_CHUNK *chunk, *head, *prev;
+	size_t chunkSize;
+	long used;
+
+	size = ARENA_ROUND( size );
+	AtomicAdd( &arena->total, (long) size );
+
+	for( head = (ARENA_CHUNK *) ATOMIC_READ_POINTER( &arena->head ); ; head = prev )
+	{
+		if( NULL != head && size <= head->size )
+		{
+			used = AtomicAdd( &head->used, (long) size );
+			if( (size_t) used <= head->size )
+				return (char *) head + ARENA_ROUND( sizeof( *head ) ) + used - size;
+		}
+
+		/* Oversized payloads get a chunk of their own */
+		chunkSize = NULL == head ? ARENA_CHUNK_MIN : head->size < ARENA_CHUNK_MAX / 2 ? 2 * head->size : ARENA_CHUNK_MAX;
+		if( size > chunkSize )
+			chunkSize = size;
+		chunk = (ARENA_CHUNK *) malloc( ARENA_ROUND( sizeof( *chunk ) ) + chunkSize );
+		if( NULL == chunk )
+		{
+			AtomicAdd( &arena->total, -(long) size );
+			return NULL;
+		}
+
+		chunk->size = chunkSize;
+		chunk->used = (long) size;
+		chunk->next = head;
+		prev = (ARENA_CHUNK *) AtomicCompareExchangePointer( (void * volatile *) &arena->head, chunk, head );
+		if( prev == head )
+			return (char *) chunk + ARENA_ROUND( sizeof( *chunk ) );
+
+		/* Another thread got a new chunk in first; use that one instead */
+		free( chunk );
+	}
+}
+
+static void ArenaFree(MESSAGE_ARENA *arena)
+{
+	ARENA_CHUNK *chunk, *tmp;
+
+	for( chunk = arena->head; NULL != chunk; chunk = tmp )
+	{
+		tmp = chunk->next;
+		free( chunk );
+	}
 
-MESSAGE_NODE* QueueCreateNode(unsigned int messageCategory)
+	arena->head = NULL;
+	arena->total = 0;
+}
+
+static void ArenaReset(MESSAGE_ARENA *arena)
+{
+	size_t total;
+
+	if( NULL == arena->head )
+		return;
+
+	/* A single chunk is simply rewound. If the batch spilled into several
+	   chunks, release them all and coalesce into one chunk just large enough
+	   for a batch of the same size, so steady state is one malloc-free chunk
+	   no larger than the largest batch seen. */
+	if( NULL != arena->head->next )
+	{
+		total = (size_t) arena->total;
+		ArenaFree( arena );
+		if( NULL != ArenaAlloc( arena, total > ARENA_CHUNK_MIN ? total : ARENA_CHUNK_MIN ) )
+			arena->head->used = 0;
+	}
+	else
+	{
+		arena->head->used = 0;
+	}
+
+	arena->total = 0;
+}
+
+MESSAGE_BUFFER* BufferCreate(TNC_BufferReference data, TNC_UInt32 length)
+{
+	MESSAGE_BUFFER *buffer;
+	const size_t headerSize = ARENA_ROUND( sizeof( *buffer ) );
+
+	buffer = (MESSAGE_BUFFER *) malloc( headerSize + length );
+	if( NULL == buffer )
+		return NULL;
+
+	buffer->refs = 1;
+	buffer->data = (TNC_BufferReference) buffer + headerSize;
+	buffer->length = length;
+	buffer->pfnFree = NULL;
+	buffer->context = NULL;
+
+	if( 0 != length )
+		memcpy( buffer->data, data, length );
+
+	return buffer;
+}
+
+MESSAGE_BUFFER* BufferAttach(TNC_BufferReference data, TNC_UInt32 length, MESSAGE_BUFFER_FREE pfnFree, void *context)
+{
+	MESSAGE_BUFFER *buffer;
+
+	buffer = (MESSAGE_BUFFER *) malloc( sizeof( *buffer ) );
+	if( NULL == buffer )
+		return NULL;
+
+	buffer->refs = 1;
+	buffer->data = data;
+	buffer->length = length;
+	buffer->pfnFree = pfnFree;
+	buffer->context = context;
+	return buffer;
+}
+
+void BufferRetain(MESSAGE_BUFFER *buffer)
+{
+	AtomicAdd( &buffer->refs, 1 );
+}
+
+void BufferRelease(MESSAGE_BUFFER *buffer)
+{
+	if( NULL == buffer || 0 != AtomicAdd( &buffer->refs, -1 ) )
+		return;
+
+	if( NULL != buffer->pfnFree )
+		buffer->pfnFree( buffer->context, buffer->data, buffer->length );
+
+	free( buffer );
+}
+
+TNC_BufferReference BufferGetData(MESSAGE_BUFFER *buffer)
+{
+	return buffer->data;
+}
+
+TNC_UInt32 BufferGetLength(MESSAGE_BUFFER *buffer)
+{
+	return buffer->length;
+}
+
+/* Allocate a node together with room for a payload of payloadLength bytes */
+static MESSAGE_NODE* QueueCreateNode(MESSAGE_QUEUE *queue, unsigned int messageCategory, TNC_UInt32 payloadLength, TNC_BufferReference *payload)
 {
     MESSAGE_NODE *msg;
-    msg = (MESSAGE_NODE *) malloc(sizeof(*msg));
+    const size_t nodeSize = ARENA_ROUND( sizeof( *msg ) );
+
+    msg = (MESSAGE_NODE *) ArenaAlloc( &queue->msgArena, nodeSize + payloadLength );
     if( NULL != msg )
 	{
 		memset( msg, 0, sizeof( *msg ) );
 		msg->messageCategory = messageCategory;
+		*payload = 0 != payloadLength ? (TNC_BufferReference) msg + nodeSize : NULL;
 	}
 	return msg;
 }
 
-void QueueInsertNode(MESSAGE_NODE* pNode)
+/* Allocate a node and give it a copy of, or a reference to, the payload at
+   'data'. If 'buffer' is not NULL the payload already lives in it and is
+   shared; otherwise large payloads are copied into a new buffer and small ones
+   in behind the node. */
+static MESSAGE_NODE* QueueCreateMessage(MESSAGE_QUEUE *queue, unsigned int messageCategory, TNC_BufferReference data, TNC_UInt32 length, MESSAGE_BUFFER *buffer, TNC_BufferReference *payload)
 {
-    if( NULL != g_MsgListTail )
+    MESSAGE_NODE *msg;
+
+    if( NULL == buffer && length < QUEUE_SHARED_PAYLOAD_MIN )
     {
-        g_MsgListTail->next = pNode;
-        g_MsgListTail = pNode;
+        msg = QueueCreateNode( queue, messageCategory, length, payload );
+        if( NULL != msg && 0 != length )
+            memcpy( *payload, data, length );
+        return msg;
     }
+
+    if( NULL != buffer )
+        BufferRetain( buffer );
+    else if( NULL != (buffer = BufferCreate( data, length )) )
+        data = buffer->data;
     else
-        g_MsgListHead = g_MsgListTail = pNode;
+        return NULL;
+
+    msg = QueueCreateNode( queue, messageCategory, 0, payload );
+    if( NULL == msg )
+    {
+        BufferRelease( buffer );
+        return NULL;
+    }
+
+    msg->buffer = buffer;
+    *payload = data;
+    return msg;
+}
+
+/* A shared payload has to lie entirely within the buffer it is shared from */
+static unsigned BufferContains(MESSAGE_BUFFER *buffer, TNC_BufferReference data, TNC_UInt32 length)
+{
+    return data >= buffer->data && length <= buffer->length
+        && (size_t) (data - buffer->data) <= buffer->length - length;
+}
+
+static void QueueReleaseBuffers(MESSAGE_NODE *pNode)
+{
+    for( ; NULL != pNode; pNode = pNode->next )
+        BufferRelease( pNode->buffer );
+}
+
+/* Push the chain pFirst..pLast onto the front of the list. Producers only
+   ever push and the consumer takes the whole list at once, so a node's
+   successor can't change under a pending push and there is no ABA */
+static void QueueInsertList(MESSAGE_QUEUE *queue, MESSAGE_NODE *pFirst, MESSAGE_NODE *pLast)
+{
+    MESSAGE_NODE *head, *prev = (MESSAGE_NODE *) ATOMIC_READ_POINTER( &queue->msgList );
+
+    do
+    {
+        head = prev;
+        pLast->next = head;
+        prev = (MESSAGE_NODE *) AtomicCompareExchangePointer( (void * volatile *) &queue->msgList, pFirst, head );
+    }
+    while( prev != head );
+}
+
+static void QueueInsertNode(MESSAGE_QUEUE *queue, MESSAGE_NODE* pNode)
+{
+    QUEUE_WATCH *watch;
+
+    QueueInsertList( queue, pNode, pNode );
+
+    watch = (QUEUE_WATCH *) ATOMIC_READ_POINTER( &queue->watch );
+    if( NULL != watch )
+        watch->pfnNotify( watch->context );
 }
 
-unsigned QueueGetMessageCategory(unsigned index)
+static unsigned QueueTableGrow(QUEUE_SHARD *shard)
 {
-    MESSAGE_NODE *pNode;
+    MESSAGE_QUEUE **table, *queue, *tmp;
+    unsigned size, i, bucket;
+
+    size = shard->size ? shard->size * 2 : QUEUE_TABLE_MIN_BUCKETS;
+    table = (MESSAGE_QUEUE **) calloc( size, sizeof( *table ) );
+    if( NULL == table )
+        return ENOMEM;
+
+    for( i = 0; i < shard->size; ++i )
+    {
+        for( queue = shard->table[ i ]; NULL != queue; queue = tmp )
+        {
+            tmp = queue->next;
+            bucket = QUEUE_HASH( queue->cid, queue->direction ) & (size - 1);
+            queue->next = table[ bucket ];
+            table[ bucket ] = queue;
+        }
+    }
+
+    free( shard->table );
+    shard->table = table;
+    shard->size = size;
+    return 0;
+}
+
+/* Find the queue of a connection; optionally create it if it doesn't exist */
+static MESSAGE_QUEUE* QueueLookup(TNC_ConnectionID cid, unsigned direction, unsigned bCreate)
+{
+    const unsigned hash = QUEUE_HASH( cid, direction );
+    QUEUE_SHARD *shard = QUEUE_SHARD( hash );
+    MESSAGE_QUEUE *queue = NULL;
+    unsigned bucket;
+
+    MutexLock( &shard->lock );
+
+    if( 0 != shard->size )
+    {
+        for( queue = shard->table[ hash & (shard->size - 1) ]; NULL != queue; queue = queue->next )
+            if( queue->cid == cid && queue->direction == direction )
+                break;
+    }
+
+    if( NULL == queue && bCreate
+        && (shard->count < shard->size || 0 == QueueTableGrow( shard )) )
+    {
+        queue = (MESSAGE_QUEUE *) calloc( 1, sizeof( *queue ) );
+        if( NULL != queue )
+        {
+            queue->cid = cid;
+            queue->direction = direction;
+            bucket = hash & (shard->size - 1);
+            queue->next = shard->table[ bucket ];
+            shard->table[ bucket ] = queue;
+            ++shard->count;
+        }
+    }
+
+    MutexUnlock( &shard->lock );
+    return queue;
+}
+
+unsigned QueueInitialize(void)
+{
+    unsigned i;
+
+    for( i = 0; i < QUEUE_TABLE_SHARDS; ++i )
+    {
+        MutexInit( &g_QueueShards[ i ].lock );
+        g_QueueShards[ i ].table = NULL;
+        g_QueueShards[ i ].size = g_QueueShards[ i ].count = 0;
+    }
+
+    return 0;
+}
+
+unsigned QueueTerminate(void)
+{
+    MESSAGE_QUEUE *queue;
+    unsigned i, j;
+
+    for( i = 0; i < QUEUE_TABLE_SHARDS; ++i )
+    {
+        /* Release whatever connections were left behind */
+        for( j = 0; j < g_QueueShards[ i ].size; ++j )
+            while( NULL != (queue = g_QueueShards[ i ].table[ j ]) )
+                QueueReleaseQueue( queue->cid, queue->direction );
+
+        free( g_QueueShards[ i ].table );
+        g_QueueShards[ i ].table = NULL;
+        g_QueueShards[ i ].size = 0;
+        MutexDestroy( &g_QueueShards[ i ].lock );
+    }
+
+    return 0;
+}
+
+static MESSAGE_NODE* QueueGetNode(TNC_ConnectionID cid, unsigned direction, unsigned index)
+{
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
+
+    if( NULL == queue || index >= queue->copyListCount )
+        return NULL;
+
+    return queue->copyList[ index ];
+}
+
+unsigned QueueGetBatch(TNC_ConnectionID cid, unsigned direction, MESSAGE_BATCH *batch)
+{
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
+
+    batch->messages = NULL != queue ? queue->copyList : NULL;
+    batch->count = NULL != queue ? queue->copyListCount : 0;
+    return batch->count;
+}
+
+unsigned BatchGetMessageCategory(const MESSAGE_BATCH *batch, unsigned index)
+{
+	return index < batch->count ? batch->messages[ index ]->messageCategory : MESSAGE_CATEGORY_UNKNOWN;
+}
+
+MESSAGE_BASIC* BatchGetMessage(const MESSAGE_BATCH *batch, unsigned index)
+{
+	return index < batch->count ? &batch->messages[ index ]->basicMessage : NULL;
+}
+
+MESSAGE_SOH* BatchGetMessageSOH(const MESSAGE_BATCH *batch, unsigned index)
+{
+	return index < batch->count ? &batch->messages[ index ]->sohMessage : NULL;
+}
+
+MESSAGE_LONG* BatchGetMessageLong(const MESSAGE_BATCH *batch, unsigned index)
+{
+	return index < batch->count ? &batch->messages[ index ]->longTypeMessage : NULL;
+}
+
+MESSAGE_BUFFER* BatchGetMessageBuffer(const MESSAGE_BATCH *batch, unsigned index)
+{
+	MESSAGE_BUFFER *buffer = index < batch->count ? batch->messages[ index ]->buffer : NULL;
+
+	if( NULL != buffer )
+		BufferRetain( buffer );
+
+	return buffer;
+}
+
+unsigned QueueGetMessageCategory(TNC_ConnectionID cid, unsigned direction, unsigned index)
+{
+    MESSAGE_NODE *pNode = QueueGetNode( cid, direction, index );
 
-    for( pNode = g_CopyListHead; NULL != pNode && 0 != index; pNode = pNode->next, --index );
-    
     if( NULL == pNode )
 		return MESSAGE_CATEGORY_UNKNOWN;
 
 	return pNode->messageCategory;
 }
 
-unsigned IsQueueEmpty(void)
+unsigned IsQueueEmpty(TNC_ConnectionID cid, unsigned direction)
 {
-    return NULL == g_MsgListHead ? 1 : 0;
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
+
+    return NULL == queue || NULL == ATOMIC_READ_POINTER( &queue->msgList ) ? 1 : 0;
+}
+
+unsigned QueueGetMessageCount(TNC_ConnectionID cid, unsigned direction)
+{
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
+
+	return NULL == queue ? 0 : queue->copyListCount;
 }
 
-unsigned QueueGetMessageCount(void)
+static void QueueClearCopyList(MESSAGE_QUEUE *queue)
 {
-	unsigned count = 0;
-	MESSAGE_NODE * pNode = NULL;
-	for (pNode = g_CopyListHead; NULL != pNode; pNode = pNode->next)
-		++count;
-	return count;
+    unsigned i;
+
+    /* Nodes and inline payloads all live in the arena; one reset releases
+       them. The array itself is kept around; batches tend to be of similar
+       size */
+    for( i = 0; i < queue->copyListCount; ++i )
+        BufferRelease( queue->copyList[ i ]->buffer );
+
+    ArenaReset( &queue->copyArena );
+    queue->copyListCount = 0;
 }
 
-unsigned QueueClearMessages(void)
+unsigned QueueClearMessages(TNC_ConnectionID cid, unsigned direction)
 {
-    MESSAGE_NODE *pNode, *tmp;
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
 
-    for( pNode = g_CopyListHead; NULL != pNode; pNode = tmp )
+    if( NULL != queue )
     {
-        tmp = pNode->next;
-		
-		if ( pNode->messageCategory == MESSAGE_CATEGORY_BASIC )
-			free( pNode->basicMessage.message );
-		else if( pNode->messageCategory == MESSAGE_CATEGORY_SOH )
-			free( pNode->sohMessage.sohReportEntry );
-		else if( pNode->messageCategory == MESSAGE_CATEGORY_LONG )
-			free( pNode->longTypeMessage.message );
-
-		free( pNode );
+        QueueClearCopyList( queue );
+        queue->bTakenEarly = 0;
     }
 
-    g_CopyListHead = g_CopyListTail = NULL;
     return 0;
 }
 
-unsigned QueueSaveState(void)
+/* Freeze the messages sent so far into the delivery array. If bRecycle is
+   set, no sender is running and the pending arena is rotated to back the
+   delivery array; otherwise the nodes stay in the pending arena, which is
+   rotated at the next such call. */
+static unsigned QueueTake(MESSAGE_QUEUE *queue, unsigned bRecycle)
 {
-    QueueClearMessages();
+    MESSAGE_NODE *pNode, *pHead, *pTail = NULL, **pList;
+    MESSAGE_ARENA arena;
+    unsigned count = 0, capacity;
+
+    QueueClearCopyList( queue );
 
-    g_CopyListHead = g_MsgListHead;
-    g_CopyListTail = g_MsgListTail;
+    /* Detach everything sent so far; a message sent from here on goes into
+       the next batch */
+    pNode = (MESSAGE_NODE *) AtomicExchangePointer( (void * volatile *) &queue->msgList, NULL );
+    for( pHead = pNode; NULL != pHead; pHead = pHead->next, ++count )
+        pTail = pHead;
+
+    /* Grow the delivery array geometrically if this batch doesn't fit */
+    if( count > queue->copyListCapacity )
+    {
+        for( capacity = queue->copyListCapacity ? queue->copyListCapacity : 16; capacity < count; capacity *= 2 );
+
+        pList = (MESSAGE_NODE **) realloc( queue->copyList, sizeof( *pList ) * capacity );
+        if( NULL == pList )
+        {
+            /* Put the messages back for the next attempt */
+            QueueInsertList( queue, pNode, pTail );
+            return ENOMEM;
+        }
+
+        queue->copyList = pList;
+        queue->copyListCapacity = capacity;
+    }
+
+    /* The list is newest first; fill the array from the back so the batch is
+       delivered in the order it was sent */
+    queue->copyListCount = count;
+    for( ; NULL != pNode; pNode = pNode->next )
+        queue->copyList[ --count ] = pNode;
+
+    if( bRecycle )
+    {
+        arena = queue->copyArena;
+        queue->copyArena = queue->msgArena;
+        queue->msgArena = arena;
+    }
 
-    g_MsgListHead = g_MsgListTail = NULL;
+    return 0;
+}
+
+unsigned QueueSaveState(TNC_ConnectionID cid, unsigned direction)
+{
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
+    unsigned err;
+
+    if( NULL == queue )
+        return 0;
+
+    /* The pending arena now backs the delivery list; recycle the old one.
+       No sender can still be allocating from it: IMCs and IMVs may only send
+       from within a call the TNCC/TNCS makes to them, and that has returned */
+    err = QueueTake( queue, 1 );
+    if( 0 == err )
+    {
+        /* Only a saved batch is a batch boundary; what was taken early is
+           traced as a part of it */
+        TraceBatch( cid, direction, queue->copyListCount, queue->bTakenEarly ? TRACE_FLAG_PIPELINED : 0 );
+        queue->bTakenEarly = 0;
+    }
+
+    return err;
+}
+
+unsigned QueueTakeMessages(TNC_ConnectionID cid, unsigned direction)
+{
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, 0 );
+    unsigned err;
+
+    if( NULL == queue )
+        return 0;
+
+    err = QueueTake( queue, 0 );
+    if( 0 == err && 0 != queue->copyListCount )
+        queue->bTakenEarly = 1;
+
+    return err;
+}
+
+unsigned QueueWatch(TNC_ConnectionID cid, unsigned direction, QUEUE_WATCH *watch)
+{
+    MESSAGE_QUEUE *queue = QueueLookup( cid, direction, NULL != watch );
+
+    if( NULL == queue )
+        return NULL != watch ? ENOMEM : 0;
+
+    AtomicExchangePointer( (void * volatile *) &queue->watch, watch );
+    return 0;
+}
+
+static void QueueReleaseQueue(TNC_ConnectionID cid, unsigned direction)
+{
+    const unsigned hash = QUEUE_HASH( cid, direction );
+    QUEUE_SHARD *shard = QUEUE_SHARD( hash );
+    MESSAGE_QUEUE **ppQueue, *queue = NULL;
+
+    MutexLock( &shard->lock );
+
+    if( 0 != shard->size )
+    {
+        for( ppQueue = &shard->table[ hash & (shard->size - 1) ]; NULL != *ppQueue; ppQueue = &(*ppQueue)->next )
+        {
+            if( (*ppQueue)->cid == cid && (*ppQueue)->direction == direction )
+            {
+                queue = *ppQueue;
+                *ppQueue = queue->next;
+                --shard->count;
+                break;
+            }
+        }
+    }
+
+    MutexUnlock( &shard->lock );
+
+    if( NULL != queue )
+    {
+        QueueClearCopyList( queue );
+        QueueReleaseBuffers( queue->msgList );
+        ArenaFree( &queue->msgArena );
+        ArenaFree( &queue->copyArena );
+        free( queue->copyList );
+        free( queue );
+    }
+}
+
+unsigned QueueRelease(TNC_ConnectionID cid)
+{
+    QueueReleaseQueue( cid, QUEUE_TO_IMV );
+    QueueReleaseQueue( cid, QUEUE_TO_IMC );
     return 0;
 }
 
 /* Functions to add regular messages to the queue */
-unsigned QueueAddMessage(MESSAGE_BASIC * basicMessage)
+static unsigned QueueAddMessageBuffer(TNC_ConnectionID cid, unsigned direction, MESSAGE_BASIC * basicMessage, MESSAGE_BUFFER *buffer)
 {
+    MESSAGE_QUEUE *queue;
     MESSAGE_NODE *node;
+    TNC_BufferReference payload;
 
-	/* Create queue node of the appropriate type */
-	node = QueueCreateNode(MESSAGE_CATEGORY_BASIC);
+	queue = QueueLookup( cid, direction, 1 );
+	if( NULL == queue )
+		return ENOMEM;
+
+	/* Create queue node of the appropriate type; the payload is either
+	   copied once or, if it is shared, referenced */
+	node = QueueCreateMessage(queue, MESSAGE_CATEGORY_BASIC, basicMessage->message, basicMessage->messageLength, buffer, &payload);
     if( NULL == node )
         return ENOMEM;
 
 	/* Copy all the contents of incoming message; safe to do since it's all
 	   basic data types */
 	memcpy(&(node->basicMessage), basicMessage, sizeof(*basicMessage));
+	node->basicMessage.message = payload;
 
-	/* Buffer needs to be deep-copied */
-    if (0 != basicMessage->messageLength) {
-		node->basicMessage.message = (TNC_BufferReference) malloc( basicMessage->messageLength );
-		if (NULL == node->basicMessage.message) {
-            free( node );
-            return ENOMEM;
-        }
-		memcpy( node->basicMessage.message, basicMessage->message, basicMessage->messageLength );
-    }
-
-	QueueInsertNode( node );
+	QueueInsertNode( queue, node );
     return 0;
 }
 
-unsigned QueueGetMessage(unsigned index, MESSAGE_BASIC ** basicMessage)
+unsigned QueueAddMessage(TNC_ConnectionID cid, unsigned direction, MESSAGE_BASIC * basicMessage)
 {
-    MESSAGE_NODE *node;
+	return QueueAddMessageBuffer( cid, direction, basicMessage, NULL );
+}
+
+unsigned QueueAddMessageShared(TNC_ConnectionID cid, unsigned direction, MESSAGE_BASIC * basicMessage, MESSAGE_BUFFER *buffer)
+{
+	if( NULL == buffer || !BufferContains( buffer, basicMessage->message, basicMessage->messageLength ) )
+		return EINVAL;
+
+	return QueueAddMessageBuffer( cid, direction, basicMessage, buffer );
+}
+
+unsigned QueueGetMessage(TNC_ConnectionID cid, unsigned direction, unsigned index, MESSAGE_BASIC ** basicMessage)
+{
+    MESSAGE_NODE *node = QueueGetNode( cid, direction, index );
 
-    for( node = g_CopyListHead; NULL != node && 0 != index; node = node->next, --index );
-    
     if( NULL == node )
         return 0;
 
@@ -186,39 +784,48 @@ unsigned QueueGetMessage(unsigned index, MESSAGE_BASIC ** basicMessage)
 }
 
 /* Functions to add SOH messages to the queue */
-unsigned QueueAddMessageSOH(MESSAGE_SOH * sohMessage)
+static unsigned QueueAddMessageSOHBuffer(TNC_ConnectionID cid, unsigned direction, MESSAGE_SOH * sohMessage, MESSAGE_BUFFER *buffer)
 {
+    MESSAGE_QUEUE *queue;
     MESSAGE_NODE *node;
+    TNC_BufferReference payload;
 
-	/* Create queue node of the appropriate type */
-	node = QueueCreateNode(MESSAGE_CATEGORY_SOH);
+	queue = QueueLookup( cid, direction, 1 );
+	if( NULL == queue )
+		return ENOMEM;
+
+	/* Create queue node of the appropriate type; the payload is either
+	   copied once or, if it is shared, referenced */
+	node = QueueCreateMessage(queue, MESSAGE_CATEGORY_SOH, sohMessage->sohReportEntry, sohMessage->sohRELength, buffer, &payload);
     if( NULL == node )
         return ENOMEM;
 
 	/* Copy all the contents of incoming message; safe to do since it's all
 	   basic data types */
 	memcpy(&(node->sohMessage), sohMessage, sizeof(*sohMessage));
+	node->sohMessage.sohReportEntry = payload;
 
-	/* Buffer needs to be deep-copied */
-	if (0 != sohMessage->sohRELength) {
-		node->sohMessage.sohReportEntry = (TNC_BufferReference) malloc( sohMessage->sohRELength );
-		if (NULL == node->sohMessage.sohReportEntry) {
-            free( node );
-            return ENOMEM;
-        }
-		memcpy( node->sohMessage.sohReportEntry, sohMessage->sohReportEntry, sohMessage->sohRELength );
-    }
-
-	QueueInsertNode( node );
+	QueueInsertNode( queue, node );
     return 0;
 }
 
-unsigned QueueGetMessageSOH(unsigned index, MESSAGE_SOH ** sohMessage)
+unsigned QueueAddMessageSOH(TNC_ConnectionID cid, unsigned direction, MESSAGE_SOH * sohMessage)
 {
-    MESSAGE_NODE *node;
+	return QueueAddMessageSOHBuffer( cid, direction, sohMessage, NULL );
+}
+
+unsigned QueueAddMessageSOHShared(TNC_ConnectionID cid, unsigned direction, MESSAGE_SOH * sohMessage, MESSAGE_BUFFER *buffer)
+{
+	if( NULL == buffer || !BufferContains( buffer, sohMessage->sohReportEntry, sohMessage->sohRELength ) )
+		return EINVAL;
+
+	return QueueAddMessageSOHBuffer( cid, direction, sohMessage, buffer );
+}
+
+unsigned QueueGetMessageSOH(TNC_ConnectionID cid, unsigned direction, unsigned index, MESSAGE_SOH ** sohMessage)
+{
+    MESSAGE_NODE *node = QueueGetNode( cid, direction, index );
 
-    for( node = g_CopyListHead; NULL != node && 0 != index; node = node->next, --index );
-    
     if( NULL == node )
         return 0;
 
@@ -227,42 +834,62 @@ unsigned QueueGetMessageSOH(unsigned index, MESSAGE_SOH ** sohMessage)
 }
 
 /* Functions to add Long messages to the queue */
-unsigned QueueAddMessageLong(MESSAGE_LONG * longTypeMessage)
+static unsigned QueueAddMessageLongBuffer(TNC_ConnectionID cid, unsigned direction, MESSAGE_LONG * longTypeMessage, MESSAGE_BUFFER *buffer)
 {
+    MESSAGE_QUEUE *queue;
     MESSAGE_NODE *node;
+    TNC_BufferReference payload;
+
+	queue = QueueLookup( cid, direction, 1 );
+	if( NULL == queue )
+		return ENOMEM;
 
-	/* Create queue node of the appropriate type */
-	node = QueueCreateNode(MESSAGE_CATEGORY_LONG);
+	/* Create queue node of the appropriate type; the payload is either
+	   copied once or, if it is shared, referenced */
+	node = QueueCreateMessage(queue, MESSAGE_CATEGORY_LONG, longTypeMessage->message, longTypeMessage->messageLength, buffer, &payload);
     if( NULL == node )
         return ENOMEM;
 
 	/* Copy all the contents of incoming message; safe to do since it's all
 	   basic data types */
 	memcpy(&(node->longTypeMessage), longTypeMessage, sizeof(*longTypeMessage));
+	node->longTypeMessage.message = payload;
 
-	/* Buffer needs to be deep-copied */
-    if (0 != longTypeMessage->messageLength) {
-		node->longTypeMessage.message = (TNC_BufferReference) malloc( longTypeMessage->messageLength );
-		if (NULL == node->longTypeMessage.message) {
-            free( node );
-            return ENOMEM;
-        }
-		memcpy( node->longTypeMessage.message, longTypeMessage->message, longTypeMessage->messageLength );
-    }
-
-	QueueInsertNode( node );
+	QueueInsertNode( queue, node );
     return 0;
 }
 
-unsigned QueueGetMessageLong(unsigned index, MESSAGE_LONG ** longTypeMessage)
+unsigned QueueAddMessageLong(TNC_ConnectionID cid, unsigned direction, MESSAGE_LONG * longTypeMessage)
 {
-    MESSAGE_NODE *node;
+	return QueueAddMessageLongBuffer( cid, direction, longTypeMessage, NULL );
+}
+
+unsigned QueueAddMessageLongShared(TNC_ConnectionID cid, unsigned direction, MESSAGE_LONG * longTypeMessage, MESSAGE_BUFFER *buffer)
+{
+	if( NULL == buffer || !BufferContains( buffer, longTypeMessage->message, longTypeMessage->messageLength ) )
+		return EINVAL;
+
+	return QueueAddMessageLongBuffer( cid, direction, longTypeMessage, buffer );
+}
+
+unsigned QueueGetMessageLong(TNC_ConnectionID cid, unsigned direction, unsigned index, MESSAGE_LONG ** longTypeMessage)
+{
+    MESSAGE_NODE *node = QueueGetNode( cid, direction, index );
 
-    for( node = g_CopyListHead; NULL != node && 0 != index; node = node->next, --index );
-    
     if( NULL == node )
         return 0;
 
 	*longTypeMessage = &(node->longTypeMessage);
     return 1;
 }
+
+MESSAGE_BUFFER* QueueGetMessageBuffer(TNC_ConnectionID cid, unsigned direction, unsigned index)
+{
+	MESSAGE_NODE *node = QueueGetNode( cid, direction, index );
+
+	if( NULL == node || NULL == node->buffer )
+		return NULL;
+
+	BufferRetain( node->buffer );
+	return node->buffer;
+}
@@ -58,15 +58,81 @@ extern "C" {
 #define MESSAGE_CATEGORY_SOH 2
 #define MESSAGE_CATEGORY_LONG 3
 
-unsigned IsQueueEmpty(void);
+/* Every connection has a queue of its own in each direction, created on the
+   first message added for it and destroyed by QueueRelease once the
+   connection is deleted. Messages the IMCs send go to QUEUE_TO_IMV, those the
+   IMVs send to QUEUE_TO_IMC, so each side can be delivered to while the other
+   is still sending. QueueInitialize must be called before any other queue
+   function. Messages may be added from several threads at once; the
+   remaining functions are called by the one thread driving the connection. */
+#define QUEUE_TO_IMV 0
+#define QUEUE_TO_IMC 1
 
-unsigned QueueGetMessageCount(void);
+unsigned QueueInitialize(void);
 
-unsigned QueueGetMessageCategory(unsigned index);
+unsigned QueueTerminate(void);
 
-unsigned QueueClearMessages(void);
+unsigned IsQueueEmpty(TNC_ConnectionID cid, unsigned direction);
 
-unsigned QueueSaveState(void);
+unsigned QueueGetMessageCount(TNC_ConnectionID cid, unsigned direction);
+
+unsigned QueueGetMessageCategory(TNC_ConnectionID cid, unsigned direction, unsigned index);
+
+unsigned QueueClearMessages(TNC_ConnectionID cid, unsigned direction);
+
+/* Make the messages sent so far the batch to be delivered. QueueSaveState is
+   called once the senders are done; QueueTakeMessages may be called while
+   they are still sending, and whatever they send afterwards makes up the next
+   batch. */
+unsigned QueueSaveState(TNC_ConnectionID cid, unsigned direction);
+
+unsigned QueueTakeMessages(TNC_ConnectionID cid, unsigned direction);
+
+unsigned QueueRelease(TNC_ConnectionID cid);
+
+/* A thread that wants to hear about messages as they are sent, rather than
+   poll the queue, watches it. From the time QueueWatch returns, whichever
+   thread adds a message to the queue calls pfnNotify once the message is in
+   it, until QueueWatch is called again with a NULL watch. A sender that is
+   just adding a message may still call the old watch after that, so the
+   watch has to stay valid until the senders are done. */
+typedef struct QUEUE_WATCH_tag
+{
+	void (*pfnNotify)(void *context);
+	void *context;
+} QUEUE_WATCH;
+
+unsigned QueueWatch(TNC_ConnectionID cid, unsigned direction, QUEUE_WATCH *watch);
+
+/* Payloads of QUEUE_SHARED_PAYLOAD_MIN bytes or more are held in reference
+   counted buffers instead of being copied into the queue itself, so a large
+   message is shared by all the modules it is delivered to. BufferCreate copies
+   the data into a new buffer; BufferAttach wraps memory owned by the caller
+   (a mapped file, say) and calls pfnFree once the last reference is released.
+   Both return a buffer holding one reference. The QueueAdd*Shared functions
+   below queue a message whose payload lies within an existing buffer by
+   taking a reference to it rather than copying, whatever its size. */
+#define QUEUE_SHARED_PAYLOAD_MIN (4 * 1024)
+
+typedef struct MESSAGE_BUFFER_tag MESSAGE_BUFFER;
+
+typedef void (*MESSAGE_BUFFER_FREE)(void *context, TNC_BufferReference data, TNC_UInt32 length);
+
+MESSAGE_BUFFER* BufferCreate(TNC_BufferReference data, TNC_UInt32 length);
+
+MESSAGE_BUFFER* BufferAttach(TNC_BufferReference data, TNC_UInt32 length, MESSAGE_BUFFER_FREE pfnFree, void *context);
+
+void BufferRetain(MESSAGE_BUFFER *buffer);
+
+void BufferRelease(MESSAGE_BUFFER *buffer);
+
+TNC_BufferReference BufferGetData(MESSAGE_BUFFER *buffer);
+
+TNC_UInt32 BufferGetLength(MESSAGE_BUFFER *buffer);
+
+/* Returns the buffer holding the payload of a delivered message with a new
+   reference, or NULL if the payload is small enough to be stored inline */
+MESSAGE_BUFFER* QueueGetMessageBuffer(TNC_ConnectionID cid, unsigned direction, unsigned index);
 
 /* Used by TNC_TNCC_SendMessage, TNC_IMC_ReceiveMessage, 
 		   TNC_TNCS_SendMessage, TNC_IMV_ReceiveMessage*/
@@ -77,9 +143,11 @@ typedef struct MESSAGE_BASIC_tag
 	TNC_MessageType	messageType;
 } MESSAGE_BASIC;
 
-unsigned QueueAddMessage(MESSAGE_BASIC   *basicMessage);
+unsigned QueueAddMessage(TNC_ConnectionID cid, unsigned direction, MESSAGE_BASIC   *basicMessage);
+
+unsigned QueueAddMessageShared(TNC_ConnectionID cid, unsigned direction, MESSAGE_BASIC *basicMessage, MESSAGE_BUFFER *buffer);
 
-unsigned QueueGetMessage(unsigned index, MESSAGE_BASIC  **basicMessage);
+unsigned QueueGetMessage(TNC_ConnectionID cid, unsigned direction, unsigned index, MESSAGE_BASIC  **basicMessage);
 
 /* Used by TNC_TNCC_SendMessageSOH, TNC_IMC_ReceiveMessageSOH,
 		   TNC_TNCS_SendMessageSOH, TNC_IMV_ReceiveMessageSOH */
@@ -89,9 +157,11 @@ typedef struct MESSAGE_SOH_tag
 	TNC_UInt32 sohRELength;
 } MESSAGE_SOH;
 
-unsigned QueueAddMessageSOH(MESSAGE_SOH  *sohMessage);
+unsigned QueueAddMessageSOH(TNC_ConnectionID cid, unsigned direction, MESSAGE_SOH  *sohMessage);
 
-unsigned QueueGetMessageSOH(unsigned index, MESSAGE_SOH **sohMessage);
+unsigned QueueAddMessageSOHShared(TNC_ConnectionID cid, unsigned direction, MESSAGE_SOH *sohMessage, MESSAGE_BUFFER *buffer);
+
+unsigned QueueGetMessageSOH(TNC_ConnectionID cid, unsigned direction, unsigned index, MESSAGE_SOH **sohMessage);
 
 /* Used by TNC_TNCC_SendMessageLong, TNC_IMC_ReceiveMessageLong,
 		   TNC_TNCS_SendMessageLong, TNC_IMV_ReceiveMessageLong */
@@ -106,9 +176,38 @@ typedef struct MESSAGE_LONG_tag
 	TNC_UInt32 imvID;
 } MESSAGE_LONG;
 
-unsigned QueueAddMessageLong(MESSAGE_LONG  *longTypeMessage);
+unsigned QueueAddMessageLong(TNC_ConnectionID cid, unsigned direction, MESSAGE_LONG  *longTypeMessage);
+
+unsigned QueueAddMessageLongShared(TNC_ConnectionID cid, unsigned direction, MESSAGE_LONG *longTypeMessage, MESSAGE_BUFFER *buffer);
+
+unsigned QueueGetMessageLong(TNC_ConnectionID cid, unsigned direction, unsigned index, MESSAGE_LONG **longTypeMessage);
+
+/* The batch of a queue, as frozen by QueueSaveState or QueueTakeMessages. It
+   stays valid until the next batch is taken or the queue is cleared, so a
+   delivery loop looks the queue up once and then indexes the batch directly
+   rather than going through the Queue*(cid, direction, index) functions
+   above, each of which finds the queue again. */
+typedef struct MESSAGE_NODE_tag MESSAGE_NODE;
+
+typedef struct MESSAGE_BATCH_tag
+{
+	MESSAGE_NODE * const *messages;
+	unsigned count;
+} MESSAGE_BATCH;
+
+/* Returns the number of messages in the batch; an unknown queue has none */
+unsigned QueueGetBatch(TNC_ConnectionID cid, unsigned direction, MESSAGE_BATCH *batch);
+
+unsigned BatchGetMessageCategory(const MESSAGE_BATCH *batch, unsigned index);
+
+MESSAGE_BASIC* BatchGetMessage(const MESSAGE_BATCH *batch, unsigned index);
+
+MESSAGE_SOH* BatchGetMessageSOH(const MESSAGE_BATCH *batch, unsigned index);
+
+MESSAGE_LONG* BatchGetMessageLong(const MESSAGE_BATCH *batch, unsigned index);
 
-unsigned QueueGetMessageLong(unsigned index, MESSAGE_LONG **longTypeMessage);
+/* Like QueueGetMessageBuffer */
+MESSAGE_BUFFER* BatchGetMessageBuffer(const MESSAGE_BATCH *batch, unsigned index);
 
 #ifdef __cplusplus
 }
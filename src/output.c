@@ -34,73 +34,426 @@
  */
 
 #include "output.h"
+#include "tncthread.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 
+/* Hex dumps are rendered sixteen bytes, one SSE2 register, at a time where
+   the compiler targets SSE2; define OUT_NO_SIMD to use the portable code */
+#if !defined(OUT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define OUT_DUMP_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef WIN32
+#define vsnprintf _vsnprintf
+#define OUT_FORMAT_LENGTH(fmt, a) _vscprintf( fmt, a )
+#else
+#define OUT_FORMAT_LENGTH(fmt, a) vsnprintf( NULL, 0, fmt, a )
+#endif
+
 
-extern unsigned g_nVerbose;
 extern unsigned g_nAsciiOutput;
 
+/* Once outstart has been called, output no longer goes straight to stdout.
+ * Producers copy each formatted record into a ring of fixed size slots and a
+ * drain thread writes the ring out in large batches, so console and pipe I/O
+ * stays off the handshake path.
+ *
+ * The ring is a bounded multi-producer queue in the style of D. Vyukov's: each
+ * slot carries a sequence number that says whether it is free for position
+ * 'pos' (seq == pos), filled (seq == pos + 1) or still waiting for the drain
+ * thread from the previous lap. A record longer than a slot takes several
+ * consecutive ones, reserved with a single compare-exchange on the head, so
+ * records from different threads never interleave. Because the drain thread
+ * frees slots strictly in order, the last slot of a reservation being free
+ * means all of them are.
+ */
+#define OUT_SLOT_SIZE		112
+#define OUT_RING_SLOTS		8192		/* Power of two; about 1MB */
+#define OUT_RING_MASK		(OUT_RING_SLOTS - 1)
+#define OUT_RECORD_MAX		(OUT_RING_SLOTS / 2 * OUT_SLOT_SIZE)
+#define OUT_BATCH_SIZE		(64 * 1024)
+#define OUT_DRAIN_IDLE_MS	1
+
+typedef struct OUT_SLOT_tag
+{
+    volatile long seq;
+    unsigned length;
+    char data[ OUT_SLOT_SIZE ];
+} OUT_SLOT;
+
+static OUT_SLOT *g_pRing = NULL;
+static volatile long g_nRingHead = 0;		/* Next position to reserve */
+static volatile long g_nRingWritten = 0;	/* Positions the drain thread has written */
+static volatile long g_nDropped = 0;
+static volatile long g_bStopDrain = 0;
+static eOUT_POLICY g_ePolicy = OUT_POLICY_BLOCK;
+static TNC_THREAD g_hDrainThread;
+
+
+static void OutWrite( const char *p, size_t nSize )
+{
+    fwrite( p, 1, nSize, stdout );
+}
+
+/* Reserve 'n' consecutive slots; returns 0 if the ring is full, the policy
+   is to drop and bMayDrop is set */
+static int OutReserve( unsigned long n, unsigned long *pos, int bMayDrop )
+{
+    unsigned long head;
+    long diff;
+    OUT_SLOT *last;
+
+    for( ;; )
+    {
+        head = (unsigned long) AtomicAdd( &g_nRingHead, 0 );
+        last = &g_pRing[ (head + n - 1) & OUT_RING_MASK ];
+        diff = (long) ((unsigned long) AtomicAdd( &last->seq, 0 ) - (head + n - 1));
+
+        if( 0 == diff )
+        {
+            if( AtomicCompareExchange( &g_nRingHead, (long) (head + n), (long) head ) == (long) head )
+                break;
+        }
+        else if( diff < 0 )
+        {
+            /* Full; the drain thread hasn't caught up with the last lap */
+            if( OUT_POLICY_DROP == g_ePolicy && bMayDrop )
+            {
+                AtomicAdd( &g_nDropped, 1 );
+                return 0;
+            }
+
+            ThreadYield();
+        }
+    }
+
+    *pos = head;
+    return 1;
+}
+
+static void OutEnqueue( const char *p, size_t nSize )
+{
+    unsigned long pos, n, i;
+    size_t nChunk, nCopy;
+    OUT_SLOT *slot;
+    int bMayDrop = 1;
+
+    while( 0 != nSize )
+    {
+        /* Anything bigger than half the ring goes in pieces; only the pieces
+           are kept whole. A record is only ever dropped as a whole: once its
+           first piece is in, the rest wait for room even under -drop. */
+        nChunk = nSize < OUT_RECORD_MAX ? nSize : OUT_RECORD_MAX;
+        n = (unsigned long) ((nChunk + OUT_SLOT_SIZE - 1) / OUT_SLOT_SIZE);
+        if( ! OutReserve( n, &pos, bMayDrop ) )
+            return;
+
+        bMayDrop = 0;
+
+        for( i = 0; i < n; ++i )
+        {
+            slot = &g_pRing[ (pos + i) & OUT_RING_MASK ];
+            nCopy = nChunk < OUT_SLOT_SIZE ? nChunk : OUT_SLOT_SIZE;
+            memcpy( slot->data, p, nCopy );
+            slot->length = (unsigned) nCopy;
+            p += nCopy;
+            nChunk -= nCopy;
+            nSize -= nCopy;
+
+            /* Publish; the atomic add also orders the copy before it */
+            AtomicAdd( &slot->seq, 1 );
+        }
+    }
+}
+
+static void OutDrainThread( void *arg )
+{
+    static char batch[ OUT_BATCH_SIZE ];
+    unsigned long tail = 0, written = 0;
+    size_t nBatch = 0;
+    OUT_SLOT *slot;
+    long nDropped;
+
+    (void) arg;
+
+    for( ;; )
+    {
+        slot = &g_pRing[ tail & OUT_RING_MASK ];
+        if( (unsigned long) AtomicAdd( &slot->seq, 0 ) == tail + 1 )
+        {
+            if( nBatch + slot->length > sizeof( batch ) )
+            {
+                OutWrite( batch, nBatch );
+                nBatch = 0;
+            }
+
+            memcpy( batch + nBatch, slot->data, slot->length );
+            nBatch += slot->length;
+
+            /* Hand the slot to the producers of the next lap */
+            AtomicAdd( &slot->seq, OUT_RING_SLOTS - 1 );
+            ++tail;
+            continue;
+        }
+
+        /* Caught up with the producers; write out what we have */
+        if( 0 != (nDropped = AtomicAdd( &g_nDropped, 0 )) )
+        {
+            AtomicAdd( &g_nDropped, -nDropped );
+            if( nBatch + 64 > sizeof( batch ) )
+            {
+                OutWrite( batch, nBatch );
+                nBatch = 0;
+            }
+
+            nBatch += sprintf( batch + nBatch, "*** %ld output records dropped ***\n", nDropped );
+        }
+
+        if( 0 != nBatch )
+        {
+            OutWrite( batch, nBatch );
+            nBatch = 0;
+            fflush( stdout );
+        }
+
+        AtomicAdd( &g_nRingWritten, (long) (tail - written) );
+        written = tail;
+        if( tail != (unsigned long) AtomicAdd( &g_nRingHead, 0 ) )
+        {
+            /* A producer has reserved slots it hasn't filled yet */
+            ThreadYield();
+            continue;
+        }
+
+        if( AtomicAdd( &g_bStopDrain, 0 ) )
+            break;
+
+        ThreadSleep( OUT_DRAIN_IDLE_MS );
+    }
+}
+
+int outstart( eOUT_POLICY policy )
+{
+    unsigned long i;
+
+    if( NULL != g_pRing )
+        return 0;
+
+    g_pRing = (OUT_SLOT *) malloc( sizeof( *g_pRing ) * OUT_RING_SLOTS );
+    if( NULL == g_pRing )
+        return -1;
+
+    for( i = 0; i < OUT_RING_SLOTS; ++i )
+        g_pRing[ i ].seq = (long) i;
+
+    g_nRingHead = g_nRingWritten = g_nDropped = g_bStopDrain = 0;
+    g_ePolicy = policy;
 
-int outfmt( eOUT_LEVEL level, char *fmt, ... )
+    if( 0 != ThreadCreate( &g_hDrainThread, OutDrainThread, NULL ) )
+    {
+        free( g_pRing );
+        g_pRing = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void outflush( void )
+{
+    long target;
+
+    if( NULL == g_pRing )
+    {
+        fflush( stdout );
+        return;
+    }
+
+    target = AtomicAdd( &g_nRingHead, 0 );
+    while( (long) ((unsigned long) AtomicAdd( &g_nRingWritten, 0 ) - (unsigned long) target) < 0 )
+        ThreadSleep( OUT_DRAIN_IDLE_MS );
+}
+
+void outstop( void )
+{
+    if( NULL == g_pRing )
+        return;
+
+    AtomicAdd( &g_bStopDrain, 1 );
+    ThreadJoin( g_hDrainThread );
+
+    free( g_pRing );
+    g_pRing = NULL;
+}
+
+int (outfmt)( eOUT_LEVEL level, char *fmt, ... )
 {
     va_list a;
     int rc = -1;
+    char sz[ 512 ];
+    char *p = sz;
+    int n;
 
 
-    va_start( a, fmt );
-    if( level <= (int)g_nVerbose )
+    if( (int) level > (int) g_nVerbose )
+        return rc;
+
+    if( NULL == g_pRing )
     {
+        va_start( a, fmt );
         vprintf( fmt, a );
         fflush( stdout );
+        va_end( a );
+        return rc;
     }
 
+    /* Format on the caller's thread; only the copy into the ring is shared */
+    va_start( a, fmt );
+    n = vsnprintf( sz, sizeof( sz ), fmt, a );
     va_end( a );
+
+    if( n < 0 || n >= (int) sizeof( sz ) )
+    {
+        va_start( a, fmt );
+        n = OUT_FORMAT_LENGTH( fmt, a );
+        va_end( a );
+
+        if( n < 0 || NULL == (p = (char *) malloc( n + 1 )) )
+            return rc;
+
+        va_start( a, fmt );
+        vsnprintf( p, n + 1, fmt, a );
+        va_end( a );
+    }
+
+    OutEnqueue( p, n );
+
+    if( p != sz )
+        free( p );
+
     return rc;
 }
 
-int outmessage( eOUT_LEVEL level, unsigned char *p, unsigned nSize )
+/* A hex dump line is "   OOOOOOOO: " followed by sixteen "XX " groups, two
+   spaces, the sixteen bytes as ASCII and a newline. Every line has the same
+   length; the last one is padded with spaces. */
+#define OUT_DUMP_BYTES		16
+#define OUT_DUMP_HEX		13
+#define OUT_DUMP_ASCII		(OUT_DUMP_HEX + 3 * OUT_DUMP_BYTES + 2)
+#define OUT_DUMP_LINE		(OUT_DUMP_ASCII + OUT_DUMP_BYTES + 1)
+
+static const char g_szHex[] = "0123456789ABCDEF";
+
+/* Write a finished record, through the ring if output is asynchronous */
+static void OutEmit( const char *p, size_t nSize )
 {
-    size_t i, n;
-    const size_t nBytes = 16;
-    const size_t nSpace = 2;
+    if( NULL != g_pRing )
+    {
+        OutEnqueue( p, nSize );
+        return;
+    }
 
-    static char szHex[] = "0123456789ABCDEF";
-    int nOffset = 0;
-    char buf[4 * 16/*nBytes*/ + 2/*nSpace*/ + 1];
-    char sz[256];
+    OutWrite( p, nSize );
+    fflush( stdout );
+}
 
+/* Fill in the offset and separators of a line that is already blank */
+static void OutDumpOffset( char *line, unsigned nOffset )
+{
+    int i;
 
-    if( nSize == 0 )
-        return 0;
+    for( i = 7; i >= 0; --i, nOffset >>= 4 )
+        line[ 3 + i ] = g_szHex[ nOffset & 0x0F ];
 
-    if( g_nAsciiOutput )
-        return outfmt( level, "%.*s\n\n", nSize, p );
+    line[ 11 ] = ':';
+    line[ OUT_DUMP_LINE - 1 ] = '\n';
+}
+
+static void OutDumpBytes( char *line, const unsigned char *p, unsigned n )
+{
+    unsigned i;
 
-    while( nSize != 0 )
+    for( i = 0; i < n; ++i )
     {
-        for( i = 0; i < (sizeof(buf) / sizeof(buf[0]) - 1); i++ )
-            buf[i] = ' ';
+        line[ OUT_DUMP_HEX + 3*i ] = g_szHex[ p[i] >> 4 ];
+        line[ OUT_DUMP_HEX + 3*i + 1 ] = g_szHex[ p[i] & 0x0F ];
+        line[ OUT_DUMP_ASCII + i ] = p[i] >= 32 && p[i] < 128 ? p[i] : '.';
+    }
+}
+
+#ifdef OUT_DUMP_SSE2
+/* '0' + x, plus the gap between '9' and 'A' for nibbles above nine */
+static __m128i OutNibblesToHex( __m128i x )
+{
+    const __m128i gap = _mm_and_si128( _mm_cmpgt_epi8( x, _mm_set1_epi8( 9 ) ), _mm_set1_epi8( 'A' - '9' - 1 ) );
 
-        buf[sizeof(buf) - 1] = 0;
+    return _mm_add_epi8( _mm_add_epi8( x, _mm_set1_epi8( '0' ) ), gap );
+}
 
-        n = nSize < nBytes ? nSize : nBytes;
-        for( i = 0; i < n; i++ )
-        {
-            buf[3*i] = szHex[p[i] >> 4];
-            buf[3*i+1] = szHex[p[i] & 0x0F];
-            buf[3*nBytes + nSpace + i] = p[i] >= 32 && p[i] < 128 ? p[i] : '.';
-        }
+/* A full line: both nibbles of all sixteen bytes are converted at once, and
+   a signed compare against 31 picks out the printable bytes (32 to 127, the
+   others being below 32 or negative) */
+static void OutDumpBytes16( char *line, const unsigned char *p )
+{
+    const __m128i nibble = _mm_set1_epi8( 0x0F );
+    const __m128i v = _mm_loadu_si128( (const __m128i *) p );
+    const __m128i hi = OutNibblesToHex( _mm_and_si128( _mm_srli_epi16( v, 4 ), nibble ) );
+    const __m128i lo = OutNibblesToHex( _mm_and_si128( v, nibble ) );
+    const __m128i printable = _mm_cmpgt_epi8( v, _mm_set1_epi8( 31 ) );
+    char hex[ 2 * OUT_DUMP_BYTES ];
+    unsigned i;
+
+    _mm_storeu_si128( (__m128i *) hex, _mm_unpacklo_epi8( hi, lo ) );
+    _mm_storeu_si128( (__m128i *) (hex + 16), _mm_unpackhi_epi8( hi, lo ) );
+    for( i = 0; i < OUT_DUMP_BYTES; ++i )
+        memcpy( line + OUT_DUMP_HEX + 3*i, hex + 2*i, 2 );
+
+    _mm_storeu_si128( (__m128i *) (line + OUT_DUMP_ASCII),
+        _mm_or_si128( _mm_and_si128( printable, v ), _mm_andnot_si128( printable, _mm_set1_epi8( '.' ) ) ) );
+}
+#else
+#define OutDumpBytes16( line, p ) OutDumpBytes( line, p, OUT_DUMP_BYTES )
+#endif
+
+/* The whole dump is rendered into one buffer and written in one go */
+int (outmessage)( eOUT_LEVEL level, unsigned char *p, unsigned nSize )
+{
+    const size_t nLines = (nSize + OUT_DUMP_BYTES - 1) / OUT_DUMP_BYTES;
+    const size_t nOut = nLines * OUT_DUMP_LINE + 2;
+    unsigned nOffset = 0;
+    char *out, *line;
+
+
+    if( nSize == 0 )
+        return 0;
+
+    if( g_nAsciiOutput )
+        return (outfmt)( level, "%.*s\n\n", nSize, p );
 
-        sprintf(sz, "   %08X: %s\n", nOffset, buf);
-        outfmt( level, "%s", sz );
+    out = (char *) malloc( nOut );
+    if( NULL == out )
+        return -1;
 
-        nOffset += n;
-        p += n;
-        nSize -= n;
+    memset( out, ' ', nOut - 2 );
+    for( line = out; nSize - nOffset >= OUT_DUMP_BYTES; line += OUT_DUMP_LINE, nOffset += OUT_DUMP_BYTES )
+    {
+        OutDumpOffset( line, nOffset );
+        OutDumpBytes16( line, p + nOffset );
+    }
+
+    if( nOffset != nSize )
+    {
+        OutDumpOffset( line, nOffset );
+        OutDumpBytes( line, p + nOffset, nSize - nOffset );
     }
 
-    outfmt( level, "\n\n" );
+    out[ nOut - 2 ] = out[ nOut - 1 ] = '\n';
+    OutEmit( out, nOut );
+    free( out );
 
     return 0;
 }
@@ -40,14 +40,51 @@ extern "C"
 
 typedef enum eOUT_LEVEL_tag
 {
+    OUT_LEVEL_SUMMARY,
     OUT_LEVEL_NORMAL,
     OUT_LEVEL_VERBOSE,
 }eOUT_LEVEL;
 
+/* What a producer does when the output ring is full: wait for the drain
+   thread, or discard the record and have the number of lost records noted */
+typedef enum eOUT_POLICY_tag
+{
+    OUT_POLICY_BLOCK,
+    OUT_POLICY_DROP,
+}eOUT_POLICY;
+
+/* Output is written synchronously until outstart hands it to a background
+   thread. outflush waits until everything logged so far has been written;
+   outstop writes out the rest and returns to synchronous output. */
+int outstart( eOUT_POLICY policy );
+
+void outflush( void );
+
+void outstop( void );
+
 int outfmt( eOUT_LEVEL level, char *fmt, ... );
 
 int outmessage( eOUT_LEVEL level, unsigned char *p, unsigned nSize );
 
+extern unsigned g_nVerbose;
+
+/* Levels above OUT_LEVEL_MAX are compiled out altogether. Building with
+   -DOUT_LEVEL_MAX=OUT_LEVEL_NORMAL removes the verbose tracing of every
+   message, and -DOUT_LEVEL_MAX=OUT_LEVEL_SUMMARY all but the summaries. */
+#ifndef OUT_LEVEL_MAX
+#define OUT_LEVEL_MAX OUT_LEVEL_VERBOSE
+#endif
+
+#define OUT_ENABLED( level ) ((level) <= OUT_LEVEL_MAX && (int) (level) <= (int) g_nVerbose)
+
+/* The level is tested before the call, so a disabled outfmt or outmessage
+   evaluates none of its other arguments. Both are statements; call the
+   functions as (outfmt) or (outmessage) to use their results. */
+#define outfmt( level, ... ) \
+    do { if( OUT_ENABLED( level ) ) (outfmt)( level, __VA_ARGS__ ); } while( 0 )
+#define outmessage( level, p, nSize ) \
+    do { if( OUT_ENABLED( level ) ) (outmessage)( level, p, nSize ); } while( 0 )
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,273 @@
+/*
+ * soh.c
+ *
+ * Splitting an SoH into its SoHReportEntries
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "soh.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SOH_GET16(p)	((unsigned) (p)[ 0 ] << 8 | (p)[ 1 ])
+#define SOH_GET32(p)	((TNC_UInt32) (p)[ 0 ] << 24 | (TNC_UInt32) (p)[ 1 ] << 16 | (TNC_UInt32) (p)[ 2 ] << 8 | (p)[ 3 ])
+
+void SohParserInit(SOH_PARSER *parser, TNC_BufferReference soh, TNC_UInt32 length)
+{
+    parser->start = parser->next = soh;
+    parser->end = NULL != soh ? soh + length : NULL;
+}
+
+eSOH_RESULT SohNextEntry(SOH_PARSER *parser, SOH_ENTRY *entry)
+{
+    TNC_BufferReference p = parser->next;
+    const TNC_BufferReference end = parser->end;
+    unsigned length;
+
+    if( p == end )
+        return SOH_RESULT_END;
+
+    /* The entry's System-Health-ID attribute */
+    if( (size_t) (end - p) < SOH_TLV_HEADER_SIZE + 4 || SOH_TYPE_SYSTEM_HEALTH_ID != SOH_GET16( p ) )
+        return SOH_RESULT_MALFORMED;
+
+    length = SOH_GET16( p + 2 );
+    if( length < 4 || (size_t) (end - p) - SOH_TLV_HEADER_SIZE < length )
+        return SOH_RESULT_MALFORMED;
+
+    entry->data = p;
+    entry->systemHealthID = (TNC_MessageType) SOH_GET32( p + SOH_TLV_HEADER_SIZE );
+    p += SOH_TLV_HEADER_SIZE + length;
+
+    /* The rest of its attributes */
+    while( p != end )
+    {
+        if( (size_t) (end - p) < SOH_TLV_HEADER_SIZE )
+        {
+            parser->next = p;
+            return SOH_RESULT_MALFORMED;
+        }
+
+        if( SOH_TYPE_SYSTEM_HEALTH_ID == SOH_GET16( p ) )
+            break;
+
+        length = SOH_GET16( p + 2 );
+        if( (size_t) (end - p) - SOH_TLV_HEADER_SIZE < length )
+        {
+            parser->next = p;
+            return SOH_RESULT_MALFORMED;
+        }
+
+        p += SOH_TLV_HEADER_SIZE + length;
+    }
+
+    entry->length = (TNC_UInt32) (p - entry->data);
+    parser->next = p;
+    return SOH_RESULT_ENTRY;
+}
+
+void SohStreamInit(SOH_STREAM *stream, SOH_ENTRY_CALLBACK pfnEntry, void *context)
+{
+    memset( stream, 0, sizeof( *stream ) );
+    stream->pfnEntry = pfnEntry;
+    stream->context = context;
+    stream->state = SOH_STREAM_HEADER;
+    stream->result = SOH_RESULT_MORE;
+}
+
+void SohStreamFree(SOH_STREAM *stream)
+{
+    free( stream->held );
+    stream->held = NULL;
+    stream->nHeld = stream->nHeldSize = 0;
+}
+
+static eSOH_RESULT SohStreamFail(SOH_STREAM *stream, eSOH_RESULT result)
+{
+    stream->result = result;
+    return result;
+}
+
+/* Append bytes to those held of the current entry */
+static int SohStreamHold(SOH_STREAM *stream, const unsigned char *p, TNC_UInt32 n)
+{
+    unsigned char *held;
+    TNC_UInt32 size;
+
+    if( 0 == n )
+        return 1;
+
+    if( stream->nHeld + n > stream->nHeldSize )
+    {
+        size = 0 != stream->nHeldSize ? 2 * stream->nHeldSize : 256;
+        if( size < stream->nHeld + n )
+            size = stream->nHeld + n;
+
+        held = (unsigned char *) realloc( stream->held, size );
+        if( NULL == held )
+            return 0;
+
+        stream->held = held;
+        stream->nHeldSize = size;
+    }
+
+    memcpy( stream->held + stream->nHeld, p, n );
+    stream->nHeld += n;
+    return 1;
+}
+
+/* Pass on the current entry, which ends at stream offset 'end'. 'data' is
+   the chunk being read, which starts at stream offset stream->offset. */
+static int SohStreamEmit(SOH_STREAM *stream, TNC_BufferReference data, TNC_UInt32 end)
+{
+    SOH_ENTRY entry;
+
+    entry.systemHealthID = stream->systemHealthID;
+    entry.length = end - stream->entryOffset;
+
+    if( stream->entryOffset >= stream->offset )
+        entry.data = data + (stream->entryOffset - stream->offset);
+    else
+    {
+        if( end > stream->offset && ! SohStreamHold( stream, data, end - stream->offset ) )
+            return 0;
+
+        entry.data = stream->held;
+    }
+
+    stream->pfnEntry( stream->context, &entry );
+    return 1;
+}
+
+/* A new entry starts at stream offset 'start'. If its header began in an
+   earlier chunk, the bytes of it seen so far are held. */
+static int SohStreamStartEntry(SOH_STREAM *stream, TNC_UInt32 start)
+{
+    stream->nHeld = 0;
+    stream->entryOffset = start;
+    stream->bInEntry = 1;
+
+    return start >= stream->offset || SohStreamHold( stream, stream->header, stream->offset - start );
+}
+
+eSOH_RESULT SohStreamWrite(SOH_STREAM *stream, TNC_BufferReference data, TNC_UInt32 length)
+{
+    TNC_UInt32 pos = 0, n;
+
+    if( SOH_RESULT_MORE != stream->result )
+        return stream->result;
+
+    if( NULL == data )
+        length = 0;
+
+    while( pos < length )
+    {
+        switch( stream->state )
+        {
+        case SOH_STREAM_HEADER:
+            if( 0 == stream->nHeader )
+                stream->attributeOffset = stream->offset + pos;
+
+            stream->header[ stream->nHeader++ ] = data[ pos++ ];
+            if( stream->nHeader < SOH_TLV_HEADER_SIZE )
+                break;
+
+            stream->nHeader = 0;
+            stream->nSkip = SOH_GET16( stream->header + 2 );
+
+            if( SOH_TYPE_SYSTEM_HEALTH_ID == SOH_GET16( stream->header ) )
+            {
+                if( stream->nSkip < 4 )
+                    return SohStreamFail( stream, SOH_RESULT_MALFORMED );
+
+                /* The entry before this one is complete */
+                if( stream->bInEntry && ! SohStreamEmit( stream, data, stream->attributeOffset ) )
+                    return SohStreamFail( stream, SOH_RESULT_NO_MEMORY );
+
+                if( ! SohStreamStartEntry( stream, stream->attributeOffset ) )
+                    return SohStreamFail( stream, SOH_RESULT_NO_MEMORY );
+
+                stream->nSkip -= 4;
+                stream->systemHealthID = 0;
+                stream->state = SOH_STREAM_ID;
+            }
+            else if( ! stream->bInEntry )
+                return SohStreamFail( stream, SOH_RESULT_MALFORMED );
+            else if( 0 != stream->nSkip )
+                stream->state = SOH_STREAM_VALUE;
+            break;
+
+        case SOH_STREAM_ID:
+            stream->systemHealthID = (stream->systemHealthID << 8) | data[ pos++ ];
+            if( ++stream->nHeader < 4 )
+                break;
+
+            stream->nHeader = 0;
+            stream->state = 0 != stream->nSkip ? SOH_STREAM_VALUE : SOH_STREAM_HEADER;
+            break;
+
+        case SOH_STREAM_VALUE:
+            n = length - pos < stream->nSkip ? length - pos : stream->nSkip;
+            pos += n;
+            stream->nSkip -= n;
+            if( 0 == stream->nSkip )
+                stream->state = SOH_STREAM_HEADER;
+            break;
+        }
+    }
+
+    /* Whatever of the current entry is in this chunk must outlive it */
+    if( stream->bInEntry )
+    {
+        n = stream->entryOffset > stream->offset ? stream->entryOffset - stream->offset : 0;
+        if( ! SohStreamHold( stream, data + n, length - n ) )
+            return SohStreamFail( stream, SOH_RESULT_NO_MEMORY );
+    }
+
+    stream->offset += length;
+    return SOH_RESULT_MORE;
+}
+
+eSOH_RESULT SohStreamFinish(SOH_STREAM *stream)
+{
+    if( SOH_RESULT_MORE != stream->result )
+        return stream->result;
+
+    if( SOH_STREAM_HEADER != stream->state || 0 != stream->nHeader )
+        return SohStreamFail( stream, SOH_RESULT_MALFORMED );
+
+    if( stream->bInEntry && ! SohStreamEmit( stream, NULL, stream->offset ) )
+        return SohStreamFail( stream, SOH_RESULT_NO_MEMORY );
+
+    stream->bInEntry = 0;
+    stream->result = SOH_RESULT_END;
+    return SOH_RESULT_END;
+}
@@ -0,0 +1,146 @@
+/*
+ * soh.h
+ *
+ * Splitting an SoH into its SoHReportEntries
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SOH_H
+#define _SOH_H
+
+#include "tncifimc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An SoH (statement of health) holds one SoHReportEntry for each health
+   agent, and an SoHR one for each health validator. Both are lists of
+   attributes, each a TLV: a 16-bit type and a 16-bit length, big-endian,
+   followed by 'length' bytes of value. An entry starts with a
+   System-Health-ID attribute, whose value begins with the 32-bit System
+   Health ID (a 24-bit SMI vendor number and an 8-bit component, laid out
+   like a TNC_MessageType), and runs up to the next System-Health-ID
+   attribute or the end of the SoH.
+
+   The parser walks the attributes once, checking each length against what
+   is left of the buffer, and hands back every entry in place; it allocates
+   nothing. An SoH that arrives in pieces can instead be fed to an
+   SOH_STREAM, which calls back with each entry as soon as it is complete. */
+
+#define SOH_TLV_HEADER_SIZE			4
+#define SOH_TYPE_SYSTEM_HEALTH_ID	2
+
+typedef enum eSOH_RESULT_tag
+{
+    SOH_RESULT_ENTRY,		/* An entry was returned */
+    SOH_RESULT_END,			/* No entries are left */
+    SOH_RESULT_MALFORMED,	/* An attribute overruns the SoH, or the SoH doesn't start with a System-Health-ID */
+    SOH_RESULT_MORE,		/* The stream needs more input */
+    SOH_RESULT_NO_MEMORY	/* An entry split across chunks couldn't be held */
+} eSOH_RESULT;
+
+typedef struct SOH_ENTRY_tag
+{
+    TNC_BufferReference data;			/* Starts with the System-Health-ID attribute */
+    TNC_UInt32 length;
+    TNC_MessageType systemHealthID;
+} SOH_ENTRY;
+
+typedef struct SOH_PARSER_tag
+{
+    TNC_BufferReference start;
+    TNC_BufferReference next;			/* Next attribute to look at */
+    TNC_BufferReference end;
+} SOH_PARSER;
+
+void SohParserInit(SOH_PARSER *parser, TNC_BufferReference soh, TNC_UInt32 length);
+
+/* After SOH_RESULT_MALFORMED, SohParserOffset gives the offset of the
+   attribute at fault */
+eSOH_RESULT SohNextEntry(SOH_PARSER *parser, SOH_ENTRY *entry);
+
+#define SohParserOffset(parser)		((TNC_UInt32) ((parser)->next - (parser)->start))
+
+/* The streaming parser is a state machine over the attribute headers; it
+   only looks at the bytes of a header and of a System Health ID, and skips
+   over other values. An entry is known to be complete when the header of
+   the next System-Health-ID attribute arrives, or the stream ends. An entry
+   that lies within one chunk is passed to the callback in place; one that
+   spans chunks is gathered into a buffer owned by the stream, so at most one
+   entry is ever held. The entry passed to the callback is only valid until
+   it returns. */
+typedef void (*SOH_ENTRY_CALLBACK)(void *context, const SOH_ENTRY *entry);
+
+typedef enum eSOH_STREAM_STATE_tag
+{
+    SOH_STREAM_HEADER,		/* Reading an attribute header */
+    SOH_STREAM_ID,			/* Reading a System Health ID */
+    SOH_STREAM_VALUE		/* Skipping the rest of a value */
+} eSOH_STREAM_STATE;
+
+typedef struct SOH_STREAM_tag
+{
+    SOH_ENTRY_CALLBACK pfnEntry;
+    void *context;
+    eSOH_STREAM_STATE state;
+    eSOH_RESULT result;					/* SOH_RESULT_MORE until the stream fails or ends */
+    unsigned char header[ SOH_TLV_HEADER_SIZE ];
+    unsigned nHeader;					/* Bytes of header[] or of the System Health ID read so far */
+    TNC_UInt32 nSkip;					/* Bytes of the value left to skip */
+    TNC_MessageType systemHealthID;		/* Of the current entry */
+    unsigned bInEntry;
+    TNC_UInt32 offset;					/* Stream offset of the next chunk */
+    TNC_UInt32 entryOffset;				/* Stream offset of the current entry */
+    TNC_UInt32 attributeOffset;			/* Stream offset of the attribute being read; after a failure, of the one at fault */
+    unsigned char *held;				/* Bytes of the current entry from earlier chunks */
+    TNC_UInt32 nHeld;
+    TNC_UInt32 nHeldSize;
+} SOH_STREAM;
+
+void SohStreamInit(SOH_STREAM *stream, SOH_ENTRY_CALLBACK pfnEntry, void *context);
+
+/* Returns SOH_RESULT_MORE when the chunk was taken. Once anything else is
+   returned the stream stays failed and takes no more input. */
+eSOH_RESULT SohStreamWrite(SOH_STREAM *stream, TNC_BufferReference data, TNC_UInt32 length);
+
+/* Ends the stream and passes on its last entry. Returns SOH_RESULT_END, or
+   SOH_RESULT_MALFORMED if it stopped inside an attribute. */
+eSOH_RESULT SohStreamFinish(SOH_STREAM *stream);
+
+/* Frees the buffer held by the stream; it can then be initialized again */
+void SohStreamFree(SOH_STREAM *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * tncthread.c
+ *
+ * TNC SDK Thread Portability Code
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tncthread.h"
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+/* Both thread APIs want a different entry point signature; this record
+   carries the portable one across to a native trampoline */
+typedef struct THREAD_START_tag
+{
+    TNC_THREAD_PROC proc;
+    void *arg;
+} THREAD_START;
+
+#ifdef WIN32
+static DWORD WINAPI ThreadTrampoline(LPVOID param)
+#else
+static void* ThreadTrampoline(void *param)
+#endif
+{
+    THREAD_START start = *(THREAD_START *) param;
+
+    free( param );
+    start.proc( start.arg );
+    return 0;
+}
+
+int ThreadCreate(TNC_THREAD *thread, TNC_THREAD_PROC proc, void *arg)
+{
+    THREAD_START *start;
+
+    start = (THREAD_START *) malloc( sizeof( *start ) );
+    if( NULL == start )
+        return ENOMEM;
+
+    start->proc = proc;
+    start->arg = arg;
+
+#ifdef WIN32
+    *thread = CreateThread( NULL, 0, ThreadTrampoline, start, 0, NULL );
+    if( NULL == *thread )
+    {
+        free( start );
+        return GetLastError();
+    }
+#else
+    {
+        int err = pthread_create( thread, NULL, ThreadTrampoline, start );
+        if( 0 != err )
+        {
+            free( start );
+            return err;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+void ThreadJoin(TNC_THREAD thread)
+{
+#ifdef WIN32
+    WaitForSingleObject( thread, INFINITE );
+    CloseHandle( thread );
+#else
+    pthread_join( thread, NULL );
+#endif
+}
+
+void ThreadYield(void)
+{
+#ifdef WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+void ThreadSleep(unsigned milliseconds)
+{
+#ifdef WIN32
+    Sleep( milliseconds );
+#else
+    struct timespec ts;
+
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (long) (milliseconds % 1000) * 1000000;
+    nanosleep( &ts, NULL );
+#endif
+}
+
+unsigned ThreadGetProcessorCount(void)
+{
+#ifdef WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo( &si );
+    return si.dwNumberOfProcessors;
+#else
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+
+    return n > 0 ? (unsigned) n : 1;
+#endif
+}
+
+void MutexInit(TNC_MUTEX *mutex)
+{
+#ifdef WIN32
+    InitializeCriticalSection( mutex );
+#else
+    pthread_mutex_init( mutex, NULL );
+#endif
+}
+
+void MutexDestroy(TNC_MUTEX *mutex)
+{
+#ifdef WIN32
+    DeleteCriticalSection( mutex );
+#else
+    pthread_mutex_destroy( mutex );
+#endif
+}
+
+void MutexLock(TNC_MUTEX *mutex)
+{
+#ifdef WIN32
+    EnterCriticalSection( mutex );
+#else
+    pthread_mutex_lock( mutex );
+#endif
+}
+
+void MutexUnlock(TNC_MUTEX *mutex)
+{
+#ifdef WIN32
+    LeaveCriticalSection( mutex );
+#else
+    pthread_mutex_unlock( mutex );
+#endif
+}
+
+void CondInit(TNC_COND *cond)
+{
+#ifdef WIN32
+    InitializeConditionVariable( cond );
+#else
+    pthread_cond_init( cond, NULL );
+#endif
+}
+
+void CondDestroy(TNC_COND *cond)
+{
+#ifdef WIN32
+    (void) cond;
+#else
+    pthread_cond_destroy( cond );
+#endif
+}
+
+void CondWait(TNC_COND *cond, TNC_MUTEX *mutex)
+{
+#ifdef WIN32
+    SleepConditionVariableCS( cond, mutex, INFINITE );
+#else
+    pthread_cond_wait( cond, mutex );
+#endif
+}
+
+void CondSignal(TNC_COND *cond)
+{
+#ifdef WIN32
+    WakeConditionVariable( cond );
+#else
+    pthread_cond_signal( cond );
+#endif
+}
+
+void CondBroadcast(TNC_COND *cond)
+{
+#ifdef WIN32
+    WakeAllConditionVariable( cond );
+#else
+    pthread_cond_broadcast( cond );
+#endif
+}
+
+long AtomicAdd(volatile long *p, long value)
+{
+#ifdef WIN32
+    return InterlockedExchangeAdd( p, value ) + value;
+#else
+    return __sync_add_and_fetch( p, value );
+#endif
+}
+
+long AtomicCompareExchange(volatile long *p, long exchange, long comparand)
+{
+#ifdef WIN32
+    return InterlockedCompareExchange( p, exchange, comparand );
+#else
+    return __sync_val_compare_and_swap( p, comparand, exchange );
+#endif
+}
+
+void* AtomicCompareExchangePointer(void * volatile *p, void *exchange, void *comparand)
+{
+#ifdef WIN32
+    return InterlockedCompareExchangePointer( p, exchange, comparand );
+#else
+    return __sync_val_compare_and_swap( p, comparand, exchange );
+#endif
+}
+
+void* AtomicExchangePointer(void * volatile *p, void *value)
+{
+#ifdef WIN32
+    return InterlockedExchangePointer( p, value );
+#else
+    /* __sync_lock_test_and_set is only an acquire barrier; make it a full
+       one like InterlockedExchangePointer */
+    __sync_synchronize();
+    return __sync_lock_test_and_set( p, value );
+#endif
+}
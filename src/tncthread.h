@@ -0,0 +1,113 @@
+/*
+ * tncthread.h
+ *
+ * Header File for TNC SDK Thread Portability Code
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TNCTHREAD_H
+#define _TNCTHREAD_H
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The tester runs on Windows and on POSIX systems. These thin wrappers hide
+   the difference between Win32 threads and pthreads from the rest of the code. */
+
+#ifdef WIN32
+typedef HANDLE TNC_THREAD;
+typedef CRITICAL_SECTION TNC_MUTEX;
+typedef CONDITION_VARIABLE TNC_COND;	/* Windows Vista and later */
+#else
+typedef pthread_t TNC_THREAD;
+typedef pthread_mutex_t TNC_MUTEX;
+typedef pthread_cond_t TNC_COND;
+#endif
+
+typedef void (*TNC_THREAD_PROC)(void *arg);
+
+int ThreadCreate(TNC_THREAD *thread, TNC_THREAD_PROC proc, void *arg);
+
+void ThreadJoin(TNC_THREAD thread);
+
+void ThreadYield(void);
+
+void ThreadSleep(unsigned milliseconds);
+
+unsigned ThreadGetProcessorCount(void);
+
+void MutexInit(TNC_MUTEX *mutex);
+
+void MutexDestroy(TNC_MUTEX *mutex);
+
+void MutexLock(TNC_MUTEX *mutex);
+
+void MutexUnlock(TNC_MUTEX *mutex);
+
+/* Condition variables, for threads that would otherwise poll. CondWait
+   releases the mutex while it waits and holds it again when it returns;
+   it may return without being signalled, so the caller waits in a loop
+   until its condition holds. */
+void CondInit(TNC_COND *cond);
+
+void CondDestroy(TNC_COND *cond);
+
+void CondWait(TNC_COND *cond, TNC_MUTEX *mutex);
+
+void CondSignal(TNC_COND *cond);
+
+void CondBroadcast(TNC_COND *cond);
+
+/* Atomically add 'value' to '*p' and return the new value */
+long AtomicAdd(volatile long *p, long value);
+
+/* Atomically replace '*p' with 'exchange' if it equals 'comparand'; returns
+   the value '*p' had before */
+long AtomicCompareExchange(volatile long *p, long exchange, long comparand);
+
+/* The same for pointers, which are wider than a long on 64-bit Windows */
+void* AtomicCompareExchangePointer(void * volatile *p, void *exchange, void *comparand);
+
+/* Atomically replace '*p' with 'value' and return the value it had before */
+void* AtomicExchangePointer(void * volatile *p, void *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
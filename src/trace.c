@@ -0,0 +1,321 @@
+/*
+ * trace.c
+ *
+ * Binary trace of the calls made to the TNCC and TNCS
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "trace.h"
+#include "typeindex.h"
+#include "tncthread.h"
+#include "IMCIMVBench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Records from all threads go into one buffer under a lock and reach the
+   file in large writes. The file pointer is set before any handshake starts
+   and cleared after they are all done, so it is read without the lock. */
+#define TRACE_BUFFER_SIZE	(256 * 1024)
+
+static FILE *g_pTraceFile = NULL;
+static TNC_MUTEX g_TraceLock;
+static char *g_pTraceBuffer = NULL;
+static size_t g_nTraceBuffered = 0;
+static unsigned long long g_nTraceOffset = 0;		/* Offset of the next byte in the file */
+static BENCH_TIME g_tTraceStart = 0;
+static int g_nTraceError = 0;
+
+static void TraceFlush(void)
+{
+    if( 0 != g_nTraceBuffered && fwrite( g_pTraceBuffer, 1, g_nTraceBuffered, g_pTraceFile ) != g_nTraceBuffered )
+        g_nTraceError = errno ? errno : EIO;
+
+    g_nTraceBuffered = 0;
+}
+
+static void TraceAppend(const void *p, size_t n)
+{
+    if( g_nTraceBuffered + n > TRACE_BUFFER_SIZE )
+        TraceFlush();
+
+    /* Payloads too big to buffer go straight to the file */
+    if( n > TRACE_BUFFER_SIZE )
+    {
+        if( fwrite( p, 1, n, g_pTraceFile ) != n )
+            g_nTraceError = errno ? errno : EIO;
+    }
+    else
+    {
+        memcpy( g_pTraceBuffer + g_nTraceBuffered, p, n );
+        g_nTraceBuffered += n;
+    }
+
+    g_nTraceOffset += n;
+}
+
+static void TracePad(size_t n)
+{
+    static const char zeros[ TRACE_ALIGN ] = { 0 };
+
+    TraceAppend( zeros, (size_t) (TRACE_ROUND( n ) - n) );
+}
+
+/* Stamp a record and append it; must be called with the lock held. Records
+   are stamped under the lock so that the file is in time order. */
+static void TraceAppendRecord(TRACE_RECORD *rec)
+{
+    rec->timestamp = BenchClock() - g_tTraceStart;
+    if( rec->flags & TRACE_FLAG_PAYLOAD )
+        rec->payload = g_nTraceOffset + sizeof( *rec );
+
+    TraceAppend( rec, sizeof( *rec ) );
+}
+
+static void TraceWrite(TRACE_RECORD *rec, const void *payload)
+{
+    MutexLock( &g_TraceLock );
+
+    TraceAppendRecord( rec );
+    if( rec->flags & TRACE_FLAG_PAYLOAD )
+    {
+        TraceAppend( payload, rec->length );
+        TracePad( rec->length );
+    }
+
+    MutexUnlock( &g_TraceLock );
+}
+
+int TraceStart(const char *pszPath)
+{
+    TRACE_HEADER header;
+
+    g_pTraceBuffer = (char *) malloc( TRACE_BUFFER_SIZE );
+    if( NULL == g_pTraceBuffer )
+        return ENOMEM;
+
+    g_pTraceFile = fopen( pszPath, "wb" );
+    if( NULL == g_pTraceFile )
+    {
+        free( g_pTraceBuffer );
+        g_pTraceBuffer = NULL;
+        return errno ? errno : EIO;
+    }
+
+    MutexInit( &g_TraceLock );
+    g_nTraceBuffered = 0;
+    g_nTraceOffset = 0;
+    g_nTraceError = 0;
+    g_tTraceStart = BenchClock();
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, TRACE_MAGIC, sizeof( header.magic ) );
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof( TRACE_RECORD );
+    header.startTime = (unsigned long long) time( NULL );
+    TraceAppend( &header, sizeof( header ) );
+
+    return 0;
+}
+
+int TraceStop(void)
+{
+    if( NULL == g_pTraceFile )
+        return 0;
+
+    TraceFlush();
+    if( 0 != fclose( g_pTraceFile ) && 0 == g_nTraceError )
+        g_nTraceError = errno ? errno : EIO;
+
+    g_pTraceFile = NULL;
+    free( g_pTraceBuffer );
+    g_pTraceBuffer = NULL;
+    MutexDestroy( &g_TraceLock );
+
+    return g_nTraceError;
+}
+
+static void TraceInitRecord(TRACE_RECORD *rec, eTRACE_EVENT event, unsigned flags, TNC_ConnectionID cid, TNC_UInt32 moduleID, TNC_Result result)
+{
+    memset( rec, 0, sizeof( *rec ) );
+    rec->event = event;
+    rec->flags = flags;
+    rec->cid = (unsigned int) cid;
+    rec->moduleID = (unsigned int) moduleID;
+    rec->result = (unsigned int) result;
+}
+
+/* Both kinds of registration are recorded as (vendor ID, subtype) pairs */
+static void TraceTypes(eTRACE_EVENT event, unsigned flags, TNC_UInt32 moduleID, TNC_MessageTypeList types,
+    TNC_VendorIDList vendorIDs, TNC_MessageSubtypeList subtypes, TNC_UInt32 typeCount, TNC_Result result)
+{
+    TRACE_RECORD rec;
+    unsigned int pair[ 2 ];
+    TNC_UInt32 i;
+
+    if( NULL == g_pTraceFile )
+        return;
+
+    if( NULL == types && (NULL == vendorIDs || NULL == subtypes) )
+        typeCount = 0;
+
+    TraceInitRecord( &rec, event, flags, 0, moduleID, result );
+    rec.length = (unsigned int) (typeCount * sizeof( pair ));
+    if( 0 != typeCount )
+        rec.flags |= TRACE_FLAG_PAYLOAD;
+
+    MutexLock( &g_TraceLock );
+
+    TraceAppendRecord( &rec );
+    for( i = 0; i < typeCount; ++i )
+    {
+        pair[ 0 ] = (unsigned int) (NULL != types ? EXTRACT_VENDOR( types[ i ] ) : vendorIDs[ i ]);
+        pair[ 1 ] = (unsigned int) (NULL != types ? EXTRACT_SUBTYPE( types[ i ] ) : subtypes[ i ]);
+        TraceAppend( pair, sizeof( pair ) );
+    }
+
+    MutexUnlock( &g_TraceLock );
+}
+
+void TraceMessageTypes(unsigned flags, TNC_UInt32 moduleID, TNC_MessageTypeList types, TNC_UInt32 typeCount, TNC_Result result)
+{
+    TraceTypes( TRACE_EVENT_REPORT_TYPES, flags, moduleID, types, NULL, NULL, typeCount, result );
+}
+
+void TraceMessageTypesLong(unsigned flags, TNC_UInt32 moduleID, TNC_VendorIDList vendorIDs, TNC_MessageSubtypeList subtypes, TNC_UInt32 typeCount, TNC_Result result)
+{
+    TraceTypes( TRACE_EVENT_REPORT_TYPES_LONG, flags, moduleID, NULL, vendorIDs, subtypes, typeCount, result );
+}
+
+void TraceMessage(eTRACE_EVENT event, unsigned flags, TNC_ConnectionID cid, TNC_UInt32 moduleID, TNC_UInt32 destinationID,
+    TNC_VendorID vendorID, TNC_MessageSubtype subtype, TNC_UInt32 messageFlags, TNC_BufferReference message, TNC_UInt32 length, TNC_Result result)
+{
+    TRACE_RECORD rec;
+
+    if( NULL == g_pTraceFile )
+        return;
+
+    TraceInitRecord( &rec, event, flags, cid, moduleID, result );
+    rec.destinationID = (unsigned int) destinationID;
+    rec.vendorID = (unsigned int) vendorID;
+    rec.subtype = (unsigned int) subtype;
+    rec.messageFlags = (unsigned int) messageFlags;
+    if( NULL != message && 0 != length )
+    {
+        rec.length = (unsigned int) length;
+        rec.flags |= TRACE_FLAG_PAYLOAD;
+    }
+
+    TraceWrite( &rec, message );
+}
+
+void TraceCall(eTRACE_EVENT event, unsigned flags, TNC_ConnectionID cid, TNC_UInt32 moduleID, TNC_UInt32 value, TNC_UInt32 evaluation,
+    const char *pszName, TNC_Result result)
+{
+    TRACE_RECORD rec;
+
+    if( NULL == g_pTraceFile )
+        return;
+
+    TraceInitRecord( &rec, event, flags, cid, moduleID, result );
+    rec.value = (unsigned int) value;
+    rec.evaluation = (unsigned int) evaluation;
+    if( NULL != pszName )
+    {
+        rec.length = (unsigned int) strlen( pszName );
+        rec.flags |= TRACE_FLAG_PAYLOAD;
+    }
+
+    TraceWrite( &rec, pszName );
+}
+
+void TraceBatch(TNC_ConnectionID cid, unsigned direction, unsigned count, unsigned flags)
+{
+    TRACE_RECORD rec;
+
+    if( NULL == g_pTraceFile )
+        return;
+
+    TraceInitRecord( &rec, TRACE_EVENT_BATCH, flags, cid, 0, TNC_RESULT_SUCCESS );
+    rec.length = count;
+    rec.direction = direction;
+    TraceWrite( &rec, NULL );
+}
+
+int TraceOpen(const char *pszPath, TRACE_FILE *file)
+{
+    const TRACE_HEADER *header;
+    int err;
+
+    err = MapFile( pszPath, file );
+    if( 0 != err )
+        return err;
+
+    header = (const TRACE_HEADER *) file->base;
+    if( file->size < sizeof( *header ) || 0 != memcmp( header->magic, TRACE_MAGIC, sizeof( header->magic ) ) ||
+        TRACE_VERSION != header->version || sizeof( TRACE_RECORD ) != header->recordSize )
+    {
+        UnmapFile( file );
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+void TraceClose(TRACE_FILE *file)
+{
+    UnmapFile( file );
+}
+
+const TRACE_RECORD* TraceNext(const TRACE_FILE *file, const TRACE_RECORD *rec)
+{
+    unsigned long long offset;
+
+    if( NULL == rec )
+        offset = sizeof( TRACE_HEADER );
+    else
+    {
+        offset = (unsigned long long) ((const unsigned char *) rec - file->base) + sizeof( *rec );
+        if( rec->flags & TRACE_FLAG_PAYLOAD )
+            offset += TRACE_ROUND( rec->length );
+    }
+
+    if( offset + sizeof( *rec ) > file->size )
+        return NULL;
+
+    rec = (const TRACE_RECORD *) (file->base + offset);
+    if( (rec->flags & TRACE_FLAG_PAYLOAD) && (rec->payload != offset + sizeof( *rec ) || rec->payload + rec->length > file->size) )
+        return NULL;
+
+    return rec;
+}
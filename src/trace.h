@@ -0,0 +1,147 @@
+/*
+ * trace.h
+ *
+ * Binary trace of the calls made to the TNCC and TNCS
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "tncifimc.h"
+#include "mapfile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* With tracing on, every call an IMC or IMV makes into the TNCC or TNCS,
+   every batch the message queue hands over for delivery and every connection
+   state change the modules are notified of is appended to a binary trace
+   file. Text output of the same calls is far too slow and bulky
+   to keep on during a load test; the trace is meant to be analyzed offline
+   or replayed.
+
+   The file starts with a TRACE_HEADER, followed by TRACE_RECORDs. A record
+   flagged TRACE_FLAG_PAYLOAD is followed by 'length' bytes of payload, padded
+   to a multiple of TRACE_ALIGN; 'payload' gives the offset of those bytes in
+   the file, so a reader that maps the file can use them in place. All fields
+   are in host byte order. */
+
+#define TRACE_MAGIC		"TNCTRACE"
+#define TRACE_VERSION	2
+#define TRACE_ALIGN		8
+#define TRACE_ROUND(x)	(((x) + TRACE_ALIGN - 1) & ~((unsigned long long) TRACE_ALIGN - 1))
+
+typedef enum eTRACE_EVENT_tag
+{
+    TRACE_EVENT_REPORT_TYPES = 1,		/* Payload: (vendor ID, subtype) pairs */
+    TRACE_EVENT_REPORT_TYPES_LONG,		/* Payload: (vendor ID, subtype) pairs */
+    TRACE_EVENT_SEND_MESSAGE,			/* Payload: the message */
+    TRACE_EVENT_SEND_MESSAGE_SOH,		/* Payload: the SOH report entry */
+    TRACE_EVENT_SEND_MESSAGE_LONG,		/* Payload: the message */
+    TRACE_EVENT_REQUEST_RETRY,			/* value: the retry reason */
+    TRACE_EVENT_PROVIDE_RECOMMENDATION,	/* value: recommendation, evaluation */
+    TRACE_EVENT_BIND_FUNCTION,			/* Payload: the function name */
+    TRACE_EVENT_BATCH,					/* length: messages in the batch; direction: its queue */
+    TRACE_EVENT_CONNECTION_STATE		/* value: the new TNC_ConnectionState */
+} eTRACE_EVENT;
+
+#define TRACE_FLAG_TNCS		0x1		/* An IMV called the TNCS; otherwise an IMC called the TNCC */
+#define TRACE_FLAG_PAYLOAD	0x2		/* Payload bytes follow the record */
+#define TRACE_FLAG_PIPELINED	0x4	/* Batches: part of it was taken early, while it was still being sent */
+
+typedef struct TRACE_HEADER_tag
+{
+    char magic[ 8 ];				/* TRACE_MAGIC, not NUL terminated */
+    unsigned int version;			/* TRACE_VERSION */
+    unsigned int recordSize;		/* sizeof( TRACE_RECORD ) */
+    unsigned long long startTime;	/* Seconds since the epoch when tracing started */
+} TRACE_HEADER;
+
+typedef struct TRACE_RECORD_tag
+{
+    unsigned long long timestamp;	/* Nanoseconds since tracing started */
+    unsigned long long payload;		/* File offset of the payload, if any */
+    unsigned int event;				/* eTRACE_EVENT */
+    unsigned int flags;				/* TRACE_FLAG_* */
+    unsigned int cid;
+    unsigned int moduleID;			/* Calling IMC or IMV */
+    unsigned int destinationID;		/* Long messages: receiving IMV or IMC */
+    unsigned int vendorID;			/* Message type; basic ones are split up */
+    unsigned int subtype;
+    unsigned int messageFlags;
+    unsigned int length;			/* Payload bytes */
+    unsigned int result;			/* TNC_Result returned to the caller */
+    unsigned int value;
+    unsigned int evaluation;
+    unsigned int direction;			/* Batches: QUEUE_TO_IMV or QUEUE_TO_IMC */
+    unsigned int reserved;			/* Zero; keeps the record a multiple of TRACE_ALIGN */
+} TRACE_RECORD;
+
+/* Returns 0 on success, or an errno value if the file can't be created */
+int TraceStart(const char *pszPath);
+
+/* Writes out buffered records and closes the file; returns 0 if all of the
+   trace made it to disk */
+int TraceStop(void);
+
+void TraceMessageTypes(unsigned flags, TNC_UInt32 moduleID, TNC_MessageTypeList types, TNC_UInt32 typeCount, TNC_Result result);
+
+void TraceMessageTypesLong(unsigned flags, TNC_UInt32 moduleID, TNC_VendorIDList vendorIDs, TNC_MessageSubtypeList subtypes, TNC_UInt32 typeCount, TNC_Result result);
+
+void TraceMessage(eTRACE_EVENT event, unsigned flags, TNC_ConnectionID cid, TNC_UInt32 moduleID, TNC_UInt32 destinationID,
+    TNC_VendorID vendorID, TNC_MessageSubtype subtype, TNC_UInt32 messageFlags, TNC_BufferReference message, TNC_UInt32 length, TNC_Result result);
+
+void TraceCall(eTRACE_EVENT event, unsigned flags, TNC_ConnectionID cid, TNC_UInt32 moduleID, TNC_UInt32 value, TNC_UInt32 evaluation,
+    const char *pszName, TNC_Result result);
+
+/* A batch boundary: the messages sent to one side so far are handed over
+   for delivery */
+void TraceBatch(TNC_ConnectionID cid, unsigned direction, unsigned count, unsigned flags);
+
+/* A trace is read back by mapping the whole file into memory; records and
+   their payloads are used where they lie. TraceNext returns NULL at the end
+   of the trace, or where a record is cut short. */
+typedef MAPPED_FILE TRACE_FILE;
+
+/* Returns 0 on success, or an errno value; EINVAL if it isn't a trace */
+int TraceOpen(const char *pszPath, TRACE_FILE *file);
+
+void TraceClose(TRACE_FILE *file);
+
+const TRACE_RECORD* TraceNext(const TRACE_FILE *file, const TRACE_RECORD *rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
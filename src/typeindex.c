@@ -0,0 +1,346 @@
+/*
+ * typeindex.c
+ *
+ * Compiled index and routing table of the message types registered by IMCs and IMVs
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "typeindex.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <memory.h>
+
+/* A (vendor ID, subtype) pair packed into one key. Vendor IDs take 24 bits
+   and subtypes 32, so no key can ever equal TYPE_SET_EMPTY. */
+#define TYPE_KEY(vendor, subtype)	(((unsigned long long) (vendor) << 32) | ((subtype) & 0xffffffffUL))
+#define TYPE_SET_EMPTY				((unsigned long long) -1)
+#define TYPE_SET_MIN_SIZE			8
+
+static unsigned TypeSetHash(const TYPE_SET *set, unsigned long long key)
+{
+    return (unsigned) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (set->size - 1);
+}
+
+/* Allocate a set with room for count keys at no more than half load */
+static unsigned TypeSetInit(TYPE_SET *set, unsigned count)
+{
+    set->size = TYPE_SET_MIN_SIZE;
+    while( set->size < 2 * count )
+        set->size <<= 1;
+
+    set->count = 0;
+    set->keys = (unsigned long long*) malloc( set->size * sizeof( *set->keys ) );
+    if( NULL == set->keys )
+    {
+        set->size = 0;
+        return ENOMEM;
+    }
+
+    /* Every byte 0xff makes every slot TYPE_SET_EMPTY */
+    memset( set->keys, 0xff, set->size * sizeof( *set->keys ) );
+    return 0;
+}
+
+static void TypeSetInsert(TYPE_SET *set, unsigned long long key)
+{
+    unsigned i = TypeSetHash( set, key );
+
+    while( TYPE_SET_EMPTY != set->keys[ i ] )
+    {
+        if( key == set->keys[ i ] )
+            return;
+
+        i = (i + 1) & (set->size - 1);
+    }
+
+    set->keys[ i ] = key;
+    ++set->count;
+}
+
+static unsigned TypeSetFind(const TYPE_SET *set, unsigned long long key)
+{
+    unsigned i;
+
+    if( 0 == set->count )
+        return 0;
+
+    for( i = TypeSetHash( set, key ); TYPE_SET_EMPTY != set->keys[ i ]; i = (i + 1) & (set->size - 1) )
+    {
+        if( key == set->keys[ i ] )
+            return 1;
+    }
+
+    return 0;
+}
+
+static void TypeSetFree(TYPE_SET *set)
+{
+    free( set->keys );
+    memset( set, 0, sizeof( *set ) );
+}
+
+/* Registration i from either a TNC_MessageType list or a pair of lists */
+static void GetRegisteredType(TNC_MessageTypeList types, TNC_VendorIDList vendorIDs,
+                              TNC_MessageSubtypeList subtypes, TNC_UInt32 i,
+                              TNC_VendorID *vendorID, TNC_MessageSubtype *subtype)
+{
+    if( NULL != types )
+    {
+        *vendorID = EXTRACT_VENDOR( types[ i ] ) & TNC_VENDORID_ANY;
+        *subtype = EXTRACT_SUBTYPE( types[ i ] );
+    }
+    else
+    {
+        *vendorID = vendorIDs[ i ] & TNC_VENDORID_ANY;
+        *subtype = subtypes[ i ];
+    }
+}
+
+static unsigned TypeIndexCompile(TYPE_INDEX *index, TNC_MessageTypeList types, TNC_VendorIDList vendorIDs,
+                                 TNC_MessageSubtypeList subtypes, TNC_UInt32 count)
+{
+    TNC_VendorID vendorID;
+    TNC_MessageSubtype subtype;
+    unsigned nExact = 0, nAnyVendor = 0, nAnySubtype = 0;
+    TNC_UInt32 i;
+
+    TypeIndexFree( index );
+
+    /* Size each table for the registrations that will land in it */
+    for( i = 0; i < count; ++i )
+    {
+        GetRegisteredType( types, vendorIDs, subtypes, i, &vendorID, &subtype );
+
+        if( TNC_VENDORID_ANY == vendorID && TNC_SUBTYPE_ANY == subtype )
+            index->bAnyType = 1;
+        else if( TNC_VENDORID_ANY == vendorID )
+            ++nAnyVendor;
+        else if( TNC_SUBTYPE_ANY == subtype )
+            ++nAnySubtype;
+        else
+            ++nExact;
+    }
+
+    if( TypeSetInit( &index->exact, nExact ) ||
+        TypeSetInit( &index->anyVendor, nAnyVendor ) ||
+        TypeSetInit( &index->anySubtype, nAnySubtype ) )
+    {
+        TypeIndexFree( index );
+        return ENOMEM;
+    }
+
+    for( i = 0; i < count; ++i )
+    {
+        GetRegisteredType( types, vendorIDs, subtypes, i, &vendorID, &subtype );
+
+        if( TNC_VENDORID_ANY == vendorID && TNC_SUBTYPE_ANY == subtype )
+            continue;
+        else if( TNC_VENDORID_ANY == vendorID )
+            TypeSetInsert( &index->anyVendor, TYPE_KEY( 0, subtype ) );
+        else if( TNC_SUBTYPE_ANY == subtype )
+            TypeSetInsert( &index->anySubtype, TYPE_KEY( vendorID, 0 ) );
+        else
+            TypeSetInsert( &index->exact, TYPE_KEY( vendorID, subtype ) );
+    }
+
+    return 0;
+}
+
+unsigned TypeIndexBuild(TYPE_INDEX *index, TNC_MessageTypeList types, TNC_UInt32 count)
+{
+    if( NULL == types )
+        count = 0;
+
+    return TypeIndexCompile( index, types, NULL, NULL, count );
+}
+
+unsigned TypeIndexBuildLong(TYPE_INDEX *index, TNC_VendorIDList vendorIDs,
+                            TNC_MessageSubtypeList subtypes, TNC_UInt32 count)
+{
+    if( NULL == vendorIDs || NULL == subtypes )
+        return TypeIndexCompile( index, NULL, NULL, NULL, 0 );
+
+    return TypeIndexCompile( index, NULL, vendorIDs, subtypes, count );
+}
+
+unsigned TypeIndexFind(const TYPE_INDEX *index, TNC_VendorID vendorID, TNC_MessageSubtype subtype)
+{
+    vendorID &= TNC_VENDORID_ANY;
+
+    return index->bAnyType
+        || TypeSetFind( &index->exact, TYPE_KEY( vendorID, subtype ) )
+        || TypeSetFind( &index->anyVendor, TYPE_KEY( 0, subtype ) )
+        || TypeSetFind( &index->anySubtype, TYPE_KEY( vendorID, 0 ) );
+}
+
+void TypeIndexFree(TYPE_INDEX *index)
+{
+    TypeSetFree( &index->exact );
+    TypeSetFree( &index->anyVendor );
+    TypeSetFree( &index->anySubtype );
+    index->bAnyType = 0;
+}
+
+static unsigned RouteTableHash(const ROUTE_TABLE *table, unsigned long long key)
+{
+    return (unsigned) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (table->size - 1);
+}
+
+/* Add the subscribers of one (vendor ID, subtype) pair unless already present */
+static unsigned RouteTableAdd(ROUTE_TABLE *table, unsigned long long key, unsigned *nIdsCapacity,
+                              unsigned nModules, ROUTE_MATCH match, void *context)
+{
+    ROUTE_ENTRY *entry;
+    TNC_UInt32 *ids;
+    TNC_UInt32 id;
+    unsigned i = RouteTableHash( table, key );
+
+    while( TYPE_SET_EMPTY != table->entries[ i ].key )
+    {
+        if( key == table->entries[ i ].key )
+            return 0;
+
+        i = (i + 1) & (table->size - 1);
+    }
+
+    entry = &table->entries[ i ];
+    entry->key = key;
+    entry->first = table->nIds;
+    entry->count = 0;
+
+    for( id = 0; id < nModules; ++id )
+    {
+        if( ! match( context, id, (TNC_VendorID) (key >> 32), (TNC_MessageSubtype) (key & 0xffffffffUL) ) )
+            continue;
+
+        if( table->nIds == *nIdsCapacity )
+        {
+            *nIdsCapacity = 0 == *nIdsCapacity ? 64 : 2 * *nIdsCapacity;
+            ids = (TNC_UInt32*) realloc( table->ids, *nIdsCapacity * sizeof( *ids ) );
+            if( NULL == ids )
+                return ENOMEM;
+
+            table->ids = ids;
+        }
+
+        table->ids[ table->nIds++ ] = id;
+        ++entry->count;
+    }
+
+    return 0;
+}
+
+ROUTE_TABLE* RouteTableBuild(TYPE_INDEX * const *indexes, unsigned nIndexes,
+                             unsigned nModules, ROUTE_MATCH match, void *context)
+{
+    ROUTE_TABLE *table;
+    const TYPE_SET *exact;
+    unsigned i, j, nKeys = 0, nIdsCapacity = 0;
+
+    for( i = 0; i < nIndexes; ++i )
+        nKeys += indexes[ i ]->exact.count;
+
+    table = (ROUTE_TABLE*) calloc( 1, sizeof( *table ) );
+    if( NULL == table )
+        return NULL;
+
+    table->size = TYPE_SET_MIN_SIZE;
+    while( table->size < 2 * nKeys )
+        table->size <<= 1;
+
+    table->entries = (ROUTE_ENTRY*) malloc( table->size * sizeof( *table->entries ) );
+    if( NULL == table->entries )
+    {
+        free( table );
+        return NULL;
+    }
+
+    for( i = 0; i < table->size; ++i )
+        table->entries[ i ].key = TYPE_SET_EMPTY;
+
+    for( i = 0; i < nIndexes; ++i )
+    {
+        exact = &indexes[ i ]->exact;
+
+        for( j = 0; j < exact->size; ++j )
+        {
+            if( TYPE_SET_EMPTY != exact->keys[ j ] &&
+                RouteTableAdd( table, exact->keys[ j ], &nIdsCapacity, nModules, match, context ) )
+            {
+                RouteTableFree( table );
+                return NULL;
+            }
+        }
+    }
+
+    return table;
+}
+
+unsigned RouteTableLookup(const ROUTE_TABLE *table, TNC_VendorID vendorID, TNC_MessageSubtype subtype,
+                          unsigned nModules, ROUTE_MATCH match, void *context,
+                          TNC_UInt32 *buffer, const TNC_UInt32 **ids)
+{
+    unsigned long long key = TYPE_KEY( vendorID & TNC_VENDORID_ANY, subtype );
+    unsigned i, count = 0;
+    TNC_UInt32 id;
+
+    if( NULL != table )
+    {
+        for( i = RouteTableHash( table, key ); TYPE_SET_EMPTY != table->entries[ i ].key; i = (i + 1) & (table->size - 1) )
+        {
+            if( key == table->entries[ i ].key )
+            {
+                *ids = table->ids + table->entries[ i ].first;
+                return table->entries[ i ].count;
+            }
+        }
+    }
+
+    /* Not registered exactly by anyone; only wildcards can match */
+    for( id = 0; id < nModules; ++id )
+    {
+        if( match( context, id, vendorID, subtype ) )
+            buffer[ count++ ] = id;
+    }
+
+    *ids = buffer;
+    return count;
+}
+
+void RouteTableFree(ROUTE_TABLE *table)
+{
+    if( NULL == table )
+        return;
+
+    free( table->entries );
+    free( table->ids );
+    free( table );
+}
@@ -0,0 +1,134 @@
+/*
+ * typeindex.h
+ *
+ * Compiled index and routing table of the message types registered by IMCs and IMVs
+ *
+ * Copyright 2004-2013 Juniper Networks, Inc. All Rights Reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * o Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * o Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the  
+ *   distribution.
+ * o Neither the name of Juniper Networks nor the names of its
+ *   contributors may be used to endorse or promote products 
+ *   derived from this software without specific prior written 
+ *   permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TYPEINDEX_H
+#define _TYPEINDEX_H
+
+#include "tncifimc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* TNC_TNCC_ReportMessageTypes and TNC_TNCS_ReportMessageTypes (and their Long
+   variants) register a list of (vendor ID, subtype) pairs, either of which may
+   be a wildcard. Rather than scanning that list for every message delivered,
+   the list is compiled into a TYPE_INDEX when it is reported:
+
+   - exact (vendor ID, subtype) pairs go into one hash set,
+   - subtypes registered with TNC_VENDORID_ANY go into a second set,
+   - vendor IDs registered with TNC_SUBTYPE_ANY go into a third set,
+   - a registration of both wildcards sets a flag that matches everything.
+
+   Checking a message then takes at most three hash probes no matter how many
+   types were registered. Vendor IDs are 24 bits wide; higher bits are ignored.
+*/
+
+/* These extract sub-information from TNC_MessageType */
+#define EXTRACT_VENDOR(x) (x >> 8)
+#define EXTRACT_SUBTYPE(x) (x & 0xff)
+
+typedef struct TYPE_SET_tag
+{
+    unsigned long long *keys;
+    unsigned size;      /* number of slots, always a power of two */
+    unsigned count;     /* number of keys stored */
+} TYPE_SET;
+
+typedef struct TYPE_INDEX_tag
+{
+    TYPE_SET exact;
+    TYPE_SET anyVendor;
+    TYPE_SET anySubtype;
+    unsigned bAnyType;
+} TYPE_INDEX;
+
+/* Replace the contents of an index with a TNC_MessageType list */
+unsigned TypeIndexBuild(TYPE_INDEX *index, TNC_MessageTypeList types, TNC_UInt32 count);
+
+/* Replace the contents of an index with a list of (vendor ID, subtype) pairs */
+unsigned TypeIndexBuildLong(TYPE_INDEX *index, TNC_VendorIDList vendorIDs,
+                            TNC_MessageSubtypeList subtypes, TNC_UInt32 count);
+
+/* Return nonzero if a message of this vendor ID and subtype is registered */
+unsigned TypeIndexFind(const TYPE_INDEX *index, TNC_VendorID vendorID, TNC_MessageSubtype subtype);
+
+void TypeIndexFree(TYPE_INDEX *index);
+
+/* A routing table answers "which modules receive a message of this type"
+   with one hash probe. It is built from the exact (vendor ID, subtype) pairs
+   in a set of TYPE_INDEXes and stores, for each pair, the IDs of every module
+   that ROUTE_MATCH says should receive it. Tables are immutable once built;
+   when registrations change a new table replaces the old one.
+
+   Types that are not in the table (those matched only by a wildcard, or by no
+   module at all) are resolved by asking ROUTE_MATCH for every module. */
+
+typedef unsigned (*ROUTE_MATCH)(void *context, TNC_UInt32 id, TNC_VendorID vendorID, TNC_MessageSubtype subtype);
+
+typedef struct ROUTE_ENTRY_tag
+{
+    unsigned long long key;
+    unsigned first;     /* index in ROUTE_TABLE.ids of the first subscriber */
+    unsigned count;     /* number of subscribers */
+} ROUTE_ENTRY;
+
+typedef struct ROUTE_TABLE_tag
+{
+    struct ROUTE_TABLE_tag *next;   /* for use by the owner, e.g. to retire old tables */
+    ROUTE_ENTRY *entries;
+    unsigned size;                  /* number of entries, always a power of two */
+    TNC_UInt32 *ids;
+    unsigned nIds;
+} ROUTE_TABLE;
+
+/* Build a new table for modules 0 to nModules-1. Returns NULL if out of memory */
+ROUTE_TABLE* RouteTableBuild(TYPE_INDEX * const *indexes, unsigned nIndexes,
+                             unsigned nModules, ROUTE_MATCH match, void *context);
+
+/* Return the number of modules that receive a message of this type and point
+   *ids at their IDs. 'buffer' must have room for nModules IDs; it is used for
+   types that are not in the table. 'table' may be NULL. */
+unsigned RouteTableLookup(const ROUTE_TABLE *table, TNC_VendorID vendorID, TNC_MessageSubtype subtype,
+                          unsigned nModules, ROUTE_MATCH match, void *context,
+                          TNC_UInt32 *buffer, const TNC_UInt32 **ids);
+
+void RouteTableFree(ROUTE_TABLE *table);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif